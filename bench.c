@@ -0,0 +1,935 @@
+
+/* SSDV - Slow Scan Digital Video                                        */
+/*=======================================================================*/
+/* Copyright 2011-2016 Philip Heron <phil@sanslogic.co.uk>               */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Throughput of the encoder and decoder, over a set of baseline JPEGs
+ * made here so the results don't depend on any files, and the cost of
+ * checking packets with different numbers of byte errors. The results
+ * are written to stdout as JSON */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include "ssdv.h"
+
+/* Quality of the JPEGs made for the benchmark, as used by libjpeg */
+#define BENCH_JPEG_QUALITY (85)
+
+/* Space for the decoded JPEG, beyond four times the size of the original.
+ * At quality 7 it can be more than twice as big */
+#define BENCH_DEC_SLACK (64 * 1024)
+
+/* Different damaged copies of the packets checked in turn, and the
+ * most checks timed for each number of errors */
+#define BENCH_WINDOWS (1024)
+#define BENCH_SAMPLES (1 << 20)
+
+typedef struct
+{
+	uint16_t width;
+	uint16_t height;
+	uint8_t  mcu_mode;
+	uint8_t  dri;       /* Restart interval in rows of MCUs, 0 = none   */
+	int8_t   quality;   /* SSDV quality level                           */
+} bench_case_t;
+
+/* A set of packets to check, with this many bytes damaged in each.
+ * Reed-Solomon corrects up to 16, anything more has to be rejected */
+typedef struct
+{
+	const char *name;
+	uint8_t type;       /* Packet type, or SSDV_TYPE_INVALID for noise  */
+	int errors;
+} bench_check_t;
+
+typedef struct
+{
+	uint8_t *data;
+	size_t len;
+	size_t size;
+	uint32_t bits;
+	uint8_t bitlen;
+} bench_jpeg_t;
+
+typedef struct
+{
+	uint32_t runs;
+	double seconds;
+	double bytes;       /* JPEG bytes read or written by one run        */
+	double packets;     /* Packets written or read by one run           */
+} bench_result_t;
+
+/* Zig-zag order of the coefficients in a block */
+static const uint8_t zigzag[64] = {
+	 0,  1,  8, 16,  9,  2,  3, 10,
+	17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34,
+	27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36,
+	29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46,
+	53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+/* The example tables from the JPEG standard, in zig-zag order */
+static const uint8_t std_dqt[2][64] = {
+	{
+	16, 11, 12, 14, 12, 10, 16, 14, 13, 14, 18, 17, 16, 19, 24, 40,
+	26, 24, 22, 22, 24, 49, 35, 37, 29, 40, 58, 51, 61, 60, 57, 51,
+	56, 55, 64, 72, 92, 78, 64, 68, 87, 69, 55, 56, 80,109, 81, 87,
+	95, 98,103,104,103, 62, 77,113,121,112,100,120, 92,101,103, 99,
+	},
+	{
+	17, 18, 18, 24, 21, 24, 47, 26, 26, 47, 99, 66, 56, 66, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+	},
+};
+
+/* The huffman tables as written in a DHT: the class and ID, the number
+ * of codes of each length, then the symbols */
+static const uint8_t std_dht[4][179] = {
+	{
+	0x00,0x00,0x01,0x05,0x01,0x01,0x01,0x01,0x01,0x01,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,0x08,0x09,0x0A,0x0B,
+	},
+	{
+	0x01,0x00,0x03,0x01,0x01,0x01,0x01,0x01,0x01,0x01,0x01,0x01,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,0x08,0x09,0x0A,0x0B,
+	},
+	{
+	0x10,0x00,0x02,0x01,0x03,0x03,0x02,0x04,0x03,0x05,0x05,0x04,0x04,0x00,0x00,0x01,
+	0x7D,0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,0x13,0x51,0x61,
+	0x07,0x22,0x71,0x14,0x32,0x81,0x91,0xA1,0x08,0x23,0x42,0xB1,0xC1,0x15,0x52,0xD1,
+	0xF0,0x24,0x33,0x62,0x72,0x82,0x09,0x0A,0x16,0x17,0x18,0x19,0x1A,0x25,0x26,0x27,
+	0x28,0x29,0x2A,0x34,0x35,0x36,0x37,0x38,0x39,0x3A,0x43,0x44,0x45,0x46,0x47,0x48,
+	0x49,0x4A,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5A,0x63,0x64,0x65,0x66,0x67,0x68,
+	0x69,0x6A,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7A,0x83,0x84,0x85,0x86,0x87,0x88,
+	0x89,0x8A,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9A,0xA2,0xA3,0xA4,0xA5,0xA6,
+	0xA7,0xA8,0xA9,0xAA,0xB2,0xB3,0xB4,0xB5,0xB6,0xB7,0xB8,0xB9,0xBA,0xC2,0xC3,0xC4,
+	0xC5,0xC6,0xC7,0xC8,0xC9,0xCA,0xD2,0xD3,0xD4,0xD5,0xD6,0xD7,0xD8,0xD9,0xDA,0xE1,
+	0xE2,0xE3,0xE4,0xE5,0xE6,0xE7,0xE8,0xE9,0xEA,0xF1,0xF2,0xF3,0xF4,0xF5,0xF6,0xF7,
+	0xF8,0xF9,0xFA,
+	},
+	{
+	0x11,0x00,0x02,0x01,0x02,0x04,0x04,0x03,0x04,0x07,0x05,0x04,0x04,0x00,0x01,0x02,
+	0x77,0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,0x51,0x07,0x61,
+	0x71,0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,0xA1,0xB1,0xC1,0x09,0x23,0x33,0x52,
+	0xF0,0x15,0x62,0x72,0xD1,0x0A,0x16,0x24,0x34,0xE1,0x25,0xF1,0x17,0x18,0x19,0x1A,
+	0x26,0x27,0x28,0x29,0x2A,0x35,0x36,0x37,0x38,0x39,0x3A,0x43,0x44,0x45,0x46,0x47,
+	0x48,0x49,0x4A,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5A,0x63,0x64,0x65,0x66,0x67,
+	0x68,0x69,0x6A,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7A,0x82,0x83,0x84,0x85,0x86,
+	0x87,0x88,0x89,0x8A,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9A,0xA2,0xA3,0xA4,
+	0xA5,0xA6,0xA7,0xA8,0xA9,0xAA,0xB2,0xB3,0xB4,0xB5,0xB6,0xB7,0xB8,0xB9,0xBA,0xC2,
+	0xC3,0xC4,0xC5,0xC6,0xC7,0xC8,0xC9,0xCA,0xD2,0xD3,0xD4,0xD5,0xD6,0xD7,0xD8,0xD9,
+	0xDA,0xE2,0xE3,0xE4,0xE5,0xE6,0xE7,0xE8,0xE9,0xEA,0xF2,0xF3,0xF4,0xF5,0xF6,0xF7,
+	0xF8,0xF9,0xFA,
+	},
+};
+
+/* Code and length of each symbol, for each table */
+static uint16_t huff_code[4][256];
+static uint8_t huff_len[4][256];
+
+static const char *sampling[4] = { "2x2", "1x2", "2x1", "1x1" };
+
+static const bench_check_t checks[] = {
+	{ "normal",  SSDV_TYPE_NORMAL,  0 },
+	{ "normal",  SSDV_TYPE_NORMAL,  1 },
+	{ "normal",  SSDV_TYPE_NORMAL,  8 },
+	{ "normal",  SSDV_TYPE_NORMAL, 16 },
+	{ "normal",  SSDV_TYPE_NORMAL, 17 },
+	{ "normal",  SSDV_TYPE_NORMAL, 32 },
+	{ "nofec",   SSDV_TYPE_NOFEC,   0 },
+	{ "nofec",   SSDV_TYPE_NOFEC,   1 },
+	{ "noise",   SSDV_TYPE_INVALID, 0 },
+};
+
+/* stderr, while it is silenced for the timed runs */
+static int saved_stderr = -1;
+
+/*****************************************************************************/
+
+static void exit_usage()
+{
+	fprintf(stderr,
+		"Usage: ssdv-bench [-t <seconds>] [codec] [packets]\n"
+		"\n"
+		"  -t Minimum time to spend on each measurement (defaults to 0.2).\n"
+		"\n"
+		"  codec   Time the encoder and decoder.\n"
+		"  packets Time ssdv_dec_is_packet() with 0 to 32 byte errors in each packet.\n"
+		"\n"
+		"Both are run if neither is given.\n"
+		"\n");
+	exit(-1);
+}
+
+static uint64_t bench_ns(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static double bench_now(void)
+{
+	return(bench_ns() * 1e-9);
+}
+
+static uint32_t bench_random(uint32_t *seed)
+{
+	/* xorshift */
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return(*seed);
+}
+
+/* The encoder and decoder describe each image on stderr */
+static void bench_quiet(char quiet)
+{
+	int null;
+	
+	fflush(stderr);
+	
+	if(quiet)
+	{
+		saved_stderr = dup(2);
+		null = open("/dev/null", O_WRONLY);
+		dup2(null, 2);
+		close(null);
+	}
+	else if(saved_stderr >= 0)
+	{
+		dup2(saved_stderr, 2);
+		close(saved_stderr);
+		saved_stderr = -1;
+	}
+}
+
+/*****************************************************************************/
+
+static void bench_build_huffman(void)
+{
+	const uint8_t *t;
+	uint16_t code;
+	int i, l, n, k;
+	
+	for(i = 0; i < 4; i++)
+	{
+		/* Codes of each length count up from where the last length ended */
+		t = std_dht[i];
+		for(code = 0, k = 17, l = 1; l <= 16; l++, code <<= 1)
+		{
+			for(n = 0; n < t[l]; n++, k++, code++)
+			{
+				huff_code[i][t[k]] = code;
+				huff_len[i][t[k]] = l;
+			}
+		}
+	}
+}
+
+static void bench_putbyte(bench_jpeg_t *j, uint8_t b)
+{
+	if(j->len == j->size)
+	{
+		j->size = j->size ? j->size * 2 : 65536;
+		j->data = realloc(j->data, j->size);
+		if(!j->data)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(-1);
+		}
+	}
+	
+	j->data[j->len++] = b;
+}
+
+static void bench_putbits(bench_jpeg_t *j, uint32_t bits, uint8_t length)
+{
+	uint8_t b;
+	
+	j->bits = (j->bits << length) | (bits & ((1 << length) - 1));
+	j->bitlen += length;
+	
+	while(j->bitlen >= 8)
+	{
+		b = j->bits >> (j->bitlen - 8);
+		j->bitlen -= 8;
+		
+		bench_putbyte(j, b);
+		if(b == 0xFF) bench_putbyte(j, 0x00);
+	}
+}
+
+/* Pad the last byte of the scan with 1s */
+static void bench_flushbits(bench_jpeg_t *j)
+{
+	if(j->bitlen > 0) bench_putbits(j, 0x7F, 8 - j->bitlen);
+	j->bits = 0;
+}
+
+static void bench_marker(bench_jpeg_t *j, uint8_t id, const uint8_t *data, uint16_t length)
+{
+	bench_putbyte(j, 0xFF);
+	bench_putbyte(j, id);
+	if(!data) return;
+	
+	bench_putbyte(j, (length + 2) >> 8);
+	bench_putbyte(j, (length + 2) & 0xFF);
+	while(length--) bench_putbyte(j, *(data++));
+}
+
+static void bench_symbol(bench_jpeg_t *j, int table, uint8_t rle, int value)
+{
+	int v = value < 0 ? -value : value, n = 0;
+	
+	while(v) n++, v >>= 1;
+	
+	bench_putbits(j, huff_code[table][(rle << 4) | n], huff_len[table][(rle << 4) | n]);
+	if(n) bench_putbits(j, value < 0 ? value + (1 << n) - 1 : value, n);
+}
+
+/* A made up scene with some of everything: smooth gradients,
+ * hard edges and fine noisy detail */
+static void bench_scene(uint8_t *ycc, int width, int height)
+{
+	uint32_t seed = 0x12345678;
+	double fx, fy, v;
+	int x, y, n;
+	
+	for(y = 0; y < height; y++)
+	{
+		for(x = 0; x < width; x++)
+		{
+			fx = (double) x / width;
+			fy = (double) y / height;
+			
+			n = (int) (bench_random(&seed) & 0x1F) - 16;
+			
+			v = 128 + 60 * sin(fx * 19) * cos(fy * 13) + n;
+			if(((x / 48) + (y / 40)) % 5 == 0) v += 50;
+			if(fx > 0.6 && fy > 0.6) v = 128 + n * 2;
+			
+			ycc[((size_t) y * width + x) * 3 + 0] = v < 0 ? 0 : (v > 255 ? 255 : v);
+			ycc[((size_t) y * width + x) * 3 + 1] = 128 + 50 * cos(fx * 7 + fy * 3);
+			ycc[((size_t) y * width + x) * 3 + 2] = 128 + 50 * sin(fy * 5 - fx * 2);
+		}
+	}
+}
+
+/* The average of a component over a block, scaled down 'sx' x 'sy' times,
+ * then run through the DCT and quantised. Returned in zig-zag order */
+static void bench_block(const uint8_t *ycc, int width, int c, int bx, int by, int sx, int sy, const uint8_t *dqt, int *out)
+{
+	static double cosine[8][8];
+	double in[64], tmp[64], sum;
+	int x, y, u, v, i, k;
+	
+	if(cosine[0][0] == 0)
+	{
+		for(u = 0; u < 8; u++)
+			for(x = 0; x < 8; x++)
+				cosine[u][x] = (u == 0 ? sqrt(0.125) : 0.5) * cos((2 * x + 1) * u * M_PI / 16);
+	}
+	
+	for(y = 0; y < 8; y++)
+	{
+		for(x = 0; x < 8; x++)
+		{
+			for(sum = 0, v = 0; v < sy; v++)
+				for(u = 0; u < sx; u++)
+					sum += ycc[((size_t) (by + y * sy + v) * width + bx + x * sx + u) * 3 + c];
+			in[y * 8 + x] = sum / (sx * sy) - 128;
+		}
+	}
+	
+	/* Along the rows, then down the columns */
+	for(y = 0; y < 8; y++)
+		for(u = 0; u < 8; u++)
+		{
+			for(sum = 0, x = 0; x < 8; x++) sum += cosine[u][x] * in[y * 8 + x];
+			tmp[y * 8 + u] = sum;
+		}
+	
+	for(k = 0; k < 64; k++)
+	{
+		i = zigzag[k];
+		u = i & 7;
+		v = i >> 3;
+		
+		for(sum = 0, y = 0; y < 8; y++) sum += cosine[v][y] * tmp[y * 8 + u];
+		out[k] = (int) lround(sum / dqt[k]);
+	}
+}
+
+static void bench_make_jpeg(bench_jpeg_t *j, const bench_case_t *bc)
+{
+	static const uint8_t factors[4] = { 0x22, 0x12, 0x21, 0x11 };
+	uint8_t dqt[2][65], b[32], *ycc;
+	int mw, mh, sx, sy, mx, my, across, dri, mcu;
+	int c, p, parts, k, run, pred[3], block[64], q, t;
+	
+	mw = factors[bc->mcu_mode] >> 4;
+	mh = factors[bc->mcu_mode] & 0x0F;
+	parts = mw * mh + 2;
+	across = bc->width / (mw * 8);
+	dri = bc->dri * across;
+	
+	ycc = malloc((size_t) bc->width * bc->height * 3);
+	if(!ycc)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(-1);
+	}
+	bench_scene(ycc, bc->width, bc->height);
+	
+	/* Scale the tables the same way as libjpeg */
+	q = BENCH_JPEG_QUALITY < 50 ? 5000 / BENCH_JPEG_QUALITY : 200 - BENCH_JPEG_QUALITY * 2;
+	for(t = 0; t < 2; t++)
+	{
+		dqt[t][0] = t;
+		for(k = 0; k < 64; k++)
+		{
+			c = (std_dqt[t][k] * q + 50) / 100;
+			dqt[t][1 + k] = c < 1 ? 1 : (c > 255 ? 255 : c);
+		}
+	}
+	
+	memset(j, 0, sizeof(bench_jpeg_t));
+	
+	bench_marker(j, 0xD8, NULL, 0); /* SOI */
+	bench_marker(j, 0xE0, (const uint8_t *) "JFIF\0\1\1\0\0\1\0\1\0\0", 14);
+	bench_marker(j, 0xDB, dqt[0], 65);
+	bench_marker(j, 0xDB, dqt[1], 65);
+	
+	b[0] = 8;
+	b[1] = bc->height >> 8;
+	b[2] = bc->height & 0xFF;
+	b[3] = bc->width >> 8;
+	b[4] = bc->width & 0xFF;
+	b[5] = 3;
+	b[6] = 1; b[7] = factors[bc->mcu_mode]; b[8] = 0;
+	b[9] = 2; b[10] = 0x11; b[11] = 1;
+	b[12] = 3; b[13] = 0x11; b[14] = 1;
+	bench_marker(j, 0xC0, b, 15);
+	
+	bench_marker(j, 0xC4, std_dht[0], 29);
+	bench_marker(j, 0xC4, std_dht[2], 179);
+	bench_marker(j, 0xC4, std_dht[1], 29);
+	bench_marker(j, 0xC4, std_dht[3], 179);
+	
+	if(dri)
+	{
+		b[0] = dri >> 8;
+		b[1] = dri & 0xFF;
+		bench_marker(j, 0xDD, b, 2);
+	}
+	
+	b[0] = 3;
+	b[1] = 1; b[2] = 0x00;
+	b[3] = 2; b[4] = 0x11;
+	b[5] = 3; b[6] = 0x11;
+	b[7] = 0; b[8] = 63; b[9] = 0;
+	bench_marker(j, 0xDA, b, 10);
+	
+	memset(pred, 0, sizeof(pred));
+	
+	for(mcu = 0; mcu < across * (bc->height / (mh * 8)); mcu++)
+	{
+		/* A restart marker, and the DC starts again */
+		if(dri && mcu > 0 && mcu % dri == 0)
+		{
+			bench_flushbits(j);
+			bench_marker(j, 0xD0 + (mcu / dri - 1) % 8, NULL, 0);
+			memset(pred, 0, sizeof(pred));
+		}
+		
+		mx = (mcu % across) * mw * 8;
+		my = (mcu / across) * mh * 8;
+		
+		for(p = 0; p < parts; p++)
+		{
+			if(p < parts - 2)
+			{
+				c = 0;
+				bench_block(ycc, bc->width, 0, mx + (p % mw) * 8, my + (p / mw) * 8, 1, 1, dqt[0] + 1, block);
+			}
+			else
+			{
+				c = p - parts + 3;
+				sx = mw;
+				sy = mh;
+				bench_block(ycc, bc->width, c, mx, my, sx, sy, dqt[1] + 1, block);
+			}
+			
+			t = c ? 1 : 0;
+			bench_symbol(j, t, 0, block[0] - pred[c]);
+			pred[c] = block[0];
+			
+			for(run = 0, k = 1; k < 64; k++)
+			{
+				if(block[k] == 0)
+				{
+					run++;
+					continue;
+				}
+				
+				while(run >= 16)
+				{
+					bench_symbol(j, 2 + t, 15, 0);
+					run -= 16;
+				}
+				
+				bench_symbol(j, 2 + t, run, block[k]);
+				run = 0;
+			}
+			
+			if(run > 0) bench_symbol(j, 2 + t, 0, 0);
+		}
+	}
+	
+	bench_flushbits(j);
+	bench_marker(j, 0xD9, NULL, 0); /* EOI */
+	
+	free(ycc);
+}
+
+/*****************************************************************************/
+
+static char bench_encode(const bench_jpeg_t *j, uint8_t type, int8_t quality, char layered, uint8_t **packets, uint32_t *count)
+{
+	uint8_t pkt[SSDV_PKT_SIZE], *p;
+	ssdv_t ssdv;
+	char c;
+	
+	ssdv_enc_init(&ssdv, type, "BENCH", 0, quality);
+	ssdv_enc_set_layered(&ssdv, layered);
+	ssdv_enc_set_buffer(&ssdv, pkt);
+	ssdv_enc_feed(&ssdv, j->data, j->len);
+	
+	*count = 0;
+	while((c = ssdv_enc_get_packet(&ssdv)) == SSDV_OK)
+	{
+		if(!packets)
+		{
+			(*count)++;
+			continue;
+		}
+		
+		/* Keep the packets for the decoder */
+		p = realloc(*packets, SSDV_PKT_SIZE * (*count + 1));
+		if(!p) return(SSDV_ERROR);
+		
+		*packets = p;
+		memcpy(&p[SSDV_PKT_SIZE * (*count)++], pkt, SSDV_PKT_SIZE);
+	}
+	
+	return(c == SSDV_EOI ? SSDV_OK : SSDV_ERROR);
+}
+
+static char bench_decode(uint8_t *packets, uint32_t count, uint8_t *out, size_t size, size_t *length)
+{
+	uint8_t *jpeg;
+	ssdv_t ssdv;
+	uint32_t i;
+	
+	ssdv_dec_init(&ssdv);
+	ssdv_dec_set_buffer(&ssdv, out, size);
+	
+	for(i = 0; i < count; i++)
+		ssdv_dec_feed(&ssdv, &packets[SSDV_PKT_SIZE * i]);
+	
+	return(ssdv_dec_get_jpeg(&ssdv, &jpeg, length));
+}
+
+static void bench_print(const char *name, const bench_result_t *r, char last)
+{
+	double per_run = r->seconds / r->runs;
+	
+	printf("      \"%s\": { \"runs\": %u, \"seconds\": %.6f, \"mb_per_s\": %.3f, \"packets_per_s\": %.1f }%s\n",
+		name, r->runs, r->seconds,
+		r->bytes / per_run / 1e6,
+		r->packets / per_run,
+		last ? "" : ",");
+}
+
+static char bench_run(const bench_case_t *bc, double min_time, char first)
+{
+	bench_jpeg_t j;
+	bench_result_t enc, dec;
+	uint8_t *packets = NULL, *out;
+	uint32_t count, n;
+	size_t size, length = 0;
+	double start;
+	char r = SSDV_ERROR;
+	
+	bench_make_jpeg(&j, bc);
+	
+	size = j.len * 4 + BENCH_DEC_SLACK;
+	out = malloc(size);
+	if(!out) goto done;
+	
+	memset(&enc, 0, sizeof(enc));
+	memset(&dec, 0, sizeof(dec));
+	
+	bench_quiet(1);
+	
+	/* Once to keep the packets, then timed */
+	if(bench_encode(&j, SSDV_TYPE_NORMAL, bc->quality, 0, &packets, &count) != SSDV_OK) goto done;
+	if(bench_decode(packets, count, out, size, &length) != SSDV_OK) goto done;
+	
+	start = bench_now();
+	do
+	{
+		if(bench_encode(&j, SSDV_TYPE_NORMAL, bc->quality, 0, NULL, &n) != SSDV_OK) goto done;
+		enc.runs++;
+	}
+	while((enc.seconds = bench_now() - start) < min_time);
+	
+	start = bench_now();
+	do
+	{
+		if(bench_decode(packets, count, out, size, &length) != SSDV_OK) goto done;
+		dec.runs++;
+	}
+	while((dec.seconds = bench_now() - start) < min_time);
+	
+	bench_quiet(0);
+	
+	enc.bytes = j.len;
+	enc.packets = count;
+	dec.bytes = length;
+	dec.packets = count;
+	
+	printf("%s    {\n", first ? "" : ",\n");
+	printf("      \"width\": %u, \"height\": %u, \"mcu_mode\": %u, \"sampling\": \"%s\",\n",
+		bc->width, bc->height, bc->mcu_mode, sampling[bc->mcu_mode]);
+	printf("      \"dri\": %u, \"quality\": %d, \"jpeg_bytes\": %zu, \"packets\": %u, \"decoded_bytes\": %zu,\n",
+		bc->dri * (bc->width / (bc->mcu_mode == 0 || bc->mcu_mode == 2 ? 16 : 8)),
+		bc->quality, j.len, count, length);
+	bench_print("encode", &enc, 0);
+	bench_print("decode", &dec, 1);
+	printf("    }");
+	fflush(stdout);
+	
+	r = SSDV_OK;
+
+done:
+	bench_quiet(0);
+	if(r != SSDV_OK)
+		fprintf(stderr, "Failed on the %ux%u %s image at quality %d\n",
+			bc->width, bc->height, sampling[bc->mcu_mode], bc->quality);
+	
+	free(packets);
+	free(out);
+	free(j.data);
+	
+	return(r);
+}
+
+/* A recording can hold more than one image. Decode a layered image
+ * followed by a tiled one: the tiled image's packets are no part of the
+ * first and have to be skipped, leaving the same JPEG as the layered
+ * image's packets alone */
+static char bench_recording(void)
+{
+	static const bench_case_t images[2] = { { 320, 240, 0, 0, 4 }, { 4160, 32, 0, 0, 4 } };
+	uint8_t *packets[2] = { NULL, NULL }, *out[2] = { NULL, NULL }, *p;
+	uint32_t count[2];
+	size_t size, length[2];
+	bench_jpeg_t j[2];
+	char r = SSDV_ERROR;
+	
+	bench_make_jpeg(&j[0], &images[0]);
+	bench_make_jpeg(&j[1], &images[1]);
+	
+	size = j[0].len * 4 + BENCH_DEC_SLACK;
+	out[0] = malloc(size);
+	out[1] = malloc(size);
+	if(!out[0] || !out[1]) goto done;
+	
+	bench_quiet(1);
+	if(bench_encode(&j[0], SSDV_TYPE_NORMAL, images[0].quality, 1, &packets[0], &count[0]) != SSDV_OK ||
+	   bench_encode(&j[1], SSDV_TYPE_NORMAL, images[1].quality, 0, &packets[1], &count[1]) != SSDV_OK) goto done;
+	
+	/* The recording is the two one after the other */
+	p = realloc(packets[0], SSDV_PKT_SIZE * (count[0] + count[1]));
+	if(!p) goto done;
+	packets[0] = p;
+	memcpy(&p[SSDV_PKT_SIZE * count[0]], packets[1], SSDV_PKT_SIZE * count[1]);
+	
+	if(bench_decode(packets[0], count[0], out[0], size, &length[0]) != SSDV_OK ||
+	   bench_decode(packets[0], count[0] + count[1], out[1], size, &length[1]) != SSDV_OK) goto done;
+	
+	if(length[0] == length[1] && !memcmp(out[0], out[1], length[0])) r = SSDV_OK;
+	
+done:
+	bench_quiet(0);
+	if(r != SSDV_OK)
+		fprintf(stderr, "Failed to decode a layered image followed by a tiled one\n");
+	
+	free(packets[0]);
+	free(packets[1]);
+	free(out[0]);
+	free(out[1]);
+	free(j[0].data);
+	free(j[1].data);
+	
+	return(r);
+}
+
+static int bench_cmp_ns(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+	
+	return(x < y ? -1 : (x > y ? 1 : 0));
+}
+
+/* Make damaged copies of the packets, each with 'errors' different bytes
+ * changed. Noise is random bytes after the sync byte */
+static void bench_damage(uint8_t *windows, const uint8_t *packets, uint32_t count, const bench_check_t *bc)
+{
+	uint32_t seed = 0x9E3779B9 + bc->errors;
+	uint8_t *w, hit[SSDV_PKT_SIZE];
+	int i, k, e;
+	
+	for(i = 0; i < BENCH_WINDOWS; i++)
+	{
+		w = &windows[i * SSDV_PKT_SIZE];
+		
+		if(bc->type == SSDV_TYPE_INVALID)
+		{
+			for(k = 1; k < SSDV_PKT_SIZE; k++) w[k] = bench_random(&seed);
+			w[0] = 0x55;
+			continue;
+		}
+		
+		memcpy(w, &packets[(i % count) * SSDV_PKT_SIZE], SSDV_PKT_SIZE);
+		memset(hit, 0, sizeof(hit));
+		
+		/* The sync byte isn't checked, so it isn't damaged */
+		for(e = 0; e < bc->errors; e++)
+		{
+			do k = 1 + bench_random(&seed) % (SSDV_PKT_SIZE - 1);
+			while(hit[k]);
+			
+			hit[k] = 1;
+			w[k] ^= 1 + bench_random(&seed) % 255;
+		}
+	}
+}
+
+static char bench_check(const bench_check_t *bc, const uint8_t *packets, uint32_t count, double min_time, char first)
+{
+	uint8_t pkt[SSDV_PKT_SIZE], *windows;
+	uint32_t *ns, n, valid = 0;
+	uint64_t start, t, total = 0, corrected = 0;
+	int i, errors;
+	
+	windows = malloc((size_t) BENCH_WINDOWS * SSDV_PKT_SIZE);
+	ns = malloc(sizeof(uint32_t) * BENCH_SAMPLES);
+	if(!windows || !ns)
+	{
+		fprintf(stderr, "Out of memory\n");
+		free(windows);
+		free(ns);
+		return(SSDV_ERROR);
+	}
+	
+	bench_damage(windows, packets, count, bc);
+	
+	/* Each check is timed on its own, for the spread of times as well as
+	 * the average. A good packet is written back corrected, so work on a copy */
+	start = bench_ns();
+	for(n = 0; n < BENCH_SAMPLES && (n < BENCH_WINDOWS || (bench_ns() - start) * 1e-9 < min_time); n++)
+	{
+		i = n % BENCH_WINDOWS;
+		memcpy(pkt, &windows[i * SSDV_PKT_SIZE], SSDV_PKT_SIZE);
+		
+		t = bench_ns();
+		if(ssdv_dec_is_packet(pkt, &errors) == 0)
+		{
+			valid++;
+			corrected += errors;
+		}
+		ns[n] = bench_ns() - t;
+		total += ns[n];
+	}
+	
+	qsort(ns, n, sizeof(uint32_t), bench_cmp_ns);
+	
+	printf("%s    {\n", first ? "" : ",\n");
+	printf("      \"packets\": \"%s\", \"byte_errors\": %d, \"checks\": %u, \"valid\": %.4f, \"corrected\": %.2f,\n",
+		bc->name, bc->errors, n, (double) valid / n, valid ? (double) corrected / valid : 0.0);
+	printf("      \"checks_per_s\": %.1f,\n", n / (total * 1e-9));
+	printf("      \"latency_ns\": { \"min\": %u, \"p50\": %u, \"p90\": %u, \"p99\": %u, \"max\": %u, \"mean\": %.1f }\n",
+		ns[0], ns[n / 2], ns[(uint64_t) n * 90 / 100], ns[(uint64_t) n * 99 / 100], ns[n - 1], (double) total / n);
+	printf("    }");
+	fflush(stdout);
+	
+	free(windows);
+	free(ns);
+	
+	return(SSDV_OK);
+}
+
+static char bench_codec(double min_time)
+{
+	static const uint16_t sizes[3][2] = { { 320, 240 }, { 1024, 768 }, { 2048, 1536 } };
+	bench_case_t bc;
+	int i, m, d, q, first = 1;
+	
+	printf("  \"results\": [\n");
+	
+	/* Every size and sampling factor, with and without restart markers */
+	for(i = 0; i < 3; i++)
+	{
+		for(m = 0; m < 4; m++)
+		{
+			for(d = 0; d < 2; d++)
+			{
+				bc.width = sizes[i][0];
+				bc.height = sizes[i][1];
+				bc.mcu_mode = m;
+				bc.dri = d;
+				bc.quality = 4;
+				
+				if(bench_run(&bc, min_time, first) != SSDV_OK) return(SSDV_ERROR);
+				first = 0;
+			}
+		}
+	}
+	
+	/* And each quality level */
+	for(q = 0; q < 8; q++)
+	{
+		if(q == 4) continue;
+		
+		bc.width = 1024;
+		bc.height = 768;
+		bc.mcu_mode = 0;
+		bc.dri = 0;
+		bc.quality = q;
+		
+		if(bench_run(&bc, min_time, first) != SSDV_OK) return(SSDV_ERROR);
+	}
+	
+	printf("\n  ]");
+	
+	return(SSDV_OK);
+}
+
+static char bench_packets(double min_time)
+{
+	static const bench_case_t image = { 320, 240, 0, 0, 4 };
+	uint8_t *packets[2] = { NULL, NULL };
+	uint32_t count[2];
+	bench_jpeg_t j;
+	char r = SSDV_ERROR;
+	int i;
+	
+	/* Real packets of both types to damage */
+	bench_make_jpeg(&j, &image);
+	bench_quiet(1);
+	if(bench_encode(&j, SSDV_TYPE_NORMAL, image.quality, 0, &packets[0], &count[0]) != SSDV_OK ||
+	   bench_encode(&j, SSDV_TYPE_NOFEC, image.quality, 0, &packets[1], &count[1]) != SSDV_OK)
+	{
+		bench_quiet(0);
+		fprintf(stderr, "Failed to encode the packets to check\n");
+		goto done;
+	}
+	bench_quiet(0);
+	
+	printf("  \"validation\": [\n");
+	
+	for(i = 0; i < sizeof(checks) / sizeof(checks[0]); i++)
+	{
+		if(bench_check(&checks[i], packets[checks[i].type == SSDV_TYPE_NOFEC ? 1 : 0],
+		   count[checks[i].type == SSDV_TYPE_NOFEC ? 1 : 0], min_time, i == 0) != SSDV_OK) goto done;
+	}
+	
+	printf("\n  ]");
+	r = SSDV_OK;
+	
+done:
+	free(packets[0]);
+	free(packets[1]);
+	free(j.data);
+	
+	return(r);
+}
+
+int main(int argc, char *argv[])
+{
+	double min_time = 0.2;
+	char codec = 0, check = 0;
+	int c;
+	
+	while((c = getopt(argc, argv, "t:")) != -1)
+	{
+		switch(c)
+		{
+		case 't': min_time = atof(optarg); break;
+		default: exit_usage();
+		}
+	}
+	
+	if(min_time <= 0) exit_usage();
+	
+	for(; optind < argc; optind++)
+	{
+		if(!strcmp(argv[optind], "codec")) codec = 1;
+		else if(!strcmp(argv[optind], "packets")) check = 1;
+		else exit_usage();
+	}
+	
+	if(!codec && !check) codec = check = 1;
+	
+	bench_build_huffman();
+	
+	/* Not timed, but a decoder that gets it wrong isn't worth timing */
+	if(bench_recording() != SSDV_OK) return(-1);
+	
+	printf("{\n  \"benchmark\": \"ssdv\",\n  \"jpeg_quality\": %d,\n  \"min_time\": %.3f",
+		BENCH_JPEG_QUALITY, min_time);
+	
+	if(codec)
+	{
+		printf(",\n");
+		if(bench_codec(min_time) != SSDV_OK) return(-1);
+	}
+	
+	if(check)
+	{
+		printf(",\n");
+		if(bench_packets(min_time) != SSDV_OK) return(-1);
+	}
+	
+	printf("\n}\n");
+	
+	return(0);
+}
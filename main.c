@@ -21,32 +21,615 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "ssdv.h"
 
+#define MAX_RECEIVERS (16)
+
 void exit_usage()
 {
 	fprintf(stderr,
-		"Usage: ssdv [-e|-d] [-n] [-t <percentage>] [-c <callsign>] [-i <id>] [-q <level>] [<in file>] [<out file>]\n"
+		"Usage: ssdv [-e|-d] [-m|-l|-x <rgb|yuv>[8]] [-a <in file>]... [-n] [-h] [-y] [-s|-f <scale>] [-j <threads>] [-r <window>] [-t <percentage>] [-c <callsign>] [-i <id>] [-q <level>|-p <packets>] [-g <x>,<y>,<w>,<h>[,<level>]] [<in file>] [<out file>]\n"
+		"       ssdv -e -b [-j <threads>] [-o <out file>] [-n] [-h] [-y] [-s|-f <scale>] [-c <callsign>] [-i <id>] [-q <level>|-p <packets>] [-g <x>,<y>,<w>,<h>[,<level>]] <in file|dir>...\n"
 		"\n"
 		"  -e Encode JPEG to SSDV packets.\n"
 		"  -d Decode SSDV packets to JPEG.\n"
 		"\n"
+		"  -m Decode multiple images. Each image is written to <out file>-NNNN-<callsign>-<id>.jpeg,\n"
+		"     or one after another to stdout if no output file is given.\n"
+		"  -l Live decode. Rewrites <out file> with what has arrived so far after each packet,\n"
+		"     in any order, redoing only the part of the image the packet changes.\n"
+		"  -x Decode to raw pixels instead of a JPEG, three bytes each (rgb or yuv) row by row.\n"
+		"     rgb8 or yuv8 decode a 1/8 scale thumbnail, quickly, from the DC of each block.\n"
+		"  -a Also decode packets from this file, from another receiver of the same downlink.\n"
+		"     One copy of each packet is decoded, the one that needed the fewest corrections.\n"
 		"  -n Encode packets with no FEC.\n"
+		"  -h Encode with huffman tables made for the image, sent in an extra first packet.\n"
+		"  -y Encode in greyscale, dropping the colour.\n"
+		"  -s Encode in layers, sending a coarse copy of the whole image before the detail.\n"
+		"  -f Encode a thumbnail in place of the image, 1 to 3 for 1/8, 1/4 or 1/2 scale.\n"
+		"  -r Decode packets that arrive out of order, holding up to this many.\n"
 		"  -t For testing, drops the specified percentage of packets while decoding.\n"
 		"  -c Set the callign. Accepts A-Z 0-9 and space, up to 6 characters.\n"
 		"  -i Set the image ID (0-255).\n"
 		"  -q Set the JPEG quality level (0 to 7, defaults to 4).\n"
-		"  -v Print data for each packet decoded.\n"
+		"  -p Use the highest quality level that encodes to no more than this many packets.\n"
+		"  -g Keep the -q quality only inside this rectangle, in pixels. The rest of the image\n"
+		"     is sent at the lower quality level given after it, or 0.\n"
+		"  -v Print data for each packet decoded, and the profiling counters if built with SSDV_STATS.\n"
+		"\n"
+		"  -b Batch encode. Each JPEG file, or each .jpg/.jpeg in a directory, is given the\n"
+		"     next image ID starting from -i and written to a .bin file next to it.\n"
+		"  -o Write the batch as a single stream of packets, in input order, to this file.\n"
+		"  -j Number of encoder threads (defaults to the number of CPUs in batch mode). When\n"
+		"     encoding a single JPEG with restart markers, its intervals are transcoded in parallel.\n"
 		"\n");
 	exit(-1);
 }
 
+static uint8_t *read_file(FILE *f, size_t *length)
+{
+	uint8_t *data = NULL, *d;
+	size_t size = 0;
+	size_t r;
+	
+	/* Read the whole file into memory */
+	*length = 0;
+	do
+	{
+		if(*length == size)
+		{
+			size = size ? size * 2 : 65536;
+			d = realloc(data, size);
+			if(!d)
+			{
+				free(data);
+				return(NULL);
+			}
+			data = d;
+		}
+		
+		r = fread(data + *length, 1, size - *length, f);
+		*length += r;
+	}
+	while(r > 0);
+	
+	return(data);
+}
+
+static uint8_t *map_file(FILE *f, size_t *length)
+{
+	struct stat st;
+	void *m;
+	
+	/* Map a regular file straight into memory, the encoder
+	 * reads it in place and jumps over any unused markers */
+	if(fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+		return(NULL);
+	
+	m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+	if(m == MAP_FAILED) return(NULL);
+	
+	madvise(m, st.st_size, MADV_SEQUENTIAL);
+	*length = st.st_size;
+	
+	return(m);
+}
+
+static char dht_packets(char type, char *callsign, char grey, uint8_t *jpeg, size_t length, int8_t quality, uint32_t *count)
+{
+	ssdv_t ssdv;
+	uint32_t packets[8];
+	
+	/* Count one quality level with the tables -h makes for it, and their packet */
+	ssdv_enc_init(&ssdv, type, callsign, 0, quality);
+	ssdv_enc_set_grey(&ssdv, grey);
+	if(ssdv_enc_optimise_dht(&ssdv, jpeg, length) != SSDV_OK ||
+	   ssdv_enc_estimate(&ssdv, jpeg, length, packets) != SSDV_OK) return(SSDV_ERROR);
+	
+	*count = packets[quality];
+	
+	return(SSDV_OK);
+}
+
+static int8_t budget_quality(char type, char *callsign, char grey, char dht, uint8_t *jpeg, size_t length, int budget, int8_t quality)
+{
+	ssdv_t ssdv;
+	uint32_t packets[8];
+	int8_t q;
+	
+	/* Count the packets of every quality level in one pass, and take the best that fits */
+	ssdv_enc_init(&ssdv, type, callsign, 0, quality);
+	ssdv_enc_set_grey(&ssdv, grey);
+	if(ssdv_enc_estimate(&ssdv, jpeg, length, packets) != SSDV_OK)
+	{
+		fprintf(stderr, "Error estimating the packet count, using quality level %i\n", quality);
+		return(quality);
+	}
+	
+	/* The table packet of -h counts towards the budget */
+	for(q = 7; q > 0 && packets[q] + dht > (uint32_t) budget; q--);
+	packets[q] += dht;
+	
+	/* The tables -h makes shrink each level, often enough for a higher one to
+	 * fit. Count the level found with its own tables, then the ones above it */
+	if(dht && dht_packets(type, callsign, grey, jpeg, length, q, &packets[q]) == SSDV_OK)
+	{
+		while(q > 0 && packets[q] > (uint32_t) budget &&
+		      dht_packets(type, callsign, grey, jpeg, length, q - 1, &packets[q - 1]) == SSDV_OK) q--;
+		
+		while(q < 7 && packets[q] <= (uint32_t) budget &&
+		      dht_packets(type, callsign, grey, jpeg, length, q + 1, &packets[q + 1]) == SSDV_OK &&
+		      packets[q + 1] <= (uint32_t) budget) q++;
+	}
+	
+	if(packets[q] > (uint32_t) budget)
+		fprintf(stderr, "Warning: %u packets at quality level %i is over the budget of %i\n", packets[q], q, budget);
+	
+	fprintf(stderr, "Quality level %i: %u packets\n", q, packets[q]);
+	
+	return(q);
+}
+
+/* Only has anything to show when built with SSDV_STATS */
+static void print_stats(ssdv_t *s, ssdv_stats_t *checks)
+{
+	ssdv_stats_t st;
+	
+	if(ssdv_get_stats(s, &st) != SSDV_OK) return;
+	
+	fprintf(stderr, "Huffman lookups: %llu (%llu slow)\n", (unsigned long long) st.huff_lookups, (unsigned long long) st.huff_slow);
+	fprintf(stderr, "Bits in: %llu, out: %llu\n", (unsigned long long) st.bits_in, (unsigned long long) st.bits_out);
+	fprintf(stderr, "Stuffing bytes in: %llu, out: %llu\n", (unsigned long long) st.stuff_in, (unsigned long long) st.stuff_out);
+	fprintf(stderr, "MCUs filled in for gaps: %llu\n", (unsigned long long) st.gap_mcus);
+	fprintf(stderr, "Time per image: %.3f ms in packets, %.3f ms of it in the scan, %.3f ms finishing\n",
+		st.ns_packet / 1e6, st.ns_process / 1e6, st.ns_finish / 1e6);
+	
+	if(!checks || checks->checked == 0) return;
+	
+	fprintf(stderr, "Packets checked: %llu, accepted %llu (%llu corrected, %llu bytes)\n",
+		(unsigned long long) checks->checked, (unsigned long long) checks->accepted,
+		(unsigned long long) checks->rs_ok, (unsigned long long) checks->rs_corrected);
+	fprintf(stderr, "Packets rejected: %llu by RS, %llu by CRC, %llu by the header checks\n",
+		(unsigned long long) checks->rs_failed, (unsigned long long) checks->crc_failed, (unsigned long long) checks->invalid);
+	fprintf(stderr, "Time checking packets: %.3f ms\n", checks->ns_check / 1e6);
+}
+
+static void write_sink(void *arg, uint8_t *data, size_t length)
+{
+	fwrite(data, 1, length, (FILE *) arg);
+}
+
+static void write_pixels(void *arg, uint8_t *pixels, uint16_t width, uint16_t y, uint8_t rows)
+{
+	fwrite(pixels, 3, (size_t) width * rows, (FILE *) arg);
+}
+
+static void write_live(FILE *f, ssdv_live_t *l)
+{
+	uint8_t *jpeg;
+	size_t length;
+	
+	if(ssdv_live_get_jpeg(l, &jpeg, &length) != SSDV_OK) return;
+	
+	/* Replace the file's contents with the latest image */
+	rewind(f);
+	fwrite(jpeg, 1, length, f);
+	fflush(f);
+	if(ftruncate(fileno(f), length) != 0) perror("ftruncate");
+}
+
+static char read_packet(FILE *f, uint8_t *pkt, int *errors, int droptest, ssdv_stats_t *checks)
+{
+	while(fread(pkt, 1, SSDV_PKT_SIZE, f) > 0)
+	{
+		/* Drop % of packets */
+		if(droptest && (rand() / (RAND_MAX / 100) < droptest)) continue;
+		
+		/* Test the packet is valid */
+		if(ssdv_dec_check_packet(pkt, errors, checks) == 0) return(1);
+	}
+	
+	return(0);
+}
+
+static char packet_before(uint8_t *a, uint8_t *b)
+{
+	/* Order by image ID, allowing for it wrapping, then by packet ID */
+	int8_t d = a[6] - b[6];
+	
+	if(d != 0) return(d < 0);
+	return(((a[7] << 8) | a[8]) < ((b[7] << 8) | b[8]));
+}
+
+typedef struct {
+	ssdv_t *ssdv;
+	ssdv_demux_t *demux;
+	ssdv_live_t *live;
+	FILE *fout;
+	char rewrite;
+	char warned;        /* Warned that the image can't be shown live */
+} decode_out_t;
+
+static void decode_packet(void *arg, uint8_t *packet)
+{
+	decode_out_t *o = (decode_out_t *) arg;
+	ssdv_packet_info_t info;
+	char r;
+	
+	/* Feed it to the decoder */
+	if(o->demux) ssdv_demux_feed(o->demux, packet);
+	else if(!o->live) ssdv_dec_feed(o->ssdv, packet);
+	else if((r = ssdv_live_feed(o->live, packet)) == SSDV_OK && o->rewrite)
+		write_live(o->fout, o->live);
+	else if(r == SSDV_ERROR && !o->warned)
+	{
+		ssdv_dec_header(&info, packet);
+		if((o->warned = info.tiled || info.layered || info.roi))
+			fprintf(stderr, "Error: Tiled, layered or region of interest images can't be decoded with -l\n");
+	}
+}
+
+typedef struct {
+	char *prefix;
+	FILE *fout;
+	int count;
+} demux_out_t;
+
+static void demux_write_image(void *arg, ssdv_packet_info_t *info, uint8_t *jpeg, size_t length)
+{
+	demux_out_t *o = arg;
+	char filename[1024];
+	FILE *f = o->fout;
+	
+	if(o->prefix)
+	{
+		snprintf(filename, sizeof(filename), "%s-%04i-%s-%i%s.jpeg", o->prefix, o->count, info->callsign_s, info->image_id,
+			info->thumbnail ? "-thumb" : "");
+		f = fopen(filename, "wb");
+		if(!f)
+		{
+			fprintf(stderr, "Error opening '%s' for output:\n", filename);
+			perror("fopen");
+			return;
+		}
+	}
+	
+	fwrite(jpeg, 1, length, f);
+	if(f != o->fout) fclose(f);
+	
+	fprintf(stderr, "Image %i: Callsign: %s, Image ID: %d, Resolution: %dx%d, %i bytes\n",
+		o->count, info->callsign_s, info->image_id, info->image_width, info->image_height, (int) length);
+	
+	o->count++;
+}
+
+typedef struct {
+	char *filename;
+	char owned;         /* The filename was allocated for a directory entry */
+	uint8_t image_id;
+	uint8_t *packets;
+	int count;
+	char done;
+	char failed;
+} batch_job_t;
+
+typedef struct {
+	batch_job_t *jobs;
+	int jobs_len;
+	int next;
+	
+	/* Encoder settings shared by every job */
+	char type;
+	char *callsign;
+	int8_t quality;
+	int budget;         /* Packets per image, 0 to use the quality level */
+	int roi[5];         /* Region of interest and the level outside it,
+	                       if the width is not 0 */
+	char dht;           /* Optimise the huffman tables for each image    */
+	char layered;       /* Send each image in layers                     */
+	char grey;          /* Drop the colour                               */
+	uint8_t thumb;      /* Or a thumbnail at 1/8, 1/4 or 1/2 scale       */
+	
+	/* Single output stream, or NULL for one file per image */
+	FILE *fout;
+	
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} batch_t;
+
+static int batch_add(batch_t *b, char *filename, char owned)
+{
+	batch_job_t *jobs;
+	
+	jobs = realloc(b->jobs, sizeof(batch_job_t) * (b->jobs_len + 1));
+	if(!jobs)
+	{
+		fprintf(stderr, "Out of memory adding '%s'\n", filename);
+		if(owned) free(filename);
+		return(-1);
+	}
+	
+	b->jobs = jobs;
+	memset(&b->jobs[b->jobs_len], 0, sizeof(batch_job_t));
+	b->jobs[b->jobs_len].filename = filename;
+	b->jobs[b->jobs_len++].owned = owned;
+	
+	return(0);
+}
+
+static void batch_free(batch_t *b)
+{
+	int i;
+	
+	for(i = 0; i < b->jobs_len; i++)
+		if(b->jobs[i].owned) free(b->jobs[i].filename);
+	
+	free(b->jobs);
+	b->jobs = NULL;
+	b->jobs_len = 0;
+}
+
+static int batch_is_jpeg(const char *name)
+{
+	const char *ext = strrchr(name, '.');
+	
+	if(!ext) return(0);
+	if(strcasecmp(ext, ".jpg") == 0) return(1);
+	if(strcasecmp(ext, ".jpeg") == 0) return(1);
+	
+	return(0);
+}
+
+static int batch_strcmp(const void *a, const void *b)
+{
+	return(strcmp(*(char * const *) a, *(char * const *) b));
+}
+
+static int batch_add_path(batch_t *b, char *path)
+{
+	DIR *dir;
+	struct dirent *de;
+	char **names = NULL, **n;
+	int i, names_len = 0, r = 0;
+	
+	dir = opendir(path);
+	if(!dir) return(batch_add(b, path, 0));
+	
+	/* Collect the JPEG files, sorted so image IDs are assigned in a stable order */
+	while((de = readdir(dir)) != NULL)
+	{
+		if(de->d_name[0] == '.' || !batch_is_jpeg(de->d_name)) continue;
+		
+		n = realloc(names, sizeof(char *) * (names_len + 1));
+		if(!n) { r = -1; break; }
+		names = n;
+		
+		names[names_len] = malloc(strlen(path) + strlen(de->d_name) + 2);
+		if(!names[names_len]) { r = -1; break; }
+		sprintf(names[names_len++], "%s/%s", path, de->d_name);
+	}
+	
+	closedir(dir);
+	
+	if(r != 0) fprintf(stderr, "Out of memory reading directory '%s'\n", path);
+	
+	/* The jobs take ownership of the names, any left over are freed */
+	qsort(names, names_len, sizeof(char *), batch_strcmp);
+	for(i = 0; i < names_len; i++)
+	{
+		if(r == 0) r = batch_add(b, names[i], 1);
+		else free(names[i]);
+	}
+	free(names);
+	
+	return(r);
+}
+
+static int batch_encode(batch_t *b, batch_job_t *job)
+{
+	FILE *f;
+	uint8_t *jpeg, *packets, pkt[SSDV_PKT_SIZE];
+	size_t length;
+	ssdv_t ssdv;
+	char c, mapped;
+	int8_t quality = b->quality;
+	
+	/* Map the whole image, it is fed to the encoder in one go */
+	f = fopen(job->filename, "rb");
+	if(!f)
+	{
+		fprintf(stderr, "Error opening '%s' for input:\n", job->filename);
+		perror("fopen");
+		return(-1);
+	}
+	
+	jpeg = map_file(f, &length);
+	if(!(mapped = jpeg != NULL)) jpeg = read_file(f, &length);
+	fclose(f);
+	
+	if(!jpeg)
+	{
+		fprintf(stderr, "Error reading '%s'\n", job->filename);
+		return(-1);
+	}
+	
+	if(b->budget > 0) quality = budget_quality(b->type, b->callsign, b->grey, b->dht, jpeg, length, b->budget, quality);
+	
+	ssdv_enc_init(&ssdv, b->type, b->callsign, job->image_id, b->roi[2] ? b->roi[4] : quality);
+	if(b->roi[2]) ssdv_enc_set_roi(&ssdv, b->roi[0], b->roi[1], b->roi[2], b->roi[3], quality);
+	ssdv_enc_set_grey(&ssdv, b->grey);
+	ssdv_enc_set_layered(&ssdv, b->layered);
+	ssdv_enc_set_thumbnail(&ssdv, b->thumb);
+	if(b->dht && ssdv_enc_optimise_dht(&ssdv, jpeg, length) != SSDV_OK)
+		fprintf(stderr, "%s: Using the standard huffman tables\n", job->filename);
+	
+	ssdv_enc_set_buffer(&ssdv, pkt);
+	ssdv_enc_feed(&ssdv, jpeg, length);
+	
+	while((c = ssdv_enc_get_packet(&ssdv)) == SSDV_OK)
+	{
+		packets = realloc(job->packets, SSDV_PKT_SIZE * (job->count + 1));
+		if(!packets) break;
+		
+		job->packets = packets;
+		memcpy(&job->packets[SSDV_PKT_SIZE * job->count++], pkt, SSDV_PKT_SIZE);
+	}
+	
+	if(mapped) munmap(jpeg, length);
+	else free(jpeg);
+	
+	if(c != SSDV_EOI)
+	{
+		fprintf(stderr, "Error encoding '%s': %s\n", job->filename,
+			c == SSDV_FEED_ME ? "Premature end of file" :
+			c == SSDV_OK ? "Out of memory" : "ssdv_enc_get_packet failed");
+		return(-1);
+	}
+	
+	return(0);
+}
+
+static int batch_write(batch_job_t *job)
+{
+	char filename[1024], *ext;
+	FILE *f;
+	
+	/* Replace the .jpg/.jpeg extension with .bin */
+	snprintf(filename, sizeof(filename) - 4, "%s", job->filename);
+	ext = strrchr(filename, '.');
+	if(ext && !strchr(ext, '/')) *ext = '\0';
+	strcat(filename, ".bin");
+	
+	f = fopen(filename, "wb");
+	if(!f)
+	{
+		fprintf(stderr, "Error opening '%s' for output:\n", filename);
+		perror("fopen");
+		return(-1);
+	}
+	
+	fwrite(job->packets, SSDV_PKT_SIZE, job->count, f);
+	fclose(f);
+	
+	return(0);
+}
+
+static void *batch_worker(void *arg)
+{
+	batch_t *b = arg;
+	batch_job_t *job;
+	
+	while(1)
+	{
+		pthread_mutex_lock(&b->lock);
+		job = b->next < b->jobs_len ? &b->jobs[b->next++] : NULL;
+		pthread_mutex_unlock(&b->lock);
+		
+		if(!job) break;
+		
+		/* Each job has its own ssdv_t, the encoder shares no state */
+		if(batch_encode(b, job) != 0) job->failed = 1;
+		else if(!b->fout && batch_write(job) != 0) job->failed = 1;
+		
+		/* Nothing is written for an image that failed */
+		if(job->failed || !b->fout)
+		{
+			free(job->packets);
+			job->packets = NULL;
+		}
+		
+		pthread_mutex_lock(&b->lock);
+		job->done = 1;
+		pthread_cond_broadcast(&b->cond);
+		pthread_mutex_unlock(&b->lock);
+	}
+	
+	return(NULL);
+}
+
+static int batch_run(batch_t *b, int threads)
+{
+	pthread_t *t;
+	int i, packets = 0, failed = 0;
+	
+	if(threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(threads > b->jobs_len) threads = b->jobs_len;
+	if(threads <= 0) threads = 1;
+	
+	t = malloc(sizeof(pthread_t) * threads);
+	if(!t) return(-1);
+	
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_cond_init(&b->cond, NULL);
+	
+	for(i = 0; i < threads; i++)
+		pthread_create(&t[i], NULL, batch_worker, b);
+	
+	/* Write the images out in input order as they complete */
+	for(i = 0; i < b->jobs_len; i++)
+	{
+		batch_job_t *job = &b->jobs[i];
+		
+		pthread_mutex_lock(&b->lock);
+		while(!job->done) pthread_cond_wait(&b->cond, &b->lock);
+		pthread_mutex_unlock(&b->lock);
+		
+		if(job->failed)
+		{
+			failed++;
+			continue;
+		}
+		
+		if(b->fout) fwrite(job->packets, SSDV_PKT_SIZE, job->count, b->fout);
+		free(job->packets);
+		job->packets = NULL;
+		
+		fprintf(stderr, "%s: Image ID %i, %i packets\n", job->filename, job->image_id, job->count);
+		packets += job->count;
+	}
+	
+	for(i = 0; i < threads; i++)
+		pthread_join(t[i], NULL);
+	
+	pthread_cond_destroy(&b->cond);
+	pthread_mutex_destroy(&b->lock);
+	free(t);
+	
+	fprintf(stderr, "Wrote %i packets for %i images\n", packets, b->jobs_len - failed);
+	if(failed) fprintf(stderr, "%i images failed\n", failed);
+	
+	/* The number of images that failed */
+	return(failed);
+}
+
 int main(int argc, char *argv[])
 {
 	int c, i;
+	char mapped;
 	FILE *fin = stdin;
 	FILE *fout = stdout;
 	char encode = -1;
+	char multi = 0;
+	char live = 0;
+	char rewrite = 0;
+	int pixels = -1;
+	char *also[MAX_RECEIVERS - 1];
+	FILE *rx[MAX_RECEIVERS];
+	int receivers = 1;
+	uint8_t rx_pkt[MAX_RECEIVERS][SSDV_PKT_SIZE];
+	int rx_errors[MAX_RECEIVERS];
+	char rx_ok[MAX_RECEIVERS];
+	int n;
+	char batch = 0;
+	char *batch_out = NULL;
+	int threads = 0;
+	int reorder = 0;
+	uint8_t *reorder_buffer = NULL;
 	char type = SSDV_TYPE_NORMAL;
 	int droptest = 0;
 	int verbose = 0;
@@ -54,21 +637,61 @@ int main(int argc, char *argv[])
 	char callsign[7];
 	uint8_t image_id = 0;
 	int8_t quality = 4;
+	int budget = 0;
+	char dht = 0;
+	char layered = 0;
+	char grey = 0;
+	int thumb = 0;
+	int roi[5] = { 0, 0, 0, 0, 0 };
 	ssdv_t ssdv;
+	ssdv_demux_t demux;
+	ssdv_live_t ssdv_live;
+	ssdv_merge_t merge;
+	ssdv_stats_t checks;
+	decode_out_t decode_out = { &ssdv, NULL, NULL, NULL, 0 };
+	struct stat st;
+	demux_out_t demux_out = { NULL, stdout, 0 };
+	batch_t bt;
 	
 	uint8_t pkt[SSDV_PKT_SIZE], b[128], *jpeg;
 	size_t jpeg_length;
 	
 	callsign[0] = '\0';
+	memset(&checks, 0, sizeof(checks));
 	
 	opterr = 0;
-	while((c = getopt(argc, argv, "ednc:i:q:t:v")) != -1)
+	while((c = getopt(argc, argv, "edmlx:a:bo:j:r:nhysf:c:i:q:p:g:t:v")) != -1)
 	{
 		switch(c)
 		{
 		case 'e': encode = 1; break;
 		case 'd': encode = 0; break;
+		case 'm': multi = 1; break;
+		case 'l': live = 1; break;
+		case 'x':
+			if(!strcmp(optarg, "rgb")) pixels = SSDV_PIXELS_RGB;
+			else if(!strcmp(optarg, "yuv")) pixels = SSDV_PIXELS_YUV;
+			else if(!strcmp(optarg, "rgb8")) pixels = SSDV_PIXELS_RGB | SSDV_PIXELS_DC;
+			else if(!strcmp(optarg, "yuv8")) pixels = SSDV_PIXELS_YUV | SSDV_PIXELS_DC;
+			else exit_usage();
+			break;
+		case 'a':
+			if(receivers == MAX_RECEIVERS)
+			{
+				fprintf(stderr, "Too many receivers, up to %d can be merged\n", MAX_RECEIVERS);
+				return(-1);
+			}
+			also[receivers++ - 1] = optarg;
+			break;
+		case 'b': batch = 1; break;
+		case 'o': batch_out = optarg; break;
+		case 'j': threads = atoi(optarg); break;
+		case 'r': reorder = atoi(optarg); break;
 		case 'n': type = SSDV_TYPE_NOFEC; break;
+		case 'h': dht = 1; break;
+		case 'y': grey = 1; break;
+		case 's': layered = 1; break;
+		case 'f': thumb = atoi(optarg); break;
 		case 'c':
 			if(strlen(optarg) > 6)
 				fprintf(stderr, "Warning: callsign is longer than 6 characters.\n");
@@ -76,6 +699,11 @@ int main(int argc, char *argv[])
 			break;
 		case 'i': image_id = atoi(optarg); break;
 		case 'q': quality = atoi(optarg); break;
+		case 'p': budget = atoi(optarg); break;
+		case 'g':
+			if(sscanf(optarg, "%d,%d,%d,%d,%d", &roi[0], &roi[1], &roi[2], &roi[3], &roi[4]) < 4 ||
+			   roi[0] < 0 || roi[1] < 0 || roi[2] <= 0 || roi[3] <= 0) exit_usage();
+			break;
 		case 't': droptest = atoi(optarg); break;
 		case 'v': verbose = 1; break;
 		case '?': exit_usage();
@@ -83,6 +711,64 @@ int main(int argc, char *argv[])
 	}
 	
 	c = argc - optind;
+	
+	/* A thumbnail is one of three scales, and isn't layered or given a region of interest */
+	if(thumb < 0 || thumb > SSDV_MAX_THUMB || (thumb && (layered || roi[2]))) exit_usage();
+	
+	/* The packet budget is only worked out for one quality level, sent in one go */
+	if((roi[2] || layered || thumb) && budget > 0) exit_usage();
+	
+	/* Pixels are only written for a single image */
+	if(pixels >= 0 && (encode != 0 || multi || live)) exit_usage();
+	
+	if(batch)
+	{
+		if(encode != 1 || c < 1) exit_usage();
+		
+		memset(&bt, 0, sizeof(bt));
+		bt.type = type;
+		bt.callsign = callsign;
+		bt.quality = quality;
+		bt.budget = budget;
+		bt.dht = dht;
+		bt.layered = layered;
+		bt.grey = grey;
+		bt.thumb = thumb;
+		memcpy(bt.roi, roi, sizeof(roi));
+		
+		for(i = 0; i < c; i++)
+		{
+			if(batch_add_path(&bt, argv[optind + i]) != 0)
+			{
+				batch_free(&bt);
+				return(-1);
+			}
+		}
+		
+		/* Image IDs follow on from -i, wrapping at 255 */
+		for(i = 0; i < bt.jobs_len; i++)
+			bt.jobs[i].image_id = image_id + i;
+		
+		if(batch_out)
+		{
+			bt.fout = strcmp(batch_out, "-") ? fopen(batch_out, "wb") : stdout;
+			if(!bt.fout)
+			{
+				fprintf(stderr, "Error opening '%s' for output:\n", batch_out);
+				perror("fopen");
+				batch_free(&bt);
+				return(-1);
+			}
+		}
+		
+		i = batch_run(&bt, threads);
+		
+		if(bt.fout && bt.fout != stdout) fclose(bt.fout);
+		batch_free(&bt);
+		
+		return(i == 0 ? 0 : -1);
+	}
+	
 	if(c > 2) exit_usage();
 	
 	for(i = 0; i < c; i++)
@@ -102,6 +788,13 @@ int main(int argc, char *argv[])
 			break;
 		
 		case 1:
+			/* In multi-image mode the output name is a prefix */
+			if(multi)
+			{
+				demux_out.prefix = argv[optind + i];
+				break;
+			}
+			
 			fout = fopen(argv[optind + i], "wb");
 			if(!fout)         
 			{                 
@@ -118,20 +811,73 @@ int main(int argc, char *argv[])
 	case 0: /* Decode */
 		if(droptest > 0) fprintf(stderr, "*** NOTE: Drop test enabled: %i ***\n", droptest);
 		
-		ssdv_dec_init(&ssdv);
+		if(multi)
+		{
+			ssdv_demux_init(&demux, 0, 0, demux_write_image, &demux_out);
+			demux.reorder_window = reorder;
+		}
+		else if(live)
+		{
+			ssdv_live_init(&ssdv_live);
+			
+			/* Only a regular file can be rewritten after each packet */
+			rewrite = fstat(fileno(fout), &st) == 0 && S_ISREG(st.st_mode);
+		}
+		else
+		{
+			/* Write the image out as it is decoded */
+			ssdv_dec_init(&ssdv);
+			if(pixels >= 0) ssdv_dec_set_pixels(&ssdv, pixels, write_pixels, fout);
+			else ssdv_dec_set_sink(&ssdv, write_sink, fout);
+			
+			if(reorder > 0)
+			{
+				reorder_buffer = malloc(SSDV_REORDER_LEN(reorder));
+				if(!reorder_buffer)
+				{
+					fprintf(stderr, "Error allocating the reorder buffer\n");
+					return(-1);
+				}
+				
+				ssdv_dec_set_reorder(&ssdv, reorder_buffer, reorder);
+			}
+		}
 		
-		jpeg_length = 1024 * 1024 * 4;
-		jpeg = malloc(jpeg_length);
-		ssdv_dec_set_buffer(&ssdv, jpeg, jpeg_length);
+		if(multi) decode_out.demux = &demux;
+		if(live) decode_out.live = &ssdv_live;
+		decode_out.fout = fout;
+		decode_out.rewrite = rewrite;
+		
+		/* Packets from more than one receiver are merged before decoding */
+		rx[0] = fin;
+		for(n = 1; n < receivers; n++)
+		{
+			rx[n] = fopen(also[n - 1], "rb");
+			if(!rx[n])
+			{
+				fprintf(stderr, "Error opening '%s' for input:\n", also[n - 1]);
+				perror("fopen");
+				return(-1);
+			}
+		}
+		
+		if(receivers > 1) ssdv_merge_init(&merge, receivers * 16, decode_packet, &decode_out);
+		
+		/* Read ahead the next packet from each receiver */
+		for(n = 0; n < receivers; n++)
+			rx_ok[n] = read_packet(rx[n], rx_pkt[n], &rx_errors[n], droptest, &checks);
 		
 		i = 0;
-		while(fread(pkt, 1, SSDV_PKT_SIZE, fin) > 0)
+		while(1)
 		{
-			/* Drop % of packets */
-			if(droptest && (rand() / (RAND_MAX / 100) < droptest)) continue;
+			/* Take the earliest, so the receivers' files are kept in step */
+			for(c = -1, n = 0; n < receivers; n++)
+				if(rx_ok[n] && (c < 0 || packet_before(rx_pkt[n], rx_pkt[c]))) c = n;
+			if(c < 0) break;
 			
-			/* Test the packet is valid */
-			if(ssdv_dec_is_packet(pkt, &errors) != 0) continue;
+			memcpy(pkt, rx_pkt[c], SSDV_PKT_SIZE);
+			errors = rx_errors[c];
+			rx_ok[c] = read_packet(rx[c], rx_pkt[c], &rx_errors[c], droptest, &checks);
 			
 			if(verbose)
 			{
@@ -154,25 +900,83 @@ int main(int argc, char *argv[])
 					p.mcu_id,
 					p.mcu_count
 				);
+				
+				if(p.tiled)
+					fprintf(stderr, ">> Tile at %dx%d of a %dx%d image\n",
+						p.tile_x, p.tile_y, p.image_width, p.image_height);
+				if(p.layered)
+					fprintf(stderr, ">> Layer %d of %d\n", p.layer + 1, SSDV_LAYERS);
+				if(p.thumbnail)
+					fprintf(stderr, ">> Thumbnail at 1/%d scale\n", 16 >> p.thumbnail);
+				if(p.grey)
+					fprintf(stderr, ">> Greyscale\n");
+				if(p.roi)
+					fprintf(stderr, ">> Quality %d inside %dx%d at %dx%d\n",
+						p.roi_quality, p.roi_width, p.roi_height, p.roi_x, p.roi_y);
 			}
 			
-			/* Feed it to the decoder */
-			ssdv_dec_feed(&ssdv, pkt);
+			if(receivers > 1) ssdv_merge_feed(&merge, pkt, errors);
+			else decode_packet(&decode_out, pkt);
 			i++;
 		}
 		
-		ssdv_dec_get_jpeg(&ssdv, &jpeg, &jpeg_length);
-		fwrite(jpeg, 1, jpeg_length, fout);
-		free(jpeg);
+		if(receivers > 1)
+		{
+			ssdv_merge_flush(&merge);
+			fprintf(stderr, "Dropped %u duplicate packets\n", merge.duplicates);
+			for(n = 1; n < receivers; n++) fclose(rx[n]);
+		}
+		
+		if(multi)
+		{
+			ssdv_demux_flush(&demux);
+		}
+		else if(live)
+		{
+			/* Anything else only gets the final image */
+			if(!rewrite && ssdv_live_get_jpeg(&ssdv_live, &jpeg, &jpeg_length) == SSDV_OK)
+				fwrite(jpeg, 1, jpeg_length, fout);
+			ssdv_live_free(&ssdv_live);
+		}
+		else
+		{
+			/* Complete the image, the sink writes the end of it */
+			ssdv_dec_get_jpeg(&ssdv, &jpeg, &jpeg_length);
+			free(reorder_buffer);
+			
+			if(verbose) print_stats(&ssdv, &checks);
+		}
 		
 		fprintf(stderr, "Read %i packets\n", i);
 		
 		break;
 	
 	case 1: /* Encode */
-		ssdv_enc_init(&ssdv, type, callsign, image_id, quality);
+		/* Map the input if possible. Otherwise it is read in small pieces, unless the
+		 * whole image is needed to split its restart intervals, fit a budget, to
+		 * optimise the huffman tables, or to send it in layers or as a thumbnail */
+		jpeg = map_file(fin, &jpeg_length);
+		mapped = jpeg != NULL;
+		if(!jpeg && (threads > 1 || budget > 0 || dht || layered || thumb)) jpeg = read_file(fin, &jpeg_length);
+		
+		if(jpeg && budget > 0) quality = budget_quality(type, callsign, grey, dht, jpeg, jpeg_length, budget, quality);
+		
+		ssdv_enc_init(&ssdv, type, callsign, image_id, roi[2] ? roi[4] : quality);
+		if(roi[2]) ssdv_enc_set_roi(&ssdv, roi[0], roi[1], roi[2], roi[3], quality);
+		ssdv_enc_set_grey(&ssdv, grey);
+		ssdv_enc_set_layered(&ssdv, layered);
+		ssdv_enc_set_thumbnail(&ssdv, thumb);
 		ssdv_enc_set_buffer(&ssdv, pkt);
 		
+		if(jpeg && dht && ssdv_enc_optimise_dht(&ssdv, jpeg, jpeg_length) != SSDV_OK)
+			fprintf(stderr, "Using the standard huffman tables\n");
+		
+		if(jpeg)
+		{
+			ssdv_enc_set_threads(&ssdv, threads);
+			ssdv_enc_feed(&ssdv, jpeg, jpeg_length);
+		}
+		
 		i = 0;
 		
 		while(1)
@@ -206,6 +1010,11 @@ int main(int argc, char *argv[])
 		
 		fprintf(stderr, "Wrote %i packets\n", i);
 		
+		if(verbose) print_stats(&ssdv, NULL);
+		
+		if(mapped) munmap(jpeg, jpeg_length);
+		else free(jpeg);
+		
 		break;
 	
 	default:
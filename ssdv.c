@@ -18,10 +18,36 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#ifdef SSDV_THREADS
+#include <pthread.h>
+#endif
+#ifdef SSDV_STATS
+#include <time.h>
+#endif
 #include "ssdv.h"
 #include "rs8.h"
 
+/* Counters for profiling, only kept when built with SSDV_STATS */
+#ifdef SSDV_STATS
+#define STATS_ADD(st, f, n)  ((st)->f += (n))
+#define STATS_START(t)       uint64_t t = ssdv_stats_ns()
+#define STATS_STOP(st, f, t) ((st)->f += ssdv_stats_ns() - (t))
+
+static inline uint64_t ssdv_stats_ns(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+#else
+#define STATS_ADD(st, f, n)
+#define STATS_START(t)
+#define STATS_STOP(st, f, t)
+#endif
+
 /* Recognised JPEG markers */
 enum {
 	J_TEM = 0xFF01,
@@ -108,25 +134,78 @@ static const uint8_t std_dht11[179] = {
 0xF8,0xF9,0xFA,
 };
 
+/* Bytes of a fixed decoder buffer kept back to end the image */
+#define SSDV_EOI_RESERVE (4)
+
+/* Packet header flag, the image has its own huffman tables in packet 0 */
+#define SSDV_FLAG_DHT (0x80)
+
+/* Packet header flag, a byte of extension flags follows the MCU ID */
+#define SSDV_FLAG_EXT (0x40)
+
+/* Extension flags, the image is split into tiles and the size of the whole
+ * image and the tile's place in it follow. Or it is sent in layers, with the
+ * packet's layer in the low bits. A thumbnail has its scale there, less one.
+ * A region of interest's quality and place in the image follow any tile's.
+ * A greyscale image has no chroma parts */
+#define SSDV_EXT_TILE    (0x80)
+#define SSDV_EXT_LAYERED (0x40)
+#define SSDV_EXT_THUMB   (0x20)
+#define SSDV_EXT_ROI     (0x10)
+#define SSDV_EXT_GREY    (0x08)
+#define SSDV_EXT_LAYER   (0x03)
+
+/* The first coefficient of each layer, in zig-zag order */
+static const uint8_t layer_start[SSDV_LAYERS + 1] = { 0, 1, 6, 15, 64 };
+
+#define LAYER_START(s, l) ((s)->layered ? layer_start[l] : 0)
+#define LAYER_END(s, l)   ((s)->layered ? layer_start[(l) + 1] : 64)
+
+/* Largest image that can be sent without tiles, and the most MCUs */
+#define SSDV_MAX_SIZE (4080)
+#define SSDV_MAX_MCUS (0xFFFF)
+
+/* Size of an MCU block in pixels */
+#define MCU_WIDTH(s)  ((s)->mcu_mode == 0 || (s)->mcu_mode == 2 ? 16 : 8)
+#define MCU_HEIGHT(s) ((s)->mcu_mode == 0 || (s)->mcu_mode == 1 ? 16 : 8)
+
+/* Is slot 'i' of the reordering window holding a packet? */
+#define REORDER_HELD(s, i) ((s)->reorder_held[(i) >> 3] & (1 << ((i) & 7)))
+
+/* Symbols a DC or AC table can hold, and the longest code used */
+#define DHT_DC_SYMBOLS (12)
+#define DHT_AC_SYMBOLS (162)
+#define DHT_MAX_BITS   (15)
+
+static const uint8_t dht_ids[2][2] = { { 0x00, 0x01 }, { 0x10, 0x11 } };
+
 /* Helper for returning the current DHT table */
 #define SDHT (s->sdht[s->acpart ? 1 : 0][s->component ? 1 : 0])
 #define DDHT (s->ddht[s->acpart ? 1 : 0][s->component ? 1 : 0])
+#define SDHT_LOOKUP (&s->sdht_lookup[s->acpart ? 1 : 0][s->component ? 1 : 0])
+#define DDHT_SYMBOLS (&s->ddht_symbols[s->acpart ? 1 : 0][s->component ? 1 : 0])
 
 /* Helpers for looking up the current DQT value */
 #define SDQT (s->sdqt[s->component ? 1 : 0][1 + s->acpart])
 #define DDQT (s->ddqt[s->component ? 1 : 0][1 + s->acpart])
 
+/* Helpers for looking up the current requantisation factors */
+#define RQDIV ((s->inroi ? s->roi_rq_div : s->rq_div)[s->component ? 1 : 0][s->acpart])
+#define RQMUL ((s->inroi ? s->roi_rq_mul : s->rq_mul)[s->component ? 1 : 0][s->acpart])
+
 /* Helpers for converting between DQT tables */
-#define AADJ(i) (SDQT == DDQT ? (i) : irdiv(i, DDQT))
-#define UADJ(i) (SDQT == DDQT ? (i) : (i * SDQT))
-#define BADJ(i) (SDQT == DDQT ? (i) : irdiv(i * SDQT, DDQT))
+#define AADJ(i) (RQDIV == 0 ? (i) : rqdiv(i, RQDIV))
+#define UADJ(i) (RQDIV == 0 ? (i) : (i * SDQT))
+#define BADJ(i) (RQDIV == 0 ? (i) : rqdiv(i, RQMUL))
 
-/* Integer-only division with rounding */
-static int irdiv(int i, int div)
+/* Integer-only division with rounding, by multiplying with a reciprocal */
+static inline int rqdiv(int i, uint64_t recip)
 {
-	i = i * 2 / div;
-	if(i & 1) i += (i > 0 ? 1 : -1);
-	return(i / 2);
+	uint32_t n = (i < 0 ? -i : i);
+	
+	n = ((n * 2 * recip >> 32) + 1) >> 1;
+	
+	return(i < 0 ? -(int) n : (int) n);
 }
 
 /*
@@ -213,6 +292,60 @@ static void *dtblcpy(ssdv_t *s, const void *src, size_t n)
 	return(r);
 }
 
+static void ssdv_build_requant(uint8_t *sdqt[2], uint8_t *ddqt[2], uint64_t rq_div[2][64], uint64_t rq_mul[2][64], char force)
+{
+	uint64_t recip;
+	int c, i;
+	
+	for(c = 0; c < 2; c++)
+	{
+		for(i = 0; i < 64; i++)
+		{
+			if(sdqt[c][1 + i] == ddqt[c][1 + i] && !force)
+			{
+				/* No conversion needed */
+				rq_div[c][i] = rq_mul[c][i] = 0;
+				continue;
+			}
+			
+			/* Exact for any numerator below 2^32 / DQT */
+			recip = ((uint64_t) 1 << 32) / ddqt[c][1 + i] + 1;
+			
+			rq_div[c][i] = recip;
+			rq_mul[c][i] = recip * sdqt[c][1 + i];
+		}
+	}
+}
+
+static void ssdv_init_requant(ssdv_t *s)
+{
+	uint8_t *rdqt[2] = { s->rdqt[0], s->rdqt[1] };
+	
+	/* The encoder switches tables between blocks in and out of a region
+	 * of interest, so every DC value is kept unquantised to stay on one
+	 * scale. The decoder brings the rest of the image to the region's */
+	if(s->roi && s->mode == S_ENCODING)
+	{
+		ssdv_build_requant(s->sdqt, s->ddqt, s->rq_div, s->rq_mul, 1);
+		ssdv_build_requant(s->sdqt, rdqt, s->roi_rq_div, s->roi_rq_mul, 1);
+	}
+	else ssdv_build_requant(s->sdqt, s->ddqt, s->rq_div, s->rq_mul, 0);
+}
+
+static char ssdv_roi_mcu(ssdv_t *s, uint32_t mcu)
+{
+	uint16_t w, x, y;
+	
+	/* Is the top left corner of the MCU inside the region of interest? The
+	 * decoder counts MCUs within the tile, the encoder in the whole image */
+	w = (s->mode == S_DECODING && s->tiled ? s->tile_width : s->width) / MCU_WIDTH(s);
+	x = (mcu % w) * MCU_WIDTH(s);
+	y = (mcu / w) * MCU_HEIGHT(s);
+	
+	return(x >= s->roi_x && x < s->roi_x + s->roi_width &&
+	       y >= s->roi_y && y < s->roi_y + s->roi_height);
+}
+
 static uint32_t crc32(void *data, size_t length)
 {
 	uint32_t crc, x;
@@ -276,69 +409,275 @@ static char *decode_callsign(char *callsign, uint32_t code)
 	return(callsign);
 }
 
-static inline char jpeg_dht_lookup(ssdv_t *s, uint8_t *symbol, uint8_t *width)
+static inline uint64_t ssdv_get_be64(const uint8_t *p)
 {
-	uint16_t code = 0;
+	return(((uint64_t) p[0] << 56) | ((uint64_t) p[1] << 48) |
+	       ((uint64_t) p[2] << 40) | ((uint64_t) p[3] << 32) |
+	       ((uint64_t) p[4] << 24) | ((uint64_t) p[5] << 16) |
+	       ((uint64_t) p[6] << 8)  | (uint64_t) p[7]);
+}
+
+static inline void ssdv_put_be64(uint8_t *p, uint64_t w)
+{
+	p[0] = w >> 56; p[1] = w >> 48; p[2] = w >> 40; p[3] = w >> 32;
+	p[4] = w >> 24; p[5] = w >> 16; p[6] = w >> 8;  p[7] = w;
+}
+
+/* Test if any of the lowest n bytes of w are 0xFF */
+static inline char ssdv_has_ff(uint64_t w, uint8_t n)
+{
+	if(n < 8) w &= ((uint64_t) 1 << (n << 3)) - 1;
+	
+	/* 0xFF bytes become zero, the unused bytes become 0xFF */
+	w = ~w;
+	return(((w - 0x0101010101010101ULL) & ~w & 0x8080808080808080ULL) != 0);
+}
+
+/* Return the next 'length' input bits without consuming them */
+static inline uint32_t ssdv_peekbits(ssdv_t *s, uint8_t length)
+{
+	return((s->workbits >> (s->worklen - length)) & ((1 << length) - 1));
+}
+
+static void jpeg_dht_build_lookup(ssdv_dht_lookup_t *l, const uint8_t *dht)
+{
+	uint16_t code = 0, k = 0;
 	uint8_t cw, n;
-	uint8_t *dht, *ss;
+	int i, fill;
 	
-	/* Select the appropriate huffman table */
-	dht = SDHT;
-	ss = &dht[17];
+	memset(l->lookup, 0, sizeof(l->lookup));
 	
 	for(cw = 1; cw <= 16; cw++)
 	{
-		/* Got enough bits? */
-		if(cw > s->worklen) return(SSDV_FEED_ME);
+		l->valptr[cw]  = k;
+		l->mincode[cw] = code;
+		l->maxcode[cw] = dht[cw] ? code + dht[cw] - 1 : -1;
 		
-		/* Compare against each code 'cw' bits wide */
-		for(n = dht[cw]; n > 0; n--)
+		for(n = dht[cw]; n > 0; n--, k++, code++)
 		{
-			if(s->workbits >> (s->worklen - cw) == code)
-			{
-				/* Found a match */
-				*symbol = *ss;
-				*width = cw;
-				return(SSDV_OK);
-			}
-			ss++; code++;
+			/* Short codes fill every table entry they are a prefix of */
+			if(cw > SSDV_DHT_LOOKAHEAD || code >= 1 << cw) continue;
+			
+			i = code << (SSDV_DHT_LOOKAHEAD - cw);
+			for(fill = 1 << (SSDV_DHT_LOOKAHEAD - cw); fill > 0; fill--)
+				l->lookup[i++] = (cw << 8) | dht[17 + k];
 		}
 		
 		code <<= 1;
 	}
+}
+
+static char jpeg_dht_lookup_slow(ssdv_t *s, uint8_t *symbol, uint8_t *width)
+{
+	ssdv_dht_lookup_t *l = SDHT_LOOKUP;
+	uint16_t code;
+	uint8_t cw;
+	
+	for(cw = 1; cw <= 16; cw++)
+	{
+		/* Got enough bits? */
+		if(cw > s->worklen) return(SSDV_FEED_ME);
+		
+		code = ssdv_peekbits(s, cw);
+		if(code <= l->maxcode[cw] && code >= l->mincode[cw])
+		{
+			/* Found a match */
+			*symbol = SDHT[17 + l->valptr[cw] + code - l->mincode[cw]];
+			*width = cw;
+			STATS_ADD(&s->stats, huff_lookups, 1);
+			STATS_ADD(&s->stats, huff_slow, 1);
+			return(SSDV_OK);
+		}
+	}
 	
 	/* No match found - error */
 	return(SSDV_ERROR);
 }
 
-static inline char jpeg_dht_lookup_symbol(ssdv_t *s, uint8_t symbol, uint16_t *bits, uint8_t *width)
+static inline char jpeg_dht_lookup(ssdv_t *s, uint8_t *symbol, uint8_t *width)
+{
+	uint16_t peek, e;
+	
+	/* Peek at the next bits, padding with zeros if there are too few */
+	if(s->worklen >= SSDV_DHT_LOOKAHEAD)
+		peek = ssdv_peekbits(s, SSDV_DHT_LOOKAHEAD);
+	else
+		peek = ssdv_peekbits(s, s->worklen) << (SSDV_DHT_LOOKAHEAD - s->worklen);
+	
+	e = SDHT_LOOKUP->lookup[peek];
+	
+	/* Long codes, or codes not yet fully buffered, take the slow path */
+	if(e == 0 || (e >> 8) > s->worklen) return(jpeg_dht_lookup_slow(s, symbol, width));
+	
+	*symbol = e & 0xFF;
+	*width = e >> 8;
+	STATS_ADD(&s->stats, huff_lookups, 1);
+	
+	return(SSDV_OK);
+}
+
+static void jpeg_dht_build_symbols(ssdv_dht_symbols_t *t, const uint8_t *dht)
 {
 	uint16_t code = 0;
 	uint8_t cw, n;
-	uint8_t *dht, *ss;
+	const uint8_t *ss = &dht[17];
 	
-	dht = DDHT;
-	ss = &dht[17];
+	memset(t->width, 0, sizeof(t->width));
 	
 	for(cw = 1; cw <= 16; cw++)
 	{
-		for(n = dht[cw]; n > 0; n--)
+		for(n = dht[cw]; n > 0; n--, ss++, code++)
 		{
-			if(*ss == symbol)
-			{
-				/* Found a match */
-				*bits = code;
-				*width = cw;
-				return(SSDV_OK);
-			}
-			ss++; code++;
+			/* Keep the first (shortest) code for each symbol */
+			if(t->width[*ss]) continue;
+			
+			t->bits[*ss]  = code;
+			t->width[*ss] = cw;
 		}
 		
 		code <<= 1;
 	}
+}
+
+/* Symbols are sent in a fixed order: DC sizes 0-11, or EOB,
+ * ZRL then each run of 0-15 followed by a size of 1-10 for AC */
+static uint8_t dht_symbol(char ac, int i)
+{
+	if(!ac) return(i);
+	if(i < 2) return(i ? 0xF0 : 0x00);
+	
+	i -= 2;
+	return(((i / 10) << 4) | (i % 10 + 1));
+}
+
+static int dht_index(char ac, uint8_t symbol)
+{
+	if(!ac) return(symbol);
+	if(symbol == 0x00) return(0);
+	if(symbol == 0xF0) return(1);
+	
+	return(2 + (symbol >> 4) * 10 + (symbol & 0x0F) - 1);
+}
+
+static size_t dht_from_lengths(uint8_t *dht, uint8_t id, const uint8_t *len, char ac)
+{
+	int n = ac ? DHT_AC_SYMBOLS : DHT_DC_SYMBOLS;
+	int i, l;
+	size_t k = 17;
+	
+	/* Shortest codes first, each length in symbol order */
+	dht[0] = id;
+	for(l = 1; l <= 16; l++)
+	{
+		dht[l] = 0;
+		for(i = 0; i < n; i++)
+		{
+			if(len[i] != l) continue;
+			dht[k++] = dht_symbol(ac, i);
+			dht[l]++;
+		}
+	}
+	
+	return(k);
+}
+
+static void dht_to_lengths(const uint8_t *dht, uint8_t *len, char ac)
+{
+	const uint8_t *ss = &dht[17];
+	int l, n;
+	
+	memset(len, 0, ac ? DHT_AC_SYMBOLS : DHT_DC_SYMBOLS);
+	for(l = 1; l <= 16; l++)
+		for(n = dht[l]; n > 0; n--)
+			len[dht_index(ac, *(ss++))] = l;
+}
+
+static void dht_optimal_lengths(uint8_t *len, const uint32_t *freq, int n)
+{
+	uint32_t f[DHT_AC_SYMBOLS + 1], v;
+	int codesize[DHT_AC_SYMBOLS + 1], others[DHT_AC_SYMBOLS + 1];
+	int bits[DHT_AC_SYMBOLS + 2];
+	int c1, c2, i, j, l;
+	
+	/* Huffman code lengths as in JPEG Annex K.2. One extra symbol
+	 * is reserved so that no code is made entirely of 1 bits */
+	for(i = 0; i <= n; i++)
+	{
+		f[i] = i < n ? freq[i] : 1;
+		codesize[i] = 0;
+		others[i] = -1;
+	}
+	
+	/* A table always has at least one symbol */
+	for(i = 0; i < n && f[i] == 0; i++);
+	if(i == n) f[0] = 1;
+	
+	while(1)
+	{
+		/* Join the two least frequent, the later one on a tie */
+		c1 = c2 = -1;
+		for(v = UINT32_MAX, i = 0; i <= n; i++)
+			if(f[i] && f[i] <= v) { v = f[i]; c1 = i; }
+		
+		for(v = UINT32_MAX, i = 0; i <= n; i++)
+			if(f[i] && f[i] <= v && i != c1) { v = f[i]; c2 = i; }
+		
+		if(c2 < 0) break;
+		
+		f[c1] += f[c2];
+		f[c2] = 0;
+		
+		for(codesize[c1]++; others[c1] >= 0; codesize[c1]++) c1 = others[c1];
+		others[c1] = c2;
+		for(codesize[c2]++; others[c2] >= 0; codesize[c2]++) c2 = others[c2];
+	}
+	
+	memset(bits, 0, sizeof(bits));
+	for(i = 0; i <= n; i++) bits[codesize[i]]++;
+	
+	/* Limit the code lengths, as in JPEG Annex K.3 */
+	for(i = n + 1; i > DHT_MAX_BITS; i--)
+	{
+		while(bits[i] > 0)
+		{
+			for(j = i - 2; bits[j] == 0; j--);
+			
+			bits[i] -= 2;
+			bits[i - 1]++;
+			bits[j + 1] += 2;
+			bits[j]--;
+		}
+	}
+	
+	/* Drop the reserved code, which is one of the longest */
+	while(bits[i] == 0) i--;
+	bits[i]--;
+	
+	/* Hand the lengths out in order of the unlimited ones */
+	memset(len, 0, n);
+	for(j = 1, l = 1; l <= n + 1; l++)
+	{
+		for(i = 0; i < n; i++)
+		{
+			if(codesize[i] != l) continue;
+			while(bits[j] == 0) j++;
+			len[i] = j;
+			bits[j]--;
+		}
+	}
+}
+
+static inline char jpeg_dht_lookup_symbol(ssdv_t *s, uint8_t symbol, uint16_t *bits, uint8_t *width)
+{
+	ssdv_dht_symbols_t *t = DDHT_SYMBOLS;
 	
 	/* No match found - error */
-	return(SSDV_ERROR);
+	if(t->width[symbol] == 0) return(SSDV_ERROR);
+	
+	*bits = t->bits[symbol];
+	*width = t->width[symbol];
+	
+	return(SSDV_OK);
 }
 
 static inline int jpeg_int(int bits, int width)
@@ -362,15 +701,109 @@ static inline void jpeg_encode_int(int value, int *bits, uint8_t *width)
 
 /*****************************************************************************/
 
-static char ssdv_outbits(ssdv_t *s, uint16_t bits, uint8_t length)
+static void ssdv_inbits(ssdv_t *s)
 {
-	uint8_t b;
+	uint64_t w;
+	uint8_t b, n, loaded = 0;
+	
+	/* Top up the work area, keeping it to 56 bits or less */
+	while(s->worklen <= 48 && s->in_len)
+	{
+		n = (56 - s->worklen) >> 3;
+		
+		/* Load whole bytes at once while there are no stuffing bytes */
+		if(!s->in_skip && s->in_len >= 8)
+		{
+			w = ssdv_get_be64(s->inp) >> (64 - (n << 3));
+			if(!s->in_stuff || !ssdv_has_ff(w, n))
+			{
+				s->workbits = (s->workbits << (n << 3)) | w;
+				s->worklen += n << 3;
+				s->inp += n;
+				s->in_len -= n;
+				loaded = 1;
+				STATS_ADD(&s->stats, bits_in, n << 3);
+				continue;
+			}
+		}
+		
+		/* Otherwise one byte at a time */
+		b = *s->inp;
+		
+		/* Skip bytes if necessary */
+		if(s->in_skip)
+		{
+			s->inp++;
+			s->in_len--;
+			s->in_skip--;
+			STATS_ADD(&s->stats, stuff_in, 1);
+			continue;
+		}
+		
+		/* Let the work area run dry before an 0xFF, it may be a marker */
+		if(s->in_stuff && b == 0xFF && loaded) break;
+		
+		s->inp++;
+		s->in_len--;
+		
+		/* Is the next byte a stuffing byte? Skip it */
+		/* TODO: Test the next byte is actually 0x00 */
+		if(s->in_stuff && b == 0xFF) s->in_skip++;
+		
+		/* Add the new byte to the work area */
+		s->workbits = (s->workbits << 8) | b;
+		s->worklen += 8;
+		loaded = 1;
+		STATS_ADD(&s->stats, bits_in, 8);
+	}
+}
+
+static void ssdv_sink_flush(ssdv_t *s)
+{
+	size_t n = s->outp - s->out;
+	
+	/* Pass the staged bytes to the sink and start again */
+	if(n > 0) s->sink(s->sink_arg, s->out, n);
+	
+	s->sink_len += n;
+	s->outp = s->out;
+	s->out_len = SSDV_SINK_LEN;
+}
+
+static void ssdv_null_sink(void *arg, uint8_t *data, size_t length)
+{
+}
+
+static char ssdv_outbits(ssdv_t *s, uint32_t bits, uint8_t length)
+{
+	uint64_t w;
+	uint8_t b, n;
 	
 	if(length)
 	{
 		s->outbits <<= length;
 		s->outbits |= bits & ((1 << length) - 1);
 		s->outlen += length;
+		STATS_ADD(&s->stats, bits_out, length);
+	}
+	
+	/* Make room for the complete bytes, and any stuffing */
+	if(s->sink && s->out_len < 16) ssdv_sink_flush(s);
+	
+	/* Write all the complete bytes at once if none need stuffing */
+	n = s->outlen >> 3;
+	if(n > 0 && n <= s->out_len)
+	{
+		w = s->outbits >> (s->outlen & 7);
+		if(!s->out_stuff || !ssdv_has_ff(w, n))
+		{
+			if(s->out_len >= 8) ssdv_put_be64(s->outp, w << (64 - (n << 3)));
+			else for(b = 0; b < n; b++) s->outp[b] = w >> ((n - 1 - b) << 3);
+			
+			s->outp += n;
+			s->out_len -= n;
+			s->outlen &= 7;
+		}
 	}
 	
 	while(s->outlen >= 8 && s->out_len > 0)
@@ -385,8 +818,9 @@ static char ssdv_outbits(ssdv_t *s, uint16_t bits, uint8_t length)
 		/* Insert stuffing byte if needed */
 		if(s->out_stuff && b == 0xFF)
 		{
-			s->outbits &= (1 << s->outlen) - 1;
+			s->outbits &= ((uint64_t) 1 << s->outlen) - 1;
 			s->outlen += 8;
+			STATS_ADD(&s->stats, stuff_out, 1);
 		}
 	}
 	
@@ -400,1081 +834,3997 @@ static char ssdv_outbits_sync(ssdv_t *s)
 	return(SSDV_OK);
 }
 
-static char ssdv_out_jpeg_int(ssdv_t *s, uint8_t rle, int value)
+static char ssdv_coef_push(ssdv_interval_t *iv, uint8_t rle, int value)
 {
-	uint16_t huffbits = 0;
-	int intbits;
-	uint8_t hufflen = 0, intlen;
-	int r;
+	ssdv_coef_t *c;
+	size_t size;
 	
-	jpeg_encode_int(value, &intbits, &intlen);
-	r = jpeg_dht_lookup_symbol(s, (rle << 4) | (intlen & 0x0F), &huffbits, &hufflen);
-	
-	if(r != SSDV_OK) fprintf(stderr, "jpeg_dht_lookup_symbol: %i (%i:%i)\n", r, value, rle);
+	if(iv->coef_len == iv->coef_size)
+	{
+		size = iv->coef_size ? iv->coef_size * 2 : iv->length + 256;
+		c = realloc(iv->coef, sizeof(ssdv_coef_t) * size);
+		if(!c)
+		{
+			iv->r = SSDV_ERROR;
+			return(SSDV_ERROR);
+		}
+		
+		iv->coef = c;
+		iv->coef_size = size;
+	}
 	
-	ssdv_outbits(s, huffbits, hufflen);
-	if(intlen) ssdv_outbits(s, intbits, intlen);
+	c = &iv->coef[iv->coef_len++];
+	c->value = value;
+	c->rle = rle;
 	
 	return(SSDV_OK);
 }
 
-static char ssdv_process(ssdv_t *s)
+static void ssdv_enc_tile_size(ssdv_t *s)
 {
-	if(s->state == S_HUFF)
+	uint32_t cols, rows;
+	
+	/* Use the fewest tiles that keep within the limits of an SSDV image */
+	cols = (s->width + SSDV_MAX_SIZE - 1) / SSDV_MAX_SIZE;
+	rows = (s->height + SSDV_MAX_SIZE - 1) / SSDV_MAX_SIZE;
+	while(1)
 	{
-		uint8_t symbol, width;
-		int r;
+		s->tile_size_w = ((s->width  + cols - 1) / cols + 15) & ~15;
+		s->tile_size_h = ((s->height + rows - 1) / rows + 15) & ~15;
+		if((s->tile_size_w / MCU_WIDTH(s)) * (s->tile_size_h / MCU_HEIGHT(s)) <= SSDV_MAX_MCUS) break;
+		if(s->tile_size_h >= s->tile_size_w) rows++;
+		else cols++;
+	}
+}
+
+static uint32_t ssdv_tile_mcu(ssdv_t *s, uint32_t mcu)
+{
+	/* The place of an MCU of the current tile in the whole image */
+	uint32_t w = s->tile_width / MCU_WIDTH(s);
+	
+	return((s->tile_y / MCU_HEIGHT(s) + mcu / w) * (s->width / MCU_WIDTH(s)) +
+	        s->tile_x / MCU_WIDTH(s) + mcu % w);
+}
+
+static inline uint32_t ssdv_kept_mcu(ssdv_t *s, uint32_t mcu)
+{
+	/* Each layer has a place for every MCU of the image */
+	uint32_t count = (s->width / MCU_WIDTH(s)) * (s->height / MCU_HEIGHT(s));
+	
+	return(s->layer * count + ssdv_tile_mcu(s, mcu));
+}
+
+static inline uint32_t ssdv_kept_count(ssdv_t *s)
+{
+	/* The number of places in kept_mcu */
+	uint32_t count = (s->width / MCU_WIDTH(s)) * (s->height / MCU_HEIGHT(s));
+	
+	return(s->layered ? count * SSDV_LAYERS : count);
+}
+
+static inline char ssdv_last_part(ssdv_t *s)
+{
+	/* The last layer of the last tile */
+	return(s->tile_x + s->tile_width >= s->width && s->tile_y + s->tile_height >= s->height &&
+	       (!s->layered || s->layer == SSDV_LAYERS - 1));
+}
+
+static ssdv_coef_t *ssdv_coef_expand(ssdv_coef_t *c, uint8_t k, int *block)
+{
+	/* Unpack a block kept by ssdv_coef_push() from coefficient k on */
+	if(k == 0) block[k++] = (c++)->value;
+	
+	for(; c->rle != SSDV_COEF_END; c++)
+	{
+		if(c->value != 0)
+		{
+			k += c->rle;
+			if(k < 64) block[k++] = c->value;
+		}
+		else if(c->rle == 15) k += 16; /* ZRL */
+		else k = 64; /* EOB */
+	}
+	
+	return(c + 1);
+}
+
+static char ssdv_estimate_init(ssdv_t *s)
+{
+	ssdv_estimate_t *e = s->estimate;
+	uint8_t dqt[2][65], *ddqt[2] = { dqt[0], dqt[1] };
+	uint64_t rq_div[2][64];
+	int q, i;
+	
+	/* Prepare the requantisation for every quality level at once */
+	for(q = 0; q < 8; q++)
+	{
+		load_standard_dqt(dqt[0], std_dqt0, q);
+		load_standard_dqt(dqt[1], std_dqt1, q);
+		ssdv_build_requant(s->sdqt, ddqt, rq_div, e->rq_mul[q], 0);
 		
-		/* Lookup the code, return if error or not enough bits yet */
-		if((r = jpeg_dht_lookup(s, &symbol, &width)) != SSDV_OK)
-			return(r);
+		e->rq_div[q][0] = rq_div[0][0];
+		e->rq_div[q][1] = rq_div[1][0];
 		
-		if(s->acpart == 0) /* DC */
+		/* The first MCU starts the first packet */
+		e->part.reset[q] = 1;
+	}
+	
+	/* Each tile across a tiled image is counted on its own */
+	if(s->tiled)
+	{
+		ssdv_enc_tile_size(s);
+		e->cols = (s->width + s->tile_size_w - 1) / s->tile_size_w;
+		e->row = malloc(sizeof(ssdv_estimate_part_t) * e->cols);
+		if(!e->row) return(SSDV_ERROR);
+		
+		for(i = 0; i < e->cols; i++)
+			e->row[i] = e->part;
+	}
+	
+	return(SSDV_OK);
+}
+
+static uint32_t ssdv_estimate_packets(ssdv_t *s, ssdv_estimate_part_t *p, int q)
+{
+	uint64_t bytes = (p->bits[q] + 7) / 8;
+	
+	return((bytes + s->pkt_size_payload - 1) / s->pkt_size_payload);
+}
+
+static void ssdv_estimate_end_row(ssdv_t *s)
+{
+	ssdv_estimate_t *e = s->estimate;
+	int i, q;
+	
+	/* Add up the packets of a finished row of tiles, and start the next */
+	for(i = 0; i < e->cols; i++)
+	{
+		for(q = 0; q < 8; q++)
 		{
-			if(symbol == 0x00)
-			{
-				/* No change in DC from last block */
-				if(s->reset_mcu == s->mcu_id && (s->mcupart == 0 || s->mcupart >= s->ycparts))
-				{
-					if(s->mode == S_ENCODING) ssdv_out_jpeg_int(s, 0, s->adc[s->component]);
-					else
-					{
-						ssdv_out_jpeg_int(s, 0, 0 - s->dc[s->component]);
-						s->dc[s->component] = 0;
-					}
-				}
-				else ssdv_out_jpeg_int(s, 0, 0);
-				
-				/* skip to the next AC part immediately */
-				s->acpart++;
-			}
-			else
-			{
-				/* DC value follows, 'symbol' bits wide */
-				s->state = S_INT;
-				s->needbits = symbol;
-			}
-		}
-		else /* AC */
-		{
-			s->acrle = 0;
-			if(symbol == 0x00)
-			{
-				/* EOB -- all remaining AC parts are zero */
-				ssdv_out_jpeg_int(s, 0, 0);
-				s->acpart = 64;
-			}
-			else if(symbol == 0xF0)
-			{
-				/* The next 16 AC parts are zero */
-				ssdv_out_jpeg_int(s, 15, 0);
-				s->acpart += 16;
-			}
-			else
-			{
-				/* Next bits are an integer value */
-				s->state = S_INT;
-				s->acrle = symbol >> 4;
-				s->acpart += s->acrle;
-				s->needbits = symbol & 0x0F;
-			}
+			e->packets[q] += ssdv_estimate_packets(s, &e->row[i], q);
+			
+			e->row[i].bits[q] = e->row[i].mark[q] = 0;
+			e->row[i].packet[q] = 0;
+			e->row[i].reset[q] = 1;
 		}
-		
-		/* Clear processed bits */
-		s->worklen -= width;
-		s->workbits &= (1 << s->worklen) - 1;
 	}
-	else if(s->state == S_INT)
+}
+
+static void ssdv_estimate_tile(ssdv_t *s)
+{
+	ssdv_estimate_t *e = s->estimate;
+	uint32_t across = s->width / MCU_WIDTH(s);
+	uint32_t x = (s->mcu_id % across) * MCU_WIDTH(s);
+	uint32_t y = (s->mcu_id / across) * MCU_HEIGHT(s);
+	uint16_t col = x / s->tile_size_w;
+	char row = x == 0 && y % s->tile_size_h == 0;
+	
+	/* Does the next MCU belong to another tile? */
+	if(col == e->col && !row) return;
+	
+	e->row[e->col] = e->part;
+	if(row) ssdv_estimate_end_row(s);
+	
+	e->col = col;
+	e->part = e->row[col];
+}
+
+static void ssdv_estimate_int(ssdv_estimate_t *e, int q, ssdv_dht_symbols_t *t, uint8_t rle, int value)
+{
+	int bits;
+	uint8_t width;
+	
+	jpeg_encode_int(value, &bits, &width);
+	e->part.bits[q] += t->width[(rle << 4) | width] + width;
+}
+
+static void ssdv_estimate_symbol(ssdv_t *s, uint8_t rle)
+{
+	ssdv_estimate_t *e = s->estimate;
+	int q;
+	
+	/* An EOB or ZRL copied from the source is the same at every level */
+	for(q = 0; q < 8; q++)
 	{
-		int i;
+		e->part.mark[q] = e->part.bits[q];
+		ssdv_estimate_int(e, q, DDHT_SYMBOLS, rle, 0);
+	}
+}
+
+static void ssdv_estimate_dc(ssdv_t *s, int i)
+{
+	ssdv_estimate_t *e = s->estimate;
+	uint8_t c = s->component ? 1 : 0;
+	int q, a;
+	
+	e->dc[s->component] += i;
+	
+	for(q = 0; q < 8; q++)
+	{
+		/* As ssdv_process_dc(), with the DC value kept unadjusted */
+		if(e->rq_div[q][c] == 0) a = e->dc[s->component];
+		else a = rqdiv(e->dc[s->component] * SDQT, e->rq_div[q][c]);
 		
-		/* Not enough bits yet? */
-		if(s->worklen < s->needbits) return(SSDV_FEED_ME);
+		e->part.mark[q] = e->part.bits[q];
+		if(e->part.reset[q] && (s->mcupart == 0 || s->mcupart >= s->ycparts))
+			ssdv_estimate_int(e, q, DDHT_SYMBOLS, 0, a);
+		else
+			ssdv_estimate_int(e, q, DDHT_SYMBOLS, 0, a - e->part.adc[q][s->component]);
 		
-		/* Decode the integer */
-		i = jpeg_int(s->workbits >> (s->worklen - s->needbits), s->needbits);
+		e->part.adc[q][s->component] = a;
+		e->accrle[q] = 0;
+	}
+}
+
+static void ssdv_estimate_ac(ssdv_t *s, int i)
+{
+	ssdv_estimate_t *e = s->estimate;
+	ssdv_dht_symbols_t *t = DDHT_SYMBOLS;
+	uint64_t mul;
+	int q, v;
+	
+	for(q = 0; q < 8; q++)
+	{
+		/* As ssdv_process_ac() */
+		mul = e->rq_mul[q][s->component ? 1 : 0][s->acpart];
+		v = mul == 0 ? i : rqdiv(i, mul);
 		
-		if(s->acpart == 0) /* DC */
+		e->part.mark[q] = e->part.bits[q];
+		if(v)
 		{
-			if(s->reset_mcu == s->mcu_id && (s->mcupart == 0 || s->mcupart >= s->ycparts))
-			{
-				if(s->mode == S_ENCODING)
-				{
-					/* Output absolute DC value */
-					s->dc[s->component] += UADJ(i);
-					s->adc[s->component] = AADJ(s->dc[s->component]);
-					ssdv_out_jpeg_int(s, 0, s->adc[s->component]);
-				}
-				else
-				{
-					/* Output relative DC value */
-					ssdv_out_jpeg_int(s, 0, i - s->dc[s->component]);
-					s->dc[s->component] = i;
-				}
-			}
-			else
+			e->accrle[q] += s->acrle;
+			while(e->accrle[q] >= 16)
 			{
-				if(s->mode == S_DECODING)
-				{
-					s->dc[s->component] += UADJ(i);
-					ssdv_out_jpeg_int(s, 0, i);
-				}
-				else
-				{
-					/* Output relative DC value */
-					s->dc[s->component] += UADJ(i);
-					
-					/* Calculate closest adjusted DC value */
-					i = AADJ(s->dc[s->component]);
-					ssdv_out_jpeg_int(s, 0, i - s->adc[s->component]);
-					s->adc[s->component] = i;
-				}
+				ssdv_estimate_int(e, q, t, 15, 0);
+				e->accrle[q] -= 16;
 			}
+			ssdv_estimate_int(e, q, t, e->accrle[q], v);
+			e->accrle[q] = 0;
 		}
-		else /* AC */
+		else if(s->acpart >= 63)
 		{
-			if((i = BADJ(i)))
-			{
-				s->accrle += s->acrle;
-				while(s->accrle >= 16)
-				{
-					ssdv_out_jpeg_int(s, 15, 0);
-					s->accrle -= 16;
-				}
-				ssdv_out_jpeg_int(s, s->accrle, i);
-				s->accrle = 0;
-			}
-			else
-			{
-				/* AC value got reduced to 0 in the DQT conversion */
-				if(s->acpart >= 63)
-				{
-					ssdv_out_jpeg_int(s, 0, 0);
-					s->accrle = 0;
-				}
-				else s->accrle += s->acrle + 1;
-			}
+			ssdv_estimate_int(e, q, t, 0, 0);
+			e->accrle[q] = 0;
 		}
-		
-		/* Next AC part to expect */
-		s->acpart++;
-		
-		/* Next bits are a huffman code */
-		s->state = S_HUFF;
-		
-		/* Clear processed bits */
-		s->worklen -= s->needbits;
-		s->workbits &= (1 << s->worklen) - 1;
+		else e->accrle[q] += s->acrle + 1;
 	}
+}
+
+static void ssdv_estimate_mcu(ssdv_t *s)
+{
+	ssdv_estimate_t *e = s->estimate;
+	int q;
 	
-	if(s->acpart >= 64)
+	for(q = 0; q < 8; q++)
 	{
-		/* Reached the end of this MCU part */
-		if(++s->mcupart == s->ycparts + 2)
+		/* The encoder starts a packet's first MCU once the packet holding the
+		 * last one has gone. A packet filled by the last symbol is still held */
+		if(e->part.mark[q] / 8 >= (uint64_t) (e->part.packet[q] + 1) * s->pkt_size_payload)
 		{
-			s->mcupart = 0;
-			s->mcu_id++;
-			
-			/* Test for the end of image */
-			if(s->mcu_id >= s->mcu_count)
-			{
-				/* Flush any remaining bits */
-				ssdv_outbits_sync(s);
-				return(SSDV_EOI);
-			}
-			
-			/* Set the packet MCU marker - encoder only */
-			if(s->mode == S_ENCODING && s->packet_mcu_id == 0xFFFF)
-			{
-				/* The first MCU of each packet should be byte aligned */
-				ssdv_outbits_sync(s);
-				
-				s->reset_mcu = s->mcu_id;
-				s->packet_mcu_id = s->mcu_id;
-				s->packet_mcu_offset = s->pkt_size_payload - s->out_len;
-			}
-			
-			if(s->mode == S_DECODING && s->mcu_id == s->reset_mcu)
-				s->workbits = s->worklen = 0;
-			
-			/* Test for a reset marker */
-			if(s->dri > 0 && s->mcu_id > 0 && s->mcu_id % s->dri == 0)
-			{
-				s->state = S_MARKER;
-				return(SSDV_FEED_ME);
-			}
+			e->part.bits[q] = (e->part.bits[q] + 7) & ~7;
+			e->part.packet[q] = e->part.bits[q] / 8 / s->pkt_size_payload;
+			e->part.reset[q] = 1;
 		}
-		
-		if(s->mcupart < s->ycparts) s->component = 0;
-		else s->component = s->mcupart - s->ycparts + 1;
-		
-		s->acpart = 0;
-		s->accrle = 0;
+		else e->part.reset[q] = 0;
 	}
 	
-	if(s->out_len == 0) return(SSDV_BUFFER_FULL);
-	
-	return(SSDV_OK);
+	/* The tiles are sent one at a time, each starting a new packet */
+	if(e->row) ssdv_estimate_tile(s);
 }
 
-static void ssdv_set_packet_conf(ssdv_t *s)
+/*****************************************************************************/
+
+/* Natural position of each coefficient, in the zig-zag order of the JPEG */
+static const uint8_t zigzag[64] = {
+	 0,  1,  8, 16,  9,  2,  3, 10,
+	17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34,
+	27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36,
+	29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46,
+	53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+/* Fixed point precision of the IDCT constants, and the extra bits
+ * of precision kept between the two passes */
+#define IDCT_CONST_BITS (13)
+#define IDCT_PASS1_BITS (2)
+
+static inline uint8_t ssdv_pixel_clamp(int v)
 {
-	/* Configure the payload size and CRC position */
-	switch(s->type)
-	{
-	case SSDV_TYPE_NORMAL:
-		s->pkt_size_payload = SSDV_PKT_SIZE - SSDV_PKT_SIZE_HEADER - SSDV_PKT_SIZE_CRC - SSDV_PKT_SIZE_RSCODES;
-		s->pkt_size_crcdata = SSDV_PKT_SIZE_HEADER + s->pkt_size_payload - 1;
-		break;
+	return(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+/* One pass of the integer IDCT (the Loeffler, Ligtenberg and Moschytz
+ * method used by the IJG library), down each column of 'in' and along
+ * each row of 'out'. Every column goes through the same steps with no
+ * branches, so the compiler can work on all eight of them at once */
+static void ssdv_idct_pass(const int32_t *in, int32_t *out, int shift)
+{
+	int32_t t0, t1, t2, t3, t10, t11, t12, t13, z1, z2, z3, z4, z5;
+	int32_t round = 1 << (shift - 1);
+	int i;
 	
-	case SSDV_TYPE_NOFEC:
-		s->pkt_size_payload = SSDV_PKT_SIZE - SSDV_PKT_SIZE_HEADER - SSDV_PKT_SIZE_CRC;
-		s->pkt_size_crcdata = SSDV_PKT_SIZE_HEADER + s->pkt_size_payload - 1;
-		break;
+	for(i = 0; i < 8; i++)
+	{
+		/* Even part */
+		z1  = (in[16 + i] + in[48 + i]) * 4433;
+		t2  = z1 - in[48 + i] * 15137;
+		t3  = z1 + in[16 + i] * 6270;
+		t0  = (in[i] + in[32 + i]) * (1 << IDCT_CONST_BITS);
+		t1  = (in[i] - in[32 + i]) * (1 << IDCT_CONST_BITS);
+		t10 = t0 + t3;
+		t13 = t0 - t3;
+		t11 = t1 + t2;
+		t12 = t1 - t2;
+		
+		/* Odd part */
+		t0 = in[56 + i];
+		t1 = in[40 + i];
+		t2 = in[24 + i];
+		t3 = in[8 + i];
+		z1 = t0 + t3;
+		z2 = t1 + t2;
+		z3 = t0 + t2;
+		z4 = t1 + t3;
+		z5 = (z3 + z4) * 9633;
+		t0 *= 2446;
+		t1 *= 16819;
+		t2 *= 25172;
+		t3 *= 12299;
+		z1 *= -7373;
+		z2 *= -20995;
+		z3 = z3 * -16069 + z5;
+		z4 = z4 * -3196 + z5;
+		t0 += z1 + z3;
+		t1 += z2 + z4;
+		t2 += z2 + z3;
+		t3 += z1 + z4;
+		
+		out[i * 8 + 0] = (t10 + t3 + round) >> shift;
+		out[i * 8 + 7] = (t10 - t3 + round) >> shift;
+		out[i * 8 + 1] = (t11 + t2 + round) >> shift;
+		out[i * 8 + 6] = (t11 - t2 + round) >> shift;
+		out[i * 8 + 2] = (t12 + t1 + round) >> shift;
+		out[i * 8 + 5] = (t12 - t1 + round) >> shift;
+		out[i * 8 + 3] = (t13 + t0 + round) >> shift;
+		out[i * 8 + 4] = (t13 - t0 + round) >> shift;
 	}
 }
 
-/*****************************************************************************/
-
-static void ssdv_memset_prng(uint8_t *s, size_t n)
+/* One pass of the integer FDCT, the IJG library's counterpart of the
+ * IDCT above, in the same way down each column of 'in' and along each
+ * row of 'out'. After both passes it gives eight times the DCT */
+static void ssdv_fdct_pass(const int32_t *in, int32_t *out, int shift)
 {
-	/* A very simple PRNG for noise whitening */
-	uint8_t l = 0x00;
-	for(; n > 0; n--) *(s++) = (l = l * 245 + 45);
+	int32_t t0, t1, t2, t3, t4, t5, t6, t7, t10, t11, t12, t13, z1, z2, z3, z4, z5;
+	int32_t round = 1 << (shift - 1);
+	int i;
+	
+	for(i = 0; i < 8; i++)
+	{
+		t0 = in[i] + in[56 + i];
+		t7 = in[i] - in[56 + i];
+		t1 = in[8 + i] + in[48 + i];
+		t6 = in[8 + i] - in[48 + i];
+		t2 = in[16 + i] + in[40 + i];
+		t5 = in[16 + i] - in[40 + i];
+		t3 = in[24 + i] + in[32 + i];
+		t4 = in[24 + i] - in[32 + i];
+		
+		/* Even part */
+		t10 = t0 + t3;
+		t13 = t0 - t3;
+		t11 = t1 + t2;
+		t12 = t1 - t2;
+		z1  = (t12 + t13) * 4433;
+		
+		out[i * 8 + 0] = ((t10 + t11) * (1 << IDCT_CONST_BITS) + round) >> shift;
+		out[i * 8 + 4] = ((t10 - t11) * (1 << IDCT_CONST_BITS) + round) >> shift;
+		out[i * 8 + 2] = (z1 + t13 * 6270 + round) >> shift;
+		out[i * 8 + 6] = (z1 - t12 * 15137 + round) >> shift;
+		
+		/* Odd part */
+		z1 = t4 + t7;
+		z2 = t5 + t6;
+		z3 = t4 + t6;
+		z4 = t5 + t7;
+		z5 = (z3 + z4) * 9633;
+		t4 *= 2446;
+		t5 *= 16819;
+		t6 *= 25172;
+		t7 *= 12299;
+		z1 *= -7373;
+		z2 *= -20995;
+		z3 = z3 * -16069 + z5;
+		z4 = z4 * -3196 + z5;
+		
+		out[i * 8 + 7] = (t4 + z1 + z3 + round) >> shift;
+		out[i * 8 + 5] = (t5 + z2 + z4 + round) >> shift;
+		out[i * 8 + 3] = (t6 + z2 + z3 + round) >> shift;
+		out[i * 8 + 1] = (t7 + z1 + z4 + round) >> shift;
+	}
 }
 
-static char ssdv_have_marker(ssdv_t *s)
+static void ssdv_pixel_mcu(ssdv_t *s)
 {
-	switch(s->marker)
+	/* Each block is 8 x 8 pixels, or only 1 when scaled down */
+	uint8_t sh = s->pixel_scale, bs = 8 >> sh, bw = MCU_WIDTH(s) / 8;
+	uint16_t w = MCU_WIDTH(s) >> sh, h = MCU_HEIGHT(s) >> sh, width = s->width >> sh;
+	uint32_t across = s->width / MCU_WIDTH(s), mx = s->pixel_mcu % across;
+	uint8_t *cb = s->pixel_mcu_buf[s->ycparts], *cr = s->pixel_mcu_buf[s->ycparts + 1];
+	uint8_t *p, *yb;
+	int x, y, c, yy, u, v;
+	
+	for(y = 0; y < h; y++)
 	{
-	case J_SOF0:
-	case J_SOS:
-	case J_DRI:
-	case J_DHT:
-	case J_DQT:
-		/* Copy the data before processing */
-		if(s->marker_len > TBL_LEN + HBUFF_LEN - s->stbl_len)
+		p = &s->pixel_row[((size_t) y * width + mx * w) * 3];
+		
+		for(x = 0; x < w; x++, p += 3)
 		{
-			/* Not enough memory ... shouldn't happen! */
-			return(SSDV_ERROR);
+			/* The Y block covering the pixel, and the chroma sample
+			 * covering it, repeated across a subsampled MCU */
+			yb = s->pixel_mcu_buf[(y / bs) * bw + x / bs];
+			yy = yb[(y % bs) * 8 + (x % bs)];
+			c  = (MCU_HEIGHT(s) == 16 ? y >> 1 : y) * 8 + (MCU_WIDTH(s) == 16 ? x >> 1 : x);
+			
+			if(s->pixel_format == SSDV_PIXELS_YUV)
+			{
+				p[0] = yy;
+				p[1] = cb[c];
+				p[2] = cr[c];
+				continue;
+			}
+			
+			/* JFIF YCbCr to RGB, with 16 bit fixed point constants */
+			u = cb[c] - 128;
+			v = cr[c] - 128;
+			p[0] = ssdv_pixel_clamp(yy + ((91881 * v + 32768) >> 16));
+			p[1] = ssdv_pixel_clamp(yy + ((-22554 * u - 46802 * v + 32768) >> 16));
+			p[2] = ssdv_pixel_clamp(yy + ((116130 * u + 32768) >> 16));
 		}
-		
-		s->marker_data     = &s->stbls[s->stbl_len];
-		s->marker_data_len = 0;
-		s->state           = S_MARKER_DATA;
-		break;
-	
-	case J_SOF2:
-		/* Don't do progressive images! */
-		fprintf(stderr, "Error: Progressive images not supported\n");
-		return(SSDV_ERROR);
+	}
 	
-	case J_EOI:
-		s->state = S_EOI;
-		break;
+	/* Pass on each row of MCUs once it is complete */
+	if(mx == across - 1)
+		s->pixel_sink(s->pixel_arg, s->pixel_row, width, s->pixel_mcu / across * h, h);
 	
-	case J_RST0:
-	case J_RST1:
-	case J_RST2:
-	case J_RST3:
-	case J_RST4:
-	case J_RST5:
-	case J_RST6:
-	case J_RST7:
-		s->dc[0]  = s->dc[1]  = s->dc[2]  = 0;
-		s->mcupart = s->acpart = s->component = 0;
-		s->acrle = s->accrle = 0;
-		s->workbits = s->worklen = 0;
-		s->state = S_HUFF;
-		break;
+	s->pixel_mcu++;
+}
+
+static void ssdv_pixel_block(ssdv_t *s)
+{
+	int32_t a[64], b[64];
+	uint8_t *out = s->pixel_mcu_buf[s->pixel_part];
+	int i;
 	
-	default:
-		/* Ignore other marks, skipping any associated data */
-		s->in_skip = s->marker_len;
-		s->state   = S_MARKER;
-		break;
+	if(s->pixel_scale)
+	{
+		/* Scaled down, the block is the average given by its DC */
+		out[0] = ssdv_pixel_clamp(((s->pixel_block[0] + 4) >> 3) + 128);
+	}
+	else
+	{
+		/* Both passes work down the columns and write along the rows,
+		 * so the second undoes the turn made by the first */
+		for(i = 0; i < 64; i++) a[i] = s->pixel_block[i];
+		ssdv_idct_pass(a, b, IDCT_CONST_BITS - IDCT_PASS1_BITS);
+		ssdv_idct_pass(b, a, IDCT_CONST_BITS + IDCT_PASS1_BITS + 3);
+		for(i = 0; i < 64; i++) out[i] = ssdv_pixel_clamp(a[i] + 128);
+		
+		memset(s->pixel_block, 0, sizeof(s->pixel_block));
 	}
 	
-	return(SSDV_OK);
+	s->pixel_k = 0;
+	
+	if(++s->pixel_part == s->ycparts + 2)
+	{
+		ssdv_pixel_mcu(s);
+		s->pixel_part = 0;
+	}
 }
 
-static char ssdv_have_marker_data(ssdv_t *s)
+/* Decode a symbol of the output JPEG straight to pixels. The decoder
+ * only gives this what it would write to the scan, so the blocks and
+ * MCUs are followed the same way as any JPEG decoder would */
+static void ssdv_pixel_symbol(ssdv_t *s, uint8_t rle, int value)
 {
-	uint8_t *d = s->marker_data;
-	size_t l = s->marker_len;
+	uint8_t c = s->pixel_part < s->ycparts ? 0 : s->pixel_part - s->ycparts + 1;
+	const uint8_t *dqt = &s->ddqt[c ? 1 : 0][1];
 	int i;
 	
-	switch(s->marker)
+	/* Anything past the end of the image is ignored, as it would be in the JPEG */
+	if(s->pixel_mcu >= (uint32_t) (s->width / MCU_WIDTH(s)) * (s->height / MCU_HEIGHT(s))) return;
+	
+	if(s->pixel_k == 0)
 	{
-	case J_SOF0:
-		s->width  = (d[3] << 8) | d[4];
-		s->height = (d[1] << 8) | d[2];
-		
-		/* Display information about the image... */
-		fprintf(stderr, "Precision: %i\n", d[0]);
-		fprintf(stderr, "Resolution: %ix%i\n", s->width, s->height);
-		fprintf(stderr, "Components: %i\n", d[5]);
+		/* The DC is the change from the last block of the component */
+		s->pixel_dc[c] += value;
+		value = s->pixel_dc[c];
+	}
+	else if(rle == 0 && value == 0)
+	{
+		/* EOB, the rest of the block is zero */
+		ssdv_pixel_block(s);
+		return;
+	}
+	else s->pixel_k += rle;
+	
+	/* Dequantise, limited to the range of an 8 bit baseline JPEG.
+	 * Scaled down only the DC is used, the rest just end the block */
+	if(s->pixel_k == 0 || (s->pixel_k < 64 && !s->pixel_scale))
+	{
+		i = value * dqt[s->pixel_k];
+		s->pixel_block[zigzag[s->pixel_k]] = i < -1024 ? -1024 : (i > 1023 ? 1023 : i);
+	}
+	
+	if(++s->pixel_k >= 64) ssdv_pixel_block(s);
+}
+
+static char ssdv_out_jpeg_int(ssdv_t *s, uint8_t rle, int value)
+{
+	uint16_t huffbits = 0;
+	int intbits;
+	uint8_t hufflen = 0, intlen;
+	int r;
+	
+	/* Transcoding a restart interval, keep the value for later */
+	if(s->coef_out) return(ssdv_coef_push(s->coef_out, rle, value));
+	
+	/* Decoding to pixels, nothing is written */
+	if(s->pixel_sink)
+	{
+		ssdv_pixel_symbol(s, rle, value);
+		return(SSDV_OK);
+	}
+	
+	/* A greyscale image only parses the chroma */
+	if(s->grey && s->component && s->mode == S_ENCODING) return(SSDV_OK);
+	
+	/* Only counting bits, this is an EOB or ZRL from the source */
+	if(s->estimate)
+	{
+		ssdv_estimate_symbol(s, rle);
+		return(SSDV_OK);
+	}
+	
+	jpeg_encode_int(value, &intbits, &intlen);
+	
+	/* Only counting the symbols used */
+	if(s->dht_freq)
+	{
+		s->dht_freq[s->acpart ? 1 : 0][s->component ? 1 : 0][(rle << 4) | (intlen & 0x0F)]++;
+		return(SSDV_OK);
+	}
+	
+	r = jpeg_dht_lookup_symbol(s, (rle << 4) | (intlen & 0x0F), &huffbits, &hufflen);
+	
+	if(r != SSDV_OK) fprintf(stderr, "jpeg_dht_lookup_symbol: %i (%i:%i)\n", r, value, rle);
+	
+	/* Write the code and the integer bits together */
+	ssdv_outbits(s, ((uint32_t) huffbits << intlen) | intbits, hufflen + intlen);
+	
+	return(SSDV_OK);
+}
+
+static void ssdv_process_dc(ssdv_t *s, int i)
+{
+	/* A greyscale image only parses the chroma, unless keeping it for later */
+	if(s->grey && s->component && s->mode == S_ENCODING && !s->coef_out) return;
+	
+	if(s->estimate)
+	{
+		ssdv_estimate_dc(s, i);
+		return;
+	}
+	
+	/* Each block of a region of interest image is on the scale of its own
+	 * region, the decoder brings the DC to the output's */
+	if(s->roi && s->mode == S_DECODING)
+	{
+		if(s->reset_mcu == s->mcu_id && (s->mcupart == 0 || s->mcupart >= s->ycparts))
+			s->dc[s->component] = i;
+		else s->dc[s->component] += i;
 		
-		/* The image must have a precision of 8 */
-		if(d[0] != 8)
+		i = BADJ(s->dc[s->component]);
+		if(s->coef_out) ssdv_coef_push(s->coef_out, 0, i);
+		else ssdv_out_jpeg_int(s, 0, i - s->adc[s->component]);
+		s->adc[s->component] = i;
+		return;
+	}
+	
+	/* A DC difference of 0 (symbol 0x00) is handled like any other value, the
+	 * adjusted DC must still be recalculated after a reset marker */
+	if(s->reset_mcu == s->mcu_id && (s->mcupart == 0 || s->mcupart >= s->ycparts))
+	{
+		if(s->mode == S_ENCODING)
 		{
-			fprintf(stderr, "Error: The image must have a precision of 8\n");
-			return(SSDV_ERROR);
+			/* Output absolute DC value */
+			s->dc[s->component] += UADJ(i);
+			s->adc[s->component] = AADJ(s->dc[s->component]);
+			ssdv_out_jpeg_int(s, 0, s->adc[s->component]);
 		}
-		
-		/* The image must have 3 components (Y'Cb'Cr) */
-		if(d[5] != 3)
+		else
 		{
-			fprintf(stderr, "Error: The image must have 3 components\n");
-			return(SSDV_ERROR);
+			/* Output relative DC value, or keep the absolute one */
+			if(s->coef_out) ssdv_coef_push(s->coef_out, 0, i);
+			else ssdv_out_jpeg_int(s, 0, i - s->dc[s->component]);
+			s->dc[s->component] = i;
 		}
-		
-		/* Maximum image is 4080x4080 */
-		if(s->width > 4080 || s->height > 4080)
+	}
+	else
+	{
+		if(s->mode == S_DECODING)
 		{
-			fprintf(stderr, "Error: The image is too big. Maximum resolution is 4080x4080\n");
-			return(SSDV_ERROR);
+			/* Kept MCUs are written out of order, so keep them absolute */
+			s->dc[s->component] += UADJ(i);
+			if(s->kept_mcu) ssdv_coef_push(s->coef_out, 0, s->dc[s->component]);
+			else if(s->coef_out) ssdv_coef_push(s->coef_out, SSDV_COEF_DIFF, i);
+			else ssdv_out_jpeg_int(s, 0, i);
 		}
-		
-		/* The image dimensions must be a multiple of 16 */
-		if((s->width & 0x0F) || (s->height & 0x0F))
+		else
 		{
-			fprintf(stderr, "Error: The image dimensions must be a multiple of 16\n");
-			return(SSDV_ERROR);
+			/* Output relative DC value */
+			s->dc[s->component] += UADJ(i);
+			
+			/* Calculate closest adjusted DC value */
+			i = AADJ(s->dc[s->component]);
+			ssdv_out_jpeg_int(s, 0, i - s->adc[s->component]);
+			s->adc[s->component] = i;
 		}
-		
-		/* TODO: Read in the quantisation table ID for each component */
-		// 01 22 00 02 11 01 03 11 01
-		for(i = 0; i < 3; i++)
+	}
+}
+
+static void ssdv_process_ac(ssdv_t *s, int i)
+{
+	if(s->grey && s->component && s->mode == S_ENCODING && !s->coef_out) return;
+	
+	if(s->estimate)
+	{
+		ssdv_estimate_ac(s, i);
+		return;
+	}
+	
+	if((i = BADJ(i)))
+	{
+		s->accrle += s->acrle;
+		while(s->accrle >= 16)
 		{
-			uint8_t *dq = &d[i * 3 + 6];
-			if(dq[0] != i + 1)
-			{
-				fprintf(stderr, "Error: Components are not in order in the SOF0 header\n");
-				return(SSDV_ERROR);
-			}
-			
-			fprintf(stderr, "DQT table for component %i: %02X, Sampling factor: %ix%i\n", dq[0], dq[2], dq[1] & 0x0F, dq[1] >> 4);
-			
-			/* The first (Y) component must have a factor of 2x2,2x1,1x2 or 1x1 */
-			if(dq[0] == 1)
-			{
-				switch(dq[1])
-				{
-				case 0x22: s->mcu_mode = 0; s->ycparts = 4; break;
-				case 0x12: s->mcu_mode = 1; s->ycparts = 2; break;
-				case 0x21: s->mcu_mode = 2; s->ycparts = 2; break;
-				case 0x11: s->mcu_mode = 3; s->ycparts = 1; break;
-				default:
-					fprintf(stderr, "Error: Component 1 sampling factor is not supported\n");
-					return(SSDV_ERROR);
-				}
-			}
-			else if(dq[0] != 1 && dq[1] != 0x11)
-			{
-				fprintf(stderr, "Error: Component %i sampling factor must be 1x1\n", dq[0]);
-				return(SSDV_ERROR);
-			}
+			ssdv_out_jpeg_int(s, 15, 0);
+			s->accrle -= 16;
 		}
-		
-		/* Calculate number of MCU blocks in this image */
-		switch(s->mcu_mode)
+		ssdv_out_jpeg_int(s, s->accrle, i);
+		s->accrle = 0;
+	}
+	else
+	{
+		/* AC value got reduced to 0 in the DQT conversion */
+		if(s->acpart >= 63)
 		{
-		case 0: l = (s->width >> 4) * (s->height >> 4); break;
-		case 1: l = (s->width >> 4) * (s->height >> 3); break;
-		case 2: l = (s->width >> 3) * (s->height >> 4); break;
-		case 3: l = (s->width >> 3) * (s->height >> 3); break;
+			ssdv_out_jpeg_int(s, 0, 0);
+			s->accrle = 0;
 		}
+		else s->accrle += s->acrle + 1;
+	}
+}
+
+static void ssdv_dec_grey_chroma(ssdv_t *s)
+{
+	/* Write empty chroma blocks after the Y parts, for a grey image */
+	for(; s->mcupart < s->ycparts + 2; s->mcupart++)
+	{
+		s->component = s->mcupart - s->ycparts + 1;
+		s->acpart = 0;
+		ssdv_process_dc(s, 0);
+		s->acpart = 1;
+		ssdv_out_jpeg_int(s, 0, 0);
+		if(s->coef_out) ssdv_coef_push(s->coef_out, SSDV_COEF_END, 0);
+	}
+}
+
+static char ssdv_process_block(ssdv_t *s)
+{
+	uint8_t symbol, width, needbits;
+	char r = SSDV_FEED_ME;
+	int i;
+	
+	/* Transcode the rest of the current block in one pass, stopping
+	 * early at the edge of the input or output buffers */
+	while(s->acpart < s->acend && s->out_len > 0)
+	{
+		/* Top up the work area, but never read an 0xFF that may be a marker */
+		if(s->worklen < 32 && s->in_len && !s->in_skip && (!s->in_stuff || *s->inp != 0xFF))
+			ssdv_inbits(s);
 		
-		fprintf(stderr, "MCU blocks: %i\n", (int) l);
+		/* Lookup the code, leave the edge cases to the state machine */
+		if((i = jpeg_dht_lookup(s, &symbol, &width)) != SSDV_OK)
+			return(i == SSDV_FEED_ME ? r : SSDV_ERROR);
 		
-		if(l > 0xFFFF)
-		{
-			fprintf(stderr, "Error: Maximum number of MCU blocks is 65535\n");
-			return(SSDV_ERROR);
-		}
+		if(s->acpart == 0) needbits = symbol;
+		else needbits = symbol & 0x0F;
 		
-		s->mcu_count = l;
+		if(needbits > 16 || width + needbits > s->worklen) break;
 		
-		break;
-	
-	case J_SOS:
-		fprintf(stderr, "Components: %i\n", d[0]);
+		/* A run past the end of the block is corrupt data */
+		if(s->acpart > 0 && s->acpart + (symbol >> 4) >= s->acend && symbol != 0xF0) break;
 		
-		/* The image must have 3 components (Y'Cb'Cr) */
-		if(d[0] != 3)
+		/* Decode the integer */
+		s->worklen -= width;
+		i = jpeg_int(ssdv_peekbits(s, needbits), needbits);
+		s->worklen -= needbits;
+		r = SSDV_OK;
+		
+		if(s->acpart == 0) /* DC */
 		{
-			fprintf(stderr, "Error: The image must have 3 components\n");
-			return(SSDV_ERROR);
+			ssdv_process_dc(s, i);
+			s->acpart++;
+		}
+		else if(symbol == 0x00)
+		{
+			/* EOB -- all remaining AC parts are zero */
+			ssdv_out_jpeg_int(s, 0, 0);
+			s->acpart = s->acend;
+		}
+		else if(symbol == 0xF0)
+		{
+			/* The next 16 AC parts are zero */
+			ssdv_out_jpeg_int(s, 15, 0);
+			s->acpart += 16;
+		}
+		else
+		{
+			s->acrle = symbol >> 4;
+			s->acpart += s->acrle;
+			ssdv_process_ac(s, i);
+			s->acpart++;
+		}
+	}
+	
+	return(r);
+}
+
+static char ssdv_process_replay(ssdv_t *s)
+{
+	ssdv_coef_t *c;
+	char r = SSDV_ERROR;
+	
+	/* Packetise the rest of the current block from the transcoded intervals */
+	while(s->acpart < 64 && s->out_len > 0)
+	{
+		/* A tile takes its MCUs from anywhere in the image */
+		if(s->mcu_coef)
+		{
+			if(s->mcupart == 0 && s->acpart == 0)
+				s->coef = s->mcu_coef[ssdv_tile_mcu(s, s->mcu_id)];
 		}
 		
-		for(i = 0; i < 3; i++)
+		/* Move on to the next interval */
+		else if(s->coef == s->intervals[s->interval].coef + s->intervals[s->interval].coef_len)
 		{
-			uint8_t *dh = &d[i * 2 + 1];
-			if(dh[0] != i + 1)
-			{
-				fprintf(stderr, "Error: Components are not in order in the SOF0 header\n");
-				return(SSDV_ERROR);
-			}
-			
-			fprintf(stderr, "Component %i DHT: %02X\n", dh[0], dh[1]);
+			if(++s->interval == s->intervals_len) return(SSDV_ERROR);
+			s->coef = s->intervals[s->interval].coef;
 		}
 		
-		/* Do I need to look at the last three bytes of the SOS data? */
-		/* 00 3F 00 */
+		c = s->coef++;
+		r = SSDV_OK;
 		
-		/* Verify all of the DQT and DHT tables where loaded */
-		if(!s->sdqt[0] || !s->sdqt[1])
+		if(s->acpart == 0)
 		{
-			fprintf(stderr, "Error: The image is missing one or more DQT tables\n");
-			return(SSDV_ERROR);
+			/* DC, absolute for the first MCU of a packet */
+			if(s->reset_mcu == s->mcu_id && (s->mcupart == 0 || s->mcupart >= s->ycparts))
+				ssdv_out_jpeg_int(s, 0, c->value);
+			else
+				ssdv_out_jpeg_int(s, 0, c->value - s->adc[s->component]);
+			
+			s->adc[s->component] = c->value;
+			s->acpart++;
 		}
+		else ssdv_out_jpeg_int(s, c->rle, c->value);
 		
-		if(!s->sdht[0][0] || !s->sdht[0][1] ||
-		   !s->sdht[1][0] || !s->sdht[1][1])
+		/* End the block with its last value, as ssdv_process_block() does */
+		if(s->coef->rle == SSDV_COEF_END)
 		{
-			fprintf(stderr, "Error: The image is missing one or more DHT tables\n");
-			return(SSDV_ERROR);
+			s->coef++;
+			s->acpart = 64;
+		}
+	}
+	
+	return(r);
+}
+
+static char ssdv_process_layer(ssdv_t *s)
+{
+	char r = SSDV_ERROR;
+	int k, v;
+	
+	/* Packetise the current layer's band of the block */
+	while(s->acpart < s->acend && s->out_len > 0)
+	{
+		/* Unpack the block when starting on it */
+		if(s->acpart == s->acstart)
+		{
+			if(s->mcupart == 0) s->coef = s->mcu_coef[ssdv_tile_mcu(s, s->mcu_id)];
+			memset(s->block, 0, sizeof(s->block));
+			s->coef = ssdv_coef_expand(s->coef, 0, s->block);
+			s->accrle = 0;
 		}
 		
-		/* The SOS data is followed by the image data */
-		s->state = S_HUFF;
+		k = s->acpart;
+		v = s->block[k];
+		r = SSDV_OK;
 		
-		return(SSDV_OK);
+		if(k == 0)
+		{
+			/* DC, absolute for the first MCU of a packet */
+			if(s->reset_mcu == s->mcu_id && (s->mcupart == 0 || s->mcupart >= s->ycparts))
+				ssdv_out_jpeg_int(s, 0, v);
+			else
+				ssdv_out_jpeg_int(s, 0, v - s->adc[s->component]);
+			
+			s->adc[s->component] = v;
+		}
+		else if(v == 0)
+		{
+			/* End the band early if the rest of it is zero */
+			s->accrle++;
+			if(k + 1 == s->acend) ssdv_out_jpeg_int(s, 0, 0);
+		}
+		else
+		{
+			while(s->accrle >= 16)
+			{
+				ssdv_out_jpeg_int(s, 15, 0);
+				s->accrle -= 16;
+			}
+			ssdv_out_jpeg_int(s, s->accrle, v);
+			s->accrle = 0;
+		}
+		
+		s->acpart++;
+	}
 	
-	case J_DHT:
-		s->stbl_len += l;
-		while(l > 0)
+	return(r);
+}
+
+static char ssdv_process(ssdv_t *s)
+{
+	char r = SSDV_FEED_ME;
+	
+	/* Use the fast path while there are enough bits buffered */
+	if(s->state == S_HUFF)
+	{
+		if(s->layered && s->mcu_coef) r = ssdv_process_layer(s);
+		else if(s->coef) r = ssdv_process_replay(s);
+		else r = ssdv_process_block(s);
+	}
+	
+	if(r == SSDV_ERROR) return(r);
+	else if(r == SSDV_OK) { /* Progress was made */ }
+	else if(s->state == S_HUFF)
+	{
+		uint8_t symbol, width;
+		
+		/* Lookup the code, return if error or not enough bits yet */
+		if((r = jpeg_dht_lookup(s, &symbol, &width)) != SSDV_OK)
+			return(r);
+		
+		if(s->acpart == 0) /* DC */
+		{
+			if(symbol == 0x00)
+			{
+				ssdv_process_dc(s, 0);
+				
+				/* skip to the next AC part immediately */
+				s->acpart++;
+			}
+			else
+			{
+				/* DC value follows, 'symbol' bits wide */
+				s->state = S_INT;
+				s->needbits = symbol;
+			}
+		}
+		else /* AC */
+		{
+			s->acrle = 0;
+			if(symbol == 0x00)
+			{
+				/* EOB -- all remaining AC parts are zero */
+				ssdv_out_jpeg_int(s, 0, 0);
+				s->acpart = s->acend;
+			}
+			else if(symbol == 0xF0)
+			{
+				/* The next 16 AC parts are zero */
+				ssdv_out_jpeg_int(s, 15, 0);
+				s->acpart += 16;
+			}
+			else
+			{
+				/* Next bits are an integer value */
+				s->state = S_INT;
+				s->acrle = symbol >> 4;
+				s->acpart += s->acrle;
+				s->needbits = symbol & 0x0F;
+			}
+		}
+		
+		/* Clear processed bits */
+		s->worklen -= width;
+	}
+	else if(s->state == S_INT)
+	{
+		int i;
+		
+		/* Not enough bits yet? */
+		if(s->worklen < s->needbits) return(SSDV_FEED_ME);
+		
+		/* Decode the integer */
+		i = jpeg_int(ssdv_peekbits(s, s->needbits), s->needbits);
+		
+		if(s->acpart == 0) ssdv_process_dc(s, i); /* DC */
+		else ssdv_process_ac(s, i); /* AC */
+		
+		/* Next AC part to expect */
+		s->acpart++;
+		
+		/* Next bits are a huffman code */
+		s->state = S_HUFF;
+		
+		/* Clear processed bits */
+		s->worklen -= s->needbits;
+	}
+	
+	if(s->acpart >= s->acend)
+	{
+		/* Keeping coefficients, mark the end of the block */
+		if(s->coef_out) ssdv_coef_push(s->coef_out, SSDV_COEF_END, 0);
+		
+		/* The decoder writes zero chroma for a greyscale image */
+		if(++s->mcupart == s->ycparts && s->grey && s->mode == S_DECODING)
+			ssdv_dec_grey_chroma(s);
+		
+		/* Reached the end of this MCU part */
+		if(s->mcupart == s->ycparts + 2)
+		{
+			/* Decoding a tile or layer, keep the MCU for its place in the image */
+			if(s->kept_mcu)
+			{
+				uint32_t n = ssdv_kept_mcu(s, s->mcu_id);
+				
+				/* A stray MCU number is never written outside the image */
+				if(n < ssdv_kept_count(s)) s->kept_mcu[n] = s->kept_start;
+				s->kept_start = s->kept.coef_len;
+			}
+			
+			s->mcupart = 0;
+			s->mcu_id++;
+			if(s->roi) s->inroi = ssdv_roi_mcu(s, s->mcu_id);
+			
+			/* Test for the end of image */
+			if(s->mcu_id >= s->mcu_count)
+			{
+				/* Flush any remaining bits */
+				ssdv_outbits_sync(s);
+				return(SSDV_EOI);
+			}
+			
+			/* Only counting bits, move the packet MCU markers */
+			if(s->estimate) ssdv_estimate_mcu(s);
+			
+			/* Set the packet MCU marker - encoder only */
+			if(s->mode == S_ENCODING && s->packet_mcu_id == 0xFFFF)
+			{
+				/* The first MCU of each packet should be byte aligned */
+				ssdv_outbits_sync(s);
+				
+				s->reset_mcu = s->mcu_id;
+				s->packet_mcu_id = s->mcu_id;
+				s->packet_mcu_offset = s->pkt_size_payload - s->out_len;
+			}
+			
+			/* Drop the padding bits before the packet's first MCU */
+			if(s->mode == S_DECODING && s->mcu_id == s->reset_mcu)
+				s->worklen -= s->worklen % 8;
+			
+			/* Test for a reset marker, unless they were already removed */
+			if(s->dri > 0 && !s->coef && s->mcu_id > 0 && s->mcu_id % s->dri == 0)
+			{
+				s->state = S_MARKER;
+				return(SSDV_FEED_ME);
+			}
+		}
+		
+		if(s->mcupart < s->ycparts) s->component = 0;
+		else s->component = s->mcupart - s->ycparts + 1;
+		
+		s->acpart = s->acstart;
+		s->accrle = 0;
+	}
+	
+	if(s->out_len == 0) return(SSDV_BUFFER_FULL);
+	
+	return(SSDV_OK);
+}
+
+static char ssdv_process_all(ssdv_t *s)
+{
+	char r;
+	STATS_START(t);
+	
+	while((r = ssdv_process(s)) == SSDV_OK);
+	
+	STATS_STOP(&s->stats, ns_process, t);
+	return(r);
+}
+
+static void ssdv_set_packet_conf(ssdv_t *s)
+{
+	/* The header of a tiled, layered or thumbnail image is longer, leaving less for the payload */
+	s->pkt_size_header = SSDV_PKT_SIZE_HEADER;
+	if(s->tiled || s->layered || s->thumb || s->roi || s->grey) s->pkt_size_header += SSDV_PKT_SIZE_EXT;
+	if(s->tiled) s->pkt_size_header += SSDV_PKT_SIZE_TILE;
+	if(s->roi) s->pkt_size_header += SSDV_PKT_SIZE_ROI;
+	
+	/* Configure the payload size and CRC position */
+	switch(s->type)
+	{
+	case SSDV_TYPE_NORMAL:
+		s->pkt_size_payload = SSDV_PKT_SIZE - s->pkt_size_header - SSDV_PKT_SIZE_CRC - SSDV_PKT_SIZE_RSCODES;
+		s->pkt_size_crcdata = s->pkt_size_header + s->pkt_size_payload - 1;
+		break;
+	
+	case SSDV_TYPE_NOFEC:
+		s->pkt_size_payload = SSDV_PKT_SIZE - s->pkt_size_header - SSDV_PKT_SIZE_CRC;
+		s->pkt_size_crcdata = s->pkt_size_header + s->pkt_size_payload - 1;
+		break;
+	}
+}
+
+static void ssdv_put_tile(uint8_t *p, uint16_t a, uint16_t b)
+{
+	/* Two sizes in pixels, as 12-bit multiples of 16 */
+	a >>= 4;
+	b >>= 4;
+	p[0] = a >> 4;
+	p[1] = ((a & 0x0F) << 4) | (b >> 8);
+	p[2] = b & 0xFF;
+}
+
+static void ssdv_put_roi(ssdv_t *s, uint8_t *p)
+{
+	uint16_t x0, y0, x1, y1, w, h;
+	
+	/* The part of the region inside the tile, relative to its origin */
+	w = s->tiled ? s->tile_width : s->width;
+	h = s->tiled ? s->tile_height : s->height;
+	x0 = s->roi_x > s->tile_x ? s->roi_x - s->tile_x : 0;
+	y0 = s->roi_y > s->tile_y ? s->roi_y - s->tile_y : 0;
+	x1 = s->roi_x + s->roi_width > s->tile_x ? s->roi_x + s->roi_width - s->tile_x : 0;
+	y1 = s->roi_y + s->roi_height > s->tile_y ? s->roi_y + s->roi_height - s->tile_y : 0;
+	if(x1 > w) x1 = w;
+	if(y1 > h) y1 = h;
+	if(x0 > x1) x0 = x1;
+	if(y0 > y1) y0 = y1;
+	
+	p[0] = s->roi_quality;
+	p[1] = x0 >> 4;
+	p[2] = y0 >> 4;
+	p[3] = (x1 - x0) >> 4;
+	p[4] = (y1 - y0) >> 4;
+}
+
+static void ssdv_get_tile(const uint8_t *p, uint16_t *a, uint16_t *b)
+{
+	*a = ((p[0] << 4) | (p[1] >> 4)) << 4;
+	*b = (((p[1] & 0x0F) << 8) | p[2]) << 4;
+}
+
+static uint16_t ssdv_roi_offset(const uint8_t *packet)
+{
+	/* The region of interest follows the tile, if there is one */
+	if(!(packet[15] & SSDV_EXT_TILE)) return(SSDV_PKT_SIZE_HEADER + SSDV_PKT_SIZE_EXT);
+	return(SSDV_PKT_SIZE_HEADER + SSDV_PKT_SIZE_EXT + SSDV_PKT_SIZE_TILE);
+}
+
+static uint16_t ssdv_header_size(const uint8_t *packet)
+{
+	/* The length of a packet's header, with any extension */
+	if(!(packet[11] & SSDV_FLAG_EXT)) return(SSDV_PKT_SIZE_HEADER);
+	if(!(packet[15] & SSDV_EXT_ROI)) return(ssdv_roi_offset(packet));
+	return(ssdv_roi_offset(packet) + SSDV_PKT_SIZE_ROI);
+}
+
+static void ssdv_get_roi(const uint8_t *packet, uint8_t *quality, uint16_t *x, uint16_t *y, uint16_t *w, uint16_t *h)
+{
+	const uint8_t *p = &packet[ssdv_roi_offset(packet)];
+	
+	/* The quality level, then the region in multiples of 16 pixels */
+	*quality = p[0] & 7;
+	*x = p[1] << 4;
+	*y = p[2] << 4;
+	*w = p[3] << 4;
+	*h = p[4] << 4;
+}
+
+/*****************************************************************************/
+
+static char ssdv_transcode_interval(ssdv_t *s, ssdv_interval_t *iv)
+{
+	uint8_t symbol, width, needbits;
+	uint32_t mcu;
+	int i;
+	
+	/* Each interval starts with the DC predictions reset */
+	s->inp = iv->data;
+	s->in_len = iv->length;
+	s->in_skip = 0;
+	s->workbits = s->worklen = 0;
+	s->dc[0] = s->dc[1] = s->dc[2] = 0;
+	s->coef_out = iv;
+	iv->r = SSDV_OK;
+	
+	for(mcu = 0; mcu < iv->mcus; mcu++)
+	{
+		if(s->roi) s->inroi = ssdv_roi_mcu(s, (iv - s->intervals) * s->dri + mcu);
+		
+		for(s->mcupart = 0; s->mcupart < s->ycparts + 2; s->mcupart++)
+		{
+			if(s->mcupart < s->ycparts) s->component = 0;
+			else s->component = s->mcupart - s->ycparts + 1;
+			
+			s->acpart = 0;
+			s->accrle = 0;
+			
+			/* The same steps as ssdv_process_block(), with the
+			 * output going to the interval's coefficient list */
+			while(s->acpart < 64)
+			{
+				while(s->worklen < 32 && s->in_len) ssdv_inbits(s);
+				
+				if(jpeg_dht_lookup(s, &symbol, &width) != SSDV_OK) return(SSDV_ERROR);
+				
+				if(s->acpart == 0) needbits = symbol;
+				else needbits = symbol & 0x0F;
+				
+				if(needbits > 16 || width + needbits > s->worklen) return(SSDV_ERROR);
+				
+				s->worklen -= width;
+				i = jpeg_int(ssdv_peekbits(s, needbits), needbits);
+				s->worklen -= needbits;
+				
+				if(s->acpart == 0)
+				{
+					/* Keep the absolute adjusted DC value, the packetiser
+					 * decides if it's sent absolute or relative */
+					s->dc[s->component] += UADJ(i);
+					ssdv_coef_push(iv, 0, AADJ(s->dc[s->component]));
+					s->acpart++;
+				}
+				else if(symbol == 0x00)
+				{
+					ssdv_out_jpeg_int(s, 0, 0);
+					s->acpart = 64;
+				}
+				else if(symbol == 0xF0)
+				{
+					ssdv_out_jpeg_int(s, 15, 0);
+					s->acpart += 16;
+				}
+				else
+				{
+					s->acrle = symbol >> 4;
+					s->acpart += s->acrle;
+					ssdv_process_ac(s, i);
+					s->acpart++;
+				}
+			}
+			
+			ssdv_coef_push(iv, SSDV_COEF_END, 0);
+		}
+	}
+	
+	return(iv->r);
+}
+
+typedef struct {
+	ssdv_t *s;
+	int first;
+	int step;
+	ssdv_stats_t stats; /* Counted by this worker alone */
+} ssdv_interval_worker_t;
+
+static void *ssdv_interval_worker(void *arg)
+{
+	ssdv_interval_worker_t *w = arg;
+	ssdv_t *s;
+	int i;
+	
+	/* Work on a private copy of the encoder state */
+	s = malloc(sizeof(ssdv_t));
+	if(!s) return(NULL);
+	
+	memcpy(s, w->s, sizeof(ssdv_t));
+	memset(&s->stats, 0, sizeof(ssdv_stats_t));
+	
+	for(i = w->first; i < w->s->intervals_len; i += w->step)
+		w->s->intervals[i].r = ssdv_transcode_interval(s, &w->s->intervals[i]);
+	
+	w->stats = s->stats;
+	free(s);
+	
+	return(NULL);
+}
+
+#ifdef SSDV_STATS
+static void ssdv_stats_add(ssdv_stats_t *st, const ssdv_stats_t *add)
+{
+	uint64_t *a = (uint64_t *) st;
+	const uint64_t *b = (const uint64_t *) add;
+	size_t i;
+	
+	/* The stats are all 64-bit counters */
+	for(i = 0; i < sizeof(ssdv_stats_t) / sizeof(uint64_t); i++)
+		a[i] += b[i];
+}
+#endif
+
+static void ssdv_free_intervals(ssdv_t *s)
+{
+	int i;
+	
+	if(!s->intervals) return;
+	
+	for(i = 0; i < s->intervals_len; i++)
+		free(s->intervals[i].coef);
+	
+	free(s->intervals);
+	s->intervals = NULL;
+	s->intervals_len = 0;
+	s->coef = NULL;
+	
+	free(s->mcu_coef);
+	s->mcu_coef = NULL;
+}
+
+static char ssdv_enc_transcode_intervals(ssdv_t *s)
+{
+	ssdv_interval_worker_t w[SSDV_MAX_THREADS];
+#ifdef SSDV_THREADS
+	pthread_t t[SSDV_MAX_THREADS];
+	char started[SSDV_MAX_THREADS];
+#endif
+	ssdv_interval_t *iv;
+	uint8_t *p = s->inp, *e = s->inp + s->in_len, *end = NULL;
+	int i, count, threads;
+	
+	/* Without restart markers the whole scan is one interval */
+	count = s->dri ? (s->mcu_count + s->dri - 1) / s->dri : 1;
+	
+	s->intervals = calloc(count, sizeof(ssdv_interval_t));
+	if(!s->intervals) return(SSDV_ERROR);
+	s->intervals_len = count;
+	
+	/* Split the scan at the RST markers. The whole scan must already
+	 * be in the input buffer, up to the marker that ends it */
+	iv = &s->intervals[0];
+	iv->data = p;
+	
+	for(i = 0; !end && (p = memchr(p, 0xFF, e - p)) && p + 1 < e; )
+	{
+		/* Skip stuffing and fill bytes */
+		if(p[1] == 0x00 || p[1] == 0xFF) { p++; continue; }
+		
+		iv->length = p - iv->data;
+		iv->mcus = s->dri;
+		iv->r = SSDV_ERROR;
+		
+		if(p[1] >= (J_RST0 & 0xFF) && p[1] <= (J_RST7 & 0xFF))
+		{
+			/* A restart interval ends here */
+			if(++i == count) break;
+			iv = &s->intervals[i];
+			iv->data = p += 2;
+		}
+		else end = p;
+	}
+	
+	/* Only use the intervals if they match the image */
+	if(!end || i != count - 1)
+	{
+		ssdv_free_intervals(s);
+		return(SSDV_FEED_ME);
+	}
+	
+	iv->mcus = s->mcu_count - s->dri * (count - 1);
+	
+	threads = s->threads > 1 ? s->threads : 1;
+	if(threads > count) threads = count;
+	for(i = 0; i < threads; i++)
+	{
+		w[i].s = s;
+		w[i].first = i;
+		w[i].step = threads;
+		memset(&w[i].stats, 0, sizeof(ssdv_stats_t));
+	}
+	
+#ifdef SSDV_THREADS
+	for(i = 1; i < threads; i++)
+		started[i] = pthread_create(&t[i], NULL, ssdv_interval_worker, &w[i]) == 0;
+	
+	ssdv_interval_worker(&w[0]);
+	
+	for(i = 1; i < threads; i++)
+	{
+		if(started[i]) pthread_join(t[i], NULL);
+		else ssdv_interval_worker(&w[i]);
+	}
+#else
+	for(i = 0; i < threads; i++)
+		ssdv_interval_worker(&w[i]);
+#endif
+	
+#ifdef SSDV_STATS
+	/* The workers' counters are added in once they have all finished */
+	for(i = 0; i < threads; i++)
+		ssdv_stats_add(&s->stats, &w[i].stats);
+#endif
+	
+	for(i = 0; i < count; i++)
+	{
+		if(s->intervals[i].r != SSDV_OK)
+		{
+			/* Leave a damaged image to the normal path */
+			ssdv_free_intervals(s);
+			return(SSDV_ERROR);
+		}
+	}
+	
+	/* Packetise from the transcoded intervals, continuing at the end marker */
+	s->interval = 0;
+	s->coef = s->intervals[0].coef;
+	s->inp = end;
+	s->in_len = e - end;
+	
+	return(SSDV_OK);
+}
+
+static void ssdv_enc_next_part(ssdv_t *s)
+{
+	/* The tiles are sent left to right, top to bottom, and each
+	 * layer for all of the tiles before the next one */
+	if(s->tile_width == 0) s->tile_x = s->tile_y = s->layer = 0;
+	else if((s->tile_x += s->tile_size_w) >= s->width)
+	{
+		s->tile_x = 0;
+		if((s->tile_y += s->tile_size_h) >= s->height)
+		{
+			s->tile_y = 0;
+			s->layer++;
+		}
+	}
+	
+	/* The last tile of each row and column may be smaller */
+	s->tile_width  = s->width  - s->tile_x < s->tile_size_w ? s->width  - s->tile_x : s->tile_size_w;
+	s->tile_height = s->height - s->tile_y < s->tile_size_h ? s->height - s->tile_y : s->tile_size_h;
+	s->mcu_count = (s->tile_width / MCU_WIDTH(s)) * (s->tile_height / MCU_HEIGHT(s));
+	s->acstart = LAYER_START(s, s->layer);
+	s->acend = LAYER_END(s, s->layer);
+	
+	/* Each part starts a new packet with an absolute DC */
+	s->mcu_id = 0;
+	s->reset_mcu = 0;
+	s->packet_mcu_id = 0;
+	s->packet_mcu_offset = 0;
+	s->component = 0;
+	s->mcupart = 0;
+	s->acpart = s->acstart;
+	s->accrle = 0;
+}
+
+static ssdv_coef_t *ssdv_thumb_pixels(ssdv_t *s, ssdv_coef_t *c, uint8_t component, uint8_t *p, size_t stride)
+{
+	const uint8_t *dqt = &s->ddqt[component ? 1 : 0][1];
+	int32_t a[64], b[64];
+	int block[64], size = 1 << (s->thumb - 1), n = 8 / size;
+	int i, v, x, y, sum;
+	
+	/* Dequantise the transcoded block, as the decoder would */
+	memset(block, 0, sizeof(block));
+	c = ssdv_coef_expand(c, 0, block);
+	
+	for(i = 0; i < 64; i++)
+	{
+		v = block[i] * dqt[i];
+		a[zigzag[i]] = v < -1024 ? -1024 : (v > 1023 ? 1023 : v);
+	}
+	
+	/* At 1/8 scale the block is one pixel, the average given by its DC */
+	if(size == 1)
+	{
+		p[0] = ssdv_pixel_clamp(((a[0] + 4) >> 3) + 128);
+		return(c);
+	}
+	
+	/* Otherwise each pixel is the average of an n x n square of the block */
+	ssdv_idct_pass(a, b, IDCT_CONST_BITS - IDCT_PASS1_BITS);
+	ssdv_idct_pass(b, a, IDCT_CONST_BITS + IDCT_PASS1_BITS + 3);
+	
+	for(y = 0; y < size; y++)
+	{
+		for(x = 0; x < size; x++)
+		{
+			for(sum = i = 0; i < n * n; i++)
+				sum += ssdv_pixel_clamp(a[(y * n + i / n) * 8 + x * n + i % n] + 128);
+			
+			p[y * stride + x] = (sum + n * n / 2) / (n * n);
+		}
+	}
+	
+	return(c);
+}
+
+static void ssdv_thumb_block(ssdv_t *s, ssdv_interval_t *iv, uint8_t component, const uint8_t *p, size_t stride)
+{
+	const uint8_t *dqt = &s->ddqt[component ? 1 : 0][1];
+	int32_t a[64], b[64];
+	int k, q, v, rle;
+	
+	for(k = 0; k < 64; k++)
+		a[k] = p[(k >> 3) * stride + (k & 7)] - 128;
+	
+	ssdv_fdct_pass(a, b, IDCT_CONST_BITS - IDCT_PASS1_BITS);
+	ssdv_fdct_pass(b, a, IDCT_CONST_BITS + IDCT_PASS1_BITS);
+	
+	/* Quantise in zig-zag order, taking out the DCT's factor of eight,
+	 * and keep the block as ssdv_transcode_interval() would */
+	for(rle = k = 0; k < 64; k++)
+	{
+		q = dqt[k] * 8;
+		v = a[zigzag[k]];
+		v = v < 0 ? -((q / 2 - v) / q) : (v + q / 2) / q;
+		v = v < -1023 ? -1023 : (v > 1023 ? 1023 : v);
+		
+		if(k == 0) ssdv_coef_push(iv, 0, v);
+		else if(v == 0) rle++;
+		else
+		{
+			for(; rle >= 16; rle -= 16) ssdv_coef_push(iv, 15, 0); /* ZRL */
+			ssdv_coef_push(iv, rle, v);
+			rle = 0;
+		}
+	}
+	
+	if(rle) ssdv_coef_push(iv, 0, 0); /* EOB */
+	ssdv_coef_push(iv, SSDV_COEF_END, 0);
+}
+
+static char ssdv_enc_thumbnail(ssdv_t *s)
+{
+	/* Each block of the image becomes 1, 2 or 4 pixels square, and
+	 * the thumbnail is rounded up to a multiple of 16 pixels */
+	uint8_t shift = 4 - s->thumb, size = 1 << (s->thumb - 1);
+	uint8_t bw = MCU_WIDTH(s) / 8, bh = MCU_HEIGHT(s) / 8;
+	uint16_t width  = ((s->width  >> shift) + 15) & ~15;
+	uint16_t height = ((s->height >> shift) + 15) & ~15;
+	uint32_t across, mcu, m, i, bx, by, w[3], h[3], fw, fh, x, y;
+	uint8_t *plane[3] = { NULL, NULL, NULL }, *row;
+	ssdv_interval_t *iv;
+	ssdv_coef_t *c;
+	int p, comp;
+	char r = SSDV_ERROR;
+	
+	iv = calloc(1, sizeof(ssdv_interval_t));
+	if(!iv) return(SSDV_ERROR);
+	
+	/* A plane for each component, the chroma at its own sampling */
+	for(comp = 0; comp < 3; comp++)
+	{
+		w[comp] = comp ? width  / bw : width;
+		h[comp] = comp ? height / bh : height;
+		plane[comp] = malloc((size_t) w[comp] * h[comp]);
+		if(!plane[comp]) goto done;
+	}
+	
+	/* Draw every block of the image into the planes at the smaller size */
+	across = s->width / MCU_WIDTH(s);
+	for(mcu = i = 0; i < s->intervals_len; i++)
+	{
+		c = s->intervals[i].coef;
+		for(m = 0; m < s->intervals[i].mcus; m++, mcu++)
+		{
+			for(p = 0; p < s->ycparts + 2; p++)
+			{
+				comp = p < s->ycparts ? 0 : p - s->ycparts + 1;
+				bx = (mcu % across) * (comp ? 1 : bw) + (comp ? 0 : p % bw);
+				by = (mcu / across) * (comp ? 1 : bh) + (comp ? 0 : p / bw);
+				c = ssdv_thumb_pixels(s, c, comp,
+					&plane[comp][(size_t) by * size * w[comp] + bx * size], w[comp]);
+			}
+		}
+	}
+	
+	/* Fill the rounding at the right and bottom with the last pixels */
+	for(comp = 0; comp < 3; comp++)
+	{
+		fw = (comp ? s->width  / bw : s->width)  >> shift;
+		fh = (comp ? s->height / bh : s->height) >> shift;
+		
+		for(y = 0; y < h[comp]; y++)
+		{
+			row = &plane[comp][(size_t) y * w[comp]];
+			if(y >= fh) memcpy(row, row - w[comp], w[comp]);
+			else for(x = fw; x < w[comp]; x++) row[x] = row[fw - 1];
+		}
+	}
+	
+	/* Encode the thumbnail as a single interval, as if it were the source */
+	iv->mcus = (width / MCU_WIDTH(s)) * (height / MCU_HEIGHT(s));
+	iv->r = SSDV_OK;
+	across = width / MCU_WIDTH(s);
+	for(mcu = 0; mcu < iv->mcus; mcu++)
+	{
+		for(p = 0; p < s->ycparts + 2; p++)
+		{
+			comp = p < s->ycparts ? 0 : p - s->ycparts + 1;
+			bx = (mcu % across) * (comp ? 1 : bw) + (comp ? 0 : p % bw);
+			by = (mcu / across) * (comp ? 1 : bh) + (comp ? 0 : p / bw);
+			ssdv_thumb_block(s, iv, comp, &plane[comp][(size_t) by * 8 * w[comp] + bx * 8], w[comp]);
+		}
+	}
+	
+	if(iv->r != SSDV_OK) goto done;
+	
+	/* Send the thumbnail in place of the image */
+	ssdv_free_intervals(s);
+	s->intervals = iv;
+	s->intervals_len = 1;
+	s->interval = 0;
+	s->coef = iv->coef;
+	iv = NULL;
+	
+	s->width = width;
+	s->height = height;
+	s->mcu_count = s->intervals[0].mcus;
+	s->tiled = width > SSDV_MAX_SIZE || height > SSDV_MAX_SIZE || s->mcu_count > SSDV_MAX_MCUS;
+	ssdv_set_packet_conf(s);
+	ssdv_enc_set_buffer(s, s->out);
+	
+	fprintf(stderr, "Thumbnail: %ix%i\n", width, height);
+	r = SSDV_OK;
+	
+done:
+	if(iv) free(iv->coef);
+	free(iv);
+	for(comp = 0; comp < 3; comp++)
+		free(plane[comp]);
+	
+	return(r);
+}
+
+static char ssdv_enc_parts(ssdv_t *s)
+{
+	uint32_t mcu, m, i;
+	ssdv_coef_t *c;
+	int p;
+	
+	/* The tiles and layers take their MCUs in a different order to
+	 * the source, so the whole scan is transcoded first */
+	if(ssdv_enc_transcode_intervals(s) != SSDV_OK)
+	{
+		fprintf(stderr, "Error: The whole image is needed to send it in tiles, layers or as a thumbnail\n");
+		return(SSDV_ERROR);
+	}
+	
+	/* A thumbnail is made from the transcoded image and sent instead */
+	if(s->thumb && ssdv_enc_thumbnail(s) != SSDV_OK) return(SSDV_ERROR);
+	
+	ssdv_enc_tile_size(s);
+	
+	/* Find the first coefficient of each MCU */
+	s->mcu_coef = malloc(sizeof(ssdv_coef_t *) * s->mcu_count);
+	if(!s->mcu_coef) return(SSDV_ERROR);
+	
+	for(mcu = i = 0; i < s->intervals_len; i++)
+	{
+		c = s->intervals[i].coef;
+		for(m = 0; m < s->intervals[i].mcus; m++)
+		{
+			s->mcu_coef[mcu++] = c;
+			for(p = 0; p < s->ycparts + 2; p++)
+			{
+				while(c->rle != SSDV_COEF_END) c++;
+				c++;
+			}
+		}
+	}
+	
+	ssdv_enc_next_part(s);
+	
+	if(s->tiled)
+		fprintf(stderr, "Tiles: %ix%i, %ix%i pixels each\n",
+			(s->width + s->tile_size_w - 1) / s->tile_size_w,
+			(s->height + s->tile_size_h - 1) / s->tile_size_h,
+			s->tile_size_w, s->tile_size_h);
+	if(s->layered)
+		fprintf(stderr, "Layers: %i\n", SSDV_LAYERS);
+	
+	return(SSDV_OK);
+}
+
+/*****************************************************************************/
+
+static void ssdv_memset_prng(uint8_t *s, size_t n)
+{
+	/* A very simple PRNG for noise whitening */
+	uint8_t l = 0x00;
+	for(; n > 0; n--) *(s++) = (l = l * 245 + 45);
+}
+
+static char ssdv_have_marker(ssdv_t *s)
+{
+	switch(s->marker)
+	{
+	case J_SOF0:
+	case J_SOS:
+	case J_DRI:
+	case J_DHT:
+	case J_DQT:
+		/* Copy the data before processing */
+		if(s->marker_len > TBL_LEN + HBUFF_LEN - s->stbl_len)
+		{
+			/* Not enough memory ... shouldn't happen! */
+			return(SSDV_ERROR);
+		}
+		
+		s->marker_data     = &s->stbls[s->stbl_len];
+		s->marker_data_len = 0;
+		s->state           = S_MARKER_DATA;
+		break;
+	
+	case J_SOF2:
+		/* Don't do progressive images! */
+		fprintf(stderr, "Error: Progressive images not supported\n");
+		return(SSDV_ERROR);
+	
+	case J_EOI:
+		s->state = S_EOI;
+		break;
+	
+	case J_RST0:
+	case J_RST1:
+	case J_RST2:
+	case J_RST3:
+	case J_RST4:
+	case J_RST5:
+	case J_RST6:
+	case J_RST7:
+		s->dc[0]  = s->dc[1]  = s->dc[2]  = 0;
+		if(s->estimate) memset(s->estimate->dc, 0, sizeof(s->estimate->dc));
+		s->mcupart = s->acpart = s->component = 0;
+		s->acrle = s->accrle = 0;
+		s->workbits = s->worklen = 0;
+		s->state = S_HUFF;
+		break;
+	
+	default:
+		/* Ignore other marks, skipping any associated data */
+		s->in_skip = s->marker_len;
+		s->state   = S_MARKER;
+		break;
+	}
+	
+	return(SSDV_OK);
+}
+
+static char ssdv_have_marker_data(ssdv_t *s)
+{
+	uint8_t *d = s->marker_data;
+	size_t l = s->marker_len;
+	int i;
+	
+	switch(s->marker)
+	{
+	case J_SOF0:
+		s->width  = (d[3] << 8) | d[4];
+		s->height = (d[1] << 8) | d[2];
+		
+		/* Display information about the image... */
+		fprintf(stderr, "Precision: %i\n", d[0]);
+		fprintf(stderr, "Resolution: %ix%i\n", s->width, s->height);
+		fprintf(stderr, "Components: %i\n", d[5]);
+		
+		/* The image must have a precision of 8 */
+		if(d[0] != 8)
+		{
+			fprintf(stderr, "Error: The image must have a precision of 8\n");
+			return(SSDV_ERROR);
+		}
+		
+		/* The image must have 3 components (Y'Cb'Cr) */
+		if(d[5] != 3)
+		{
+			fprintf(stderr, "Error: The image must have 3 components\n");
+			return(SSDV_ERROR);
+		}
+		
+		/* The image dimensions must be a multiple of 16 */
+		if((s->width & 0x0F) || (s->height & 0x0F))
+		{
+			fprintf(stderr, "Error: The image dimensions must be a multiple of 16\n");
+			return(SSDV_ERROR);
+		}
+		
+		/* TODO: Read in the quantisation table ID for each component */
+		// 01 22 00 02 11 01 03 11 01
+		for(i = 0; i < 3; i++)
+		{
+			uint8_t *dq = &d[i * 3 + 6];
+			if(dq[0] != i + 1)
+			{
+				fprintf(stderr, "Error: Components are not in order in the SOF0 header\n");
+				return(SSDV_ERROR);
+			}
+			
+			fprintf(stderr, "DQT table for component %i: %02X, Sampling factor: %ix%i\n", dq[0], dq[2], dq[1] & 0x0F, dq[1] >> 4);
+			
+			/* The first (Y) component must have a factor of 2x2,2x1,1x2 or 1x1 */
+			if(dq[0] == 1)
+			{
+				switch(dq[1])
+				{
+				case 0x22: s->mcu_mode = 0; s->ycparts = 4; break;
+				case 0x12: s->mcu_mode = 1; s->ycparts = 2; break;
+				case 0x21: s->mcu_mode = 2; s->ycparts = 2; break;
+				case 0x11: s->mcu_mode = 3; s->ycparts = 1; break;
+				default:
+					fprintf(stderr, "Error: Component 1 sampling factor is not supported\n");
+					return(SSDV_ERROR);
+				}
+			}
+			else if(dq[0] != 1 && dq[1] != 0x11)
+			{
+				fprintf(stderr, "Error: Component %i sampling factor must be 1x1\n", dq[0]);
+				return(SSDV_ERROR);
+			}
+		}
+		
+		/* Calculate number of MCU blocks in this image */
+		switch(s->mcu_mode)
+		{
+		case 0: l = (s->width >> 4) * (s->height >> 4); break;
+		case 1: l = (s->width >> 4) * (s->height >> 3); break;
+		case 2: l = (s->width >> 3) * (s->height >> 4); break;
+		case 3: l = (s->width >> 3) * (s->height >> 3); break;
+		}
+		
+		fprintf(stderr, "MCU blocks: %i\n", (int) l);
+		
+		s->mcu_count = l;
+		
+		/* An image bigger than 4080x4080 or 65535 MCUs is split into tiles */
+		if(s->width > SSDV_MAX_SIZE || s->height > SSDV_MAX_SIZE || l > SSDV_MAX_MCUS)
+		{
+			s->tiled = 1;
+			ssdv_set_packet_conf(s);
+			ssdv_enc_set_buffer(s, s->out);
+		}
+		
+		break;
+	
+	case J_SOS:
+		fprintf(stderr, "Components: %i\n", d[0]);
+		
+		/* The image must have 3 components (Y'Cb'Cr) */
+		if(d[0] != 3)
+		{
+			fprintf(stderr, "Error: The image must have 3 components\n");
+			return(SSDV_ERROR);
+		}
+		
+		for(i = 0; i < 3; i++)
+		{
+			uint8_t *dh = &d[i * 2 + 1];
+			if(dh[0] != i + 1)
+			{
+				fprintf(stderr, "Error: Components are not in order in the SOF0 header\n");
+				return(SSDV_ERROR);
+			}
+			
+			fprintf(stderr, "Component %i DHT: %02X\n", dh[0], dh[1]);
+		}
+		
+		/* Do I need to look at the last three bytes of the SOS data? */
+		/* 00 3F 00 */
+		
+		/* Verify all of the DQT and DHT tables where loaded */
+		if(!s->sdqt[0] || !s->sdqt[1])
+		{
+			fprintf(stderr, "Error: The image is missing one or more DQT tables\n");
+			return(SSDV_ERROR);
+		}
+		
+		if(!s->sdht[0][0] || !s->sdht[0][1] ||
+		   !s->sdht[1][0] || !s->sdht[1][1])
+		{
+			fprintf(stderr, "Error: The image is missing one or more DHT tables\n");
+			return(SSDV_ERROR);
+		}
+		
+		/* Both sets of DQT tables are known, prepare the conversion */
+		ssdv_init_requant(s);
+		if(s->roi) s->inroi = ssdv_roi_mcu(s, 0);
+		if(s->estimate)
+		{
+			if(ssdv_estimate_init(s) != SSDV_OK) return(SSDV_ERROR);
+		}
+		
+		/* Split the image into tiles or layers, or make a thumbnail of
+		 * it, the whole scan must be here */
+		else if(s->tiled || s->layered || s->thumb)
+		{
+			if(ssdv_enc_parts(s) != SSDV_OK) return(SSDV_ERROR);
+		}
+		
+		/* Transcode the restart intervals in parallel if the whole scan is here */
+		else if(s->threads > 1 && s->dri > 0) ssdv_enc_transcode_intervals(s);
+		
+		/* The SOS data is followed by the image data */
+		s->state = S_HUFF;
+		
+		return(SSDV_OK);
+	
+	case J_DHT:
+		s->stbl_len += l;
+		while(l > 0)
+		{
+			int i, j;
+			
+			/* Store the table and prepare its decode lookup */
+			switch(d[0])
+			{
+			case 0x00: s->sdht[0][0] = d; jpeg_dht_build_lookup(&s->sdht_lookup[0][0], d); break;
+			case 0x01: s->sdht[0][1] = d; jpeg_dht_build_lookup(&s->sdht_lookup[0][1], d); break;
+			case 0x10: s->sdht[1][0] = d; jpeg_dht_build_lookup(&s->sdht_lookup[1][0], d); break;
+			case 0x11: s->sdht[1][1] = d; jpeg_dht_build_lookup(&s->sdht_lookup[1][1], d); break;
+			}
+			
+			/* Skip to the next DHT table */
+			for(j = 17, i = 1; i <= 16; i++)
+				j += d[i];
+			
+			l -= j;
+			d += j;
+		}
+		break;
+	
+	case J_DQT:
+		s->stbl_len += l;
+		while(l > 0)
+		{
+			switch(d[0])
+			{
+			case 0x00: s->sdqt[0] = d; break;
+			case 0x01: s->sdqt[1] = d; break;
+			}
+			
+			/* Skip to the next one, if present */
+			l -= 65;
+			d += 65;
+		}
+		break;
+	
+	case J_DRI:
+		s->dri = (d[0] << 8) + d[1];
+		fprintf(stderr, "Reset interval: %i blocks\n", s->dri);
+		break;
+	}
+	
+	s->state = S_MARKER;
+	return(SSDV_OK);
+}
+
+static void ssdv_enc_finish_packet(ssdv_t *s, char eoi, uint16_t mcu_id, uint8_t mcu_offset)
+{
+	uint32_t x;
+	uint8_t i;
+	
+	/* A packet is ready, create the headers */
+	s->out[0]   = 0x55;                /* Sync */
+	s->out[1]   = 0x66 + s->type;      /* Type */
+	s->out[2]   = s->callsign >> 24;
+	s->out[3]   = s->callsign >> 16;
+	s->out[4]   = s->callsign >> 8;
+	s->out[5]   = s->callsign;
+	s->out[6]   = s->image_id;         /* Image ID */
+	s->out[7]   = s->packet_id >> 8;   /* Packet ID MSB */
+	s->out[8]   = s->packet_id & 0xFF; /* Packet ID LSB */
+	s->out[9]   = (s->tiled ? s->tile_width : s->width) >> 4;   /* Width / 16 */
+	s->out[10]  = (s->tiled ? s->tile_height : s->height) >> 4; /* Height / 16 */
+	s->out[11]  = 0x00;
+	s->out[11] |= ((s->quality - 4) & 7) << 3;  /* Quality level */
+	s->out[11] |= (eoi ? 1 : 0) << 2;            /* EOI flag (1 bit) */
+	s->out[11] |= s->mcu_mode & 0x03;  /* MCU mode (2 bits) */
+	if(s->dht) s->out[11] |= SSDV_FLAG_DHT;     /* Huffman tables in packet 0 */
+	if(s->tiled || s->layered || s->thumb || s->roi || s->grey) s->out[11] |= SSDV_FLAG_EXT; /* Extension flags follow */
+	s->out[12]  = mcu_offset;          /* Next MCU offset */
+	s->out[13]  = mcu_id >> 8;         /* MCU ID MSB */
+	s->out[14]  = mcu_id & 0xFF;       /* MCU ID LSB */
+	
+	if(s->tiled || s->layered || s->thumb || s->roi || s->grey)
+	{
+		s->out[15] = 0x00;
+		if(s->layered) s->out[15] |= SSDV_EXT_LAYERED | s->layer;
+		if(s->thumb) s->out[15] |= SSDV_EXT_THUMB | (s->thumb - 1);
+		if(s->tiled) s->out[15] |= SSDV_EXT_TILE;
+		if(s->roi) s->out[15] |= SSDV_EXT_ROI;
+		if(s->grey) s->out[15] |= SSDV_EXT_GREY;
+	}
+	
+	/* The size of the whole image, and where the tile goes in it */
+	if(s->tiled)
+	{
+		ssdv_put_tile(&s->out[16], s->width, s->height);
+		ssdv_put_tile(&s->out[19], s->tile_x, s->tile_y);
+	}
+	
+	/* The region of interest, within this tile */
+	if(s->roi) ssdv_put_roi(s, &s->out[ssdv_roi_offset(s->out)]);
+	
+	/* Fill any remaining bytes with noise */
+	if(s->out_len > 0) ssdv_memset_prng(s->outp, s->out_len);
+	
+	/* Calculate the CRC codes */
+	x = crc32(&s->out[1], s->pkt_size_crcdata);
+	
+	i = 1 + s->pkt_size_crcdata;
+	s->out[i++] = (x >> 24) & 0xFF;
+	s->out[i++] = (x >> 16) & 0xFF;
+	s->out[i++] = (x >> 8) & 0xFF;
+	s->out[i++] = x & 0xFF;
+	
+	/* Generate the RS codes */
+	if(s->type == SSDV_TYPE_NORMAL)
+		encode_rs_8(&s->out[1], &s->out[i], 0);
+	
+	s->packet_id++;
+}
+
+static void ssdv_enc_dht_packet(ssdv_t *s)
+{
+	uint8_t len[DHT_AC_SYMBOLS];
+	int ac, c, i;
+	
+	/* The length of each symbol's code, 4 bits each */
+	for(ac = 0; ac < 2; ac++)
+	{
+		for(c = 0; c < 2; c++)
+		{
+			dht_to_lengths(s->ddht[ac][c], len, ac);
+			for(i = 0; i < (ac ? DHT_AC_SYMBOLS : DHT_DC_SYMBOLS); i++)
+				ssdv_outbits(s, len[i], 4);
+		}
+	}
+	
+	ssdv_enc_finish_packet(s, 0, 0xFFFF, 0xFF);
+	s->dht = S_DHT_READY;
+	
+	/* The image data starts in the next packet */
+	s->out_len = 0;
+}
+
+char ssdv_enc_init(ssdv_t *s, uint8_t type, char *callsign, uint8_t image_id, int8_t quality)
+{
+	/* Limit the quality level */
+	if(quality < 0) quality = 0;
+	if(quality > 7) quality = 7;
+	
+	memset(s, 0, sizeof(ssdv_t));
+	s->image_id = image_id;
+	s->callsign = encode_callsign(callsign);
+	s->mode = S_ENCODING;
+	s->type = type;
+	s->quality = quality;
+	s->in_stuff = 1;
+	s->acend = 64;
+	ssdv_set_packet_conf(s);
+	
+	/* Prepare the output JPEG tables */
+	s->ddqt[0] = dload_standard_dqt(s, std_dqt0, s->quality);
+	s->ddqt[1] = dload_standard_dqt(s, std_dqt1, s->quality);
+	s->ddht[0][0] = dtblcpy(s, std_dht00, sizeof(std_dht00));
+	s->ddht[0][1] = dtblcpy(s, std_dht01, sizeof(std_dht01));
+	s->ddht[1][0] = dtblcpy(s, std_dht10, sizeof(std_dht10));
+	s->ddht[1][1] = dtblcpy(s, std_dht11, sizeof(std_dht11));
+	jpeg_dht_build_symbols(&s->ddht_symbols[0][0], s->ddht[0][0]);
+	jpeg_dht_build_symbols(&s->ddht_symbols[0][1], s->ddht[0][1]);
+	jpeg_dht_build_symbols(&s->ddht_symbols[1][0], s->ddht[1][0]);
+	jpeg_dht_build_symbols(&s->ddht_symbols[1][1], s->ddht[1][1]);
+	
+	return(SSDV_OK);
+}
+
+char ssdv_enc_set_buffer(ssdv_t *s, uint8_t *buffer)
+{
+	s->out     = buffer;
+	s->outp    = buffer + s->pkt_size_header;
+	s->out_len = s->pkt_size_payload;
+	
+	/* Zero the payload memory */
+	memset(s->out, 0, SSDV_PKT_SIZE);
+	
+	/* Flush the output bits */
+	ssdv_outbits(s, 0, 0);
+	
+	return(SSDV_OK);
+}
+
+static char ssdv_enc_make_packet(ssdv_t *s)
+{
+	int r;
+	uint8_t b;
+	size_t n;
+	
+	/* Have we reached the end of the image? */
+	if(s->state == S_EOI) return(SSDV_EOI);
+	
+	/* If the output buffer is empty, re-initialise */
+	if(s->out_len == 0) ssdv_enc_set_buffer(s, s->out);
+	
+	while(s->in_len || s->state == S_HUFF || s->state == S_INT)
+	{
+		if(s->state != S_HUFF && s->state != S_INT)
+		{
+			/* Jump over any bytes to be skipped */
+			if(s->in_skip)
+			{
+				n = s->in_skip < s->in_len ? s->in_skip : s->in_len;
+				s->inp     += n;
+				s->in_len  -= n;
+				s->in_skip -= n;
+				continue;
+			}
+			
+			b = *(s->inp++);
+			s->in_len--;
+		}
+		
+		switch(s->state)
+		{
+		case S_MARKER:
+			s->marker = (s->marker << 8) | b;
+			
+			if(s->marker == J_TEM ||
+			   (s->marker >= J_RST0 && s->marker <= J_EOI))
+			{
+				/* Marker without data */
+				s->marker_len = 0;
+				r = ssdv_have_marker(s);
+				if(r != SSDV_OK) return(r);
+			}
+			else if(s->marker >= J_SOF0 && s->marker <= J_COM)
+			{
+				/* All other markers are followed by data */
+				s->marker_len = 0;
+				s->state = S_MARKER_LEN;
+				s->needbits = 16;
+			}
+			break;
+		
+		case S_MARKER_LEN:
+			s->marker_len = (s->marker_len << 8) | b;
+			if((s->needbits -= 8) == 0)
+			{
+				s->marker_len -= 2;
+				r = ssdv_have_marker(s);
+				if(r != SSDV_OK) return(r);
+			}
+			break;
+		
+		case S_MARKER_DATA:
+			s->marker_data[s->marker_data_len++] = b;
+			
+			/* Copy as much of the rest as is available in one go */
+			n = s->marker_data_len < s->marker_len ? s->marker_len - s->marker_data_len : 0;
+			if(n > s->in_len) n = s->in_len;
+			memcpy(&s->marker_data[s->marker_data_len], s->inp, n);
+			s->marker_data_len += n;
+			s->inp    += n;
+			s->in_len -= n;
+			
+			if(s->marker_data_len == s->marker_len)
+			{
+				r = ssdv_have_marker_data(s);
+				if(r != SSDV_OK) return(r);
+			}
+			break;
+		
+		case S_HUFF:
+		case S_INT:
+			/* The huffman tables go ahead of the image data */
+			if(s->dht == S_DHT_PENDING)
+			{
+				ssdv_enc_dht_packet(s);
+				return(SSDV_OK);
+			}
+			
+			/* Process the data until more needed, or an error occurs */
+			r = ssdv_process_all(s);
+			
+			/* Only counting, move straight on to the next tile or layer */
+			if(r == SSDV_EOI && s->dht_freq && s->mcu_coef && !ssdv_last_part(s))
+			{
+				ssdv_enc_next_part(s);
+				break;
+			}
+			
+			if(r == SSDV_EOI && (s->estimate || s->dht_freq))
+			{
+				/* Only counting, no packets are made */
+				s->state = S_EOI;
+				ssdv_free_intervals(s);
+				return(SSDV_EOI);
+			}
+			else if(r == SSDV_BUFFER_FULL || r == SSDV_EOI)
+			{
+				uint16_t mcu_id    = s->packet_mcu_id;
+				uint8_t mcu_offset = s->packet_mcu_offset;
+				
+				if(mcu_offset != 0xFF && mcu_offset >= s->pkt_size_payload)
+				{
+					/* The first MCU begins in the next packet, not this one */
+					mcu_id = 0xFFFF;
+					mcu_offset = 0xFF;
+					s->packet_mcu_offset -= s->pkt_size_payload;
+				}
+				else
+				{
+					/* Clear the MCU data for the next packet */
+					s->packet_mcu_id = 0xFFFF;
+					s->packet_mcu_offset = 0xFF;
+				}
+				
+				/* The end of a tile or layer, the next one starts in a new packet */
+				if(r == SSDV_EOI && s->mcu_coef && !ssdv_last_part(s))
+				{
+					ssdv_enc_finish_packet(s, 0, mcu_id, mcu_offset);
+					
+					/* Any bits that didn't fit are dropped, as at the end of an image */
+					s->outlen = 0;
+					s->out_len = 0;
+					ssdv_enc_next_part(s);
+					
+					return(SSDV_OK);
+				}
+				
+				ssdv_enc_finish_packet(s, r == SSDV_EOI, mcu_id, mcu_offset);
+				
+				/* Have we reached the end of the image data? */
+				if(r == SSDV_EOI)
+				{
+					s->state = S_EOI;
+					ssdv_free_intervals(s);
+				}
+				
+				return(SSDV_OK);
+			}
+			else if(r != SSDV_FEED_ME)
+			{
+				/* An error occured */
+				fprintf(stderr, "ssdv_process() failed: %i\n", r);
+				return(SSDV_ERROR);
+			}
+			
+			/* Add more bytes to the work area, if still in the scan */
+			if(s->state == S_HUFF || s->state == S_INT)
+			{
+				if(s->in_len == 0) return(SSDV_FEED_ME);
+				ssdv_inbits(s);
+			}
+			break;
+		
+		case S_EOI:
+			/* Shouldn't reach this point */
+			break;
+		}
+	}
+	
+	/* Need more data */
+	return(SSDV_FEED_ME);
+}
+
+char ssdv_enc_get_packet(ssdv_t *s)
+{
+	char r;
+	STATS_START(t);
+	
+	r = ssdv_enc_make_packet(s);
+	
+	STATS_STOP(&s->stats, ns_packet, t);
+	return(r);
+}
+
+char ssdv_enc_feed(ssdv_t *s, uint8_t *buffer, size_t length)
+{
+	s->inp    = buffer;
+	s->in_len = length;
+	return(SSDV_OK);
+}
+
+char ssdv_enc_set_threads(ssdv_t *s, int threads)
+{
+	/* Used when the source has restart intervals and the whole image is fed at once */
+	if(threads > SSDV_MAX_THREADS) threads = SSDV_MAX_THREADS;
+	s->threads = threads;
+	return(SSDV_OK);
+}
+
+char ssdv_enc_set_layered(ssdv_t *s, char layered)
+{
+	/* Send the coefficients in bands, the lowest frequencies first */
+	if(layered && s->thumb) return(SSDV_ERROR);
+	s->layered = layered ? 1 : 0;
+	ssdv_set_packet_conf(s);
+	if(s->out) ssdv_enc_set_buffer(s, s->out);
+	return(SSDV_OK);
+}
+
+char ssdv_enc_set_thumbnail(ssdv_t *s, uint8_t scale)
+{
+	/* Send a copy of the image scaled down by 8, 4 or 2, for 1 to 3 */
+	if(scale > SSDV_MAX_THUMB || (scale && (s->layered || s->roi))) return(SSDV_ERROR);
+	s->thumb = scale;
+	ssdv_set_packet_conf(s);
+	if(s->out) ssdv_enc_set_buffer(s, s->out);
+	return(SSDV_OK);
+}
+
+char ssdv_enc_set_grey(ssdv_t *s, char grey)
+{
+	/* Drop the chroma, sending only the Y parts of each MCU */
+	s->grey = grey ? 1 : 0;
+	ssdv_set_packet_conf(s);
+	if(s->out) ssdv_enc_set_buffer(s, s->out);
+	return(SSDV_OK);
+}
+
+char ssdv_enc_set_roi(ssdv_t *s, uint16_t x, uint16_t y, uint16_t width, uint16_t height, int8_t quality)
+{
+	/* Send the MCUs inside the rectangle at this quality level, the
+	 * rest at the image's. It is widened out to multiples of 16 pixels */
+	if(quality < 0) quality = 0;
+	if(quality > 7) quality = 7;
+	if(width == 0 || height == 0 || s->thumb) return(SSDV_ERROR);
+	
+	s->roi = 1;
+	s->roi_quality = quality;
+	s->roi_x = x & ~15;
+	s->roi_y = y & ~15;
+	s->roi_width = ((x + width + 15) & ~15) - s->roi_x;
+	s->roi_height = ((y + height + 15) & ~15) - s->roi_y;
+	load_standard_dqt(s->rdqt[0], std_dqt0, quality);
+	load_standard_dqt(s->rdqt[1], std_dqt1, quality);
+	
+	ssdv_set_packet_conf(s);
+	if(s->out) ssdv_enc_set_buffer(s, s->out);
+	return(SSDV_OK);
+}
+
+char ssdv_enc_estimate(ssdv_t *s, uint8_t *jpeg, size_t length, uint32_t packets[8])
+{
+	uint8_t pkt[SSDV_PKT_SIZE], tables = 0;
+	char r;
+	int q;
+	
+	/* Count the bits of every quality level in one pass, with no packets made */
+	s->estimate = calloc(1, sizeof(ssdv_estimate_t));
+	if(!s->estimate) return(SSDV_ERROR);
+	
+	ssdv_enc_set_buffer(s, pkt);
+	ssdv_enc_feed(s, jpeg, length);
+	r = ssdv_enc_get_packet(s);
+	
+	/* Tables from ssdv_enc_optimise_dht() are counted in place of the standard
+	 * ones, only right for this quality level. Their packet comes first */
+	if(r == SSDV_OK && s->dht == S_DHT_READY)
+	{
+		tables = 1;
+		r = ssdv_enc_get_packet(s);
+	}
+	
+	/* Count the last row of tiles */
+	if(r == SSDV_EOI && s->estimate->row)
+	{
+		s->estimate->row[s->estimate->col] = s->estimate->part;
+		ssdv_estimate_end_row(s);
+	}
+	
+	for(q = 0; r == SSDV_EOI && q < 8; q++)
+	{
+		if(s->estimate->row) packets[q] = s->estimate->packets[q];
+		else packets[q] = ssdv_estimate_packets(s, &s->estimate->part, q);
+		packets[q] += tables;
+	}
+	
+	free(s->estimate->row);
+	free(s->estimate);
+	s->estimate = NULL;
+	
+	return(r == SSDV_EOI ? SSDV_OK : SSDV_ERROR);
+}
+
+char ssdv_enc_optimise_dht(ssdv_t *s, uint8_t *jpeg, size_t length)
+{
+	uint32_t freq[2][2][256], f[DHT_AC_SYMBOLS];
+	uint8_t pkt[SSDV_PKT_SIZE], len[DHT_AC_SYMBOLS], dht[17 + DHT_AC_SYMBOLS];
+	ssdv_t *t;
+	int ac, c, i;
+	char r;
+	
+	/* Count the symbols the image needs, in a dry run of the encoder */
+	t = malloc(sizeof(ssdv_t));
+	if(!t) return(SSDV_ERROR);
+	
+	memset(freq, 0, sizeof(freq));
+	ssdv_enc_init(t, s->type, "", 0, s->quality);
+	ssdv_enc_set_layered(t, s->layered);
+	ssdv_enc_set_thumbnail(t, s->thumb);
+	ssdv_enc_set_grey(t, s->grey);
+	if(s->roi) ssdv_enc_set_roi(t, s->roi_x, s->roi_y, s->roi_width, s->roi_height, s->roi_quality);
+	t->dht_freq = freq;
+	ssdv_enc_set_buffer(t, pkt);
+	ssdv_enc_feed(t, jpeg, length);
+	r = ssdv_enc_get_packet(t);
+	
+	/* A JPEG that ends early leaves its tiles, layers or intervals behind */
+	ssdv_free_intervals(t);
+	free(t);
+	
+	if(r != SSDV_EOI) return(SSDV_ERROR);
+	
+	/* Replace the standard tables, they are no smaller than these */
+	s->dtbl_len = s->ddht[0][0] - s->dtbls;
+	
+	for(ac = 0; ac < 2; ac++)
+	{
+		for(c = 0; c < 2; c++)
+		{
+			/* Any DC value can begin a packet, so every DC size gets a code */
+			for(i = 0; i < (ac ? DHT_AC_SYMBOLS : DHT_DC_SYMBOLS); i++)
+				f[i] = freq[ac][c][dht_symbol(ac, i)] + (ac ? 0 : 1);
+			
+			/* The decoder ends the empty chroma blocks of a greyscale image with an EOB */
+			if(s->grey && ac && c) f[dht_index(ac, 0x00)]++;
+			
+			dht_optimal_lengths(len, f, ac ? DHT_AC_SYMBOLS : DHT_DC_SYMBOLS);
+			s->ddht[ac][c] = dtblcpy(s, dht, dht_from_lengths(dht, dht_ids[ac][c], len, ac));
+			jpeg_dht_build_symbols(&s->ddht_symbols[ac][c], s->ddht[ac][c]);
+		}
+	}
+	
+	s->dht = S_DHT_PENDING;
+	
+	return(SSDV_OK);
+}
+
+/*****************************************************************************/
+
+static void ssdv_write_marker(ssdv_t *s, uint16_t id, uint16_t length, const uint8_t *data)
+{
+	ssdv_outbits(s, id, 16);
+	if(length > 0)
+	{
+		ssdv_outbits(s, length + 2, 16);
+		while(length--) ssdv_outbits(s, *(data++), 8);
+	}
+}
+
+static void ssdv_out_headers(ssdv_t *s)
+{
+	uint8_t *b = &s->stbls[s->stbl_len];
+	
+	ssdv_write_marker(s, J_SOI,    0, 0);
+	ssdv_write_marker(s, J_APP0,  14, app0);
+	ssdv_write_marker(s, J_DQT,   65, s->ddqt[0]);  /* DQT Luminance       */
+	ssdv_write_marker(s, J_DQT,   65, s->ddqt[1]);  /* DQT Chrominance     */
+	
+	/* Build SOF0 header */
+	b[0]  = 8; /* Precision */
+	b[1]  = s->height >> 8;
+	b[2]  = s->height & 0xFF;
+	b[3]  = s->width >> 8;
+	b[4]  = s->width & 0xFF;
+	b[5]  = 3; /* Components (Y'Cb'Cr) */
+	b[6]  = 1; /* Y */
+	switch(s->mcu_mode)
+	{
+	case 0: b[7] = 0x22; break;
+	case 1: b[7] = 0x12; break;
+	case 2: b[7] = 0x21; break;
+	case 3: b[7] = 0x11; break;
+	}
+	b[8]  = 0x00;
+	b[9]  = 2; /* Cb */
+	b[10] = 0x11;
+	b[11] = 0x01;
+	b[12] = 3; /* Cr */
+	b[13] = 0x11;
+	b[14] = 0x01;
+	ssdv_write_marker(s, J_SOF0,  15, b);  /* SOF0 (Baseline DCT) */
+	
+	ssdv_write_marker(s, J_DHT,   29, std_dht00); /* DHT (DC Luminance)  */
+	ssdv_write_marker(s, J_DHT,  179, std_dht10); /* DHT (AC Luminance)  */
+	ssdv_write_marker(s, J_DHT,   29, std_dht01); /* DHT (DC Chrominance */
+	ssdv_write_marker(s, J_DHT,  179, std_dht11); /* DHT (AC Chrominance */
+	
+	/* DRI, if the scan is to have restart markers */
+	if(s->dri > 0)
+	{
+		b[0] = s->dri >> 8;
+		b[1] = s->dri & 0xFF;
+		ssdv_write_marker(s, J_DRI, 2, b);
+	}
+	
+	ssdv_write_marker(s, J_SOS,   10, sos);
+}
+
+static void ssdv_fill_gap(ssdv_t *s, uint16_t next_mcu)
+{
+	if(s->mcupart > 0 || s->acpart > 0)
+	{
+		/* Cleanly end the current MCU part */
+		if(s->acpart > 0)
+		{
+			ssdv_out_jpeg_int(s, 0, 0);
+			s->mcupart++;
+		}
+		
+		/* End the current MCU block */
+		for(; s->mcupart < s->ycparts + 2; s->mcupart++)
+		{
+			if(s->mcupart < s->ycparts) s->component = 0;
+			else s->component = s->mcupart - s->ycparts + 1;
+			s->acpart = 0; ssdv_out_jpeg_int(s, 0, 0); /* DC */
+			s->acpart = 1; ssdv_out_jpeg_int(s, 0, 0); /* AC */
+		}
+		
+		s->mcu_id++;
+		STATS_ADD(&s->stats, gap_mcus, 1);
+	}
+	
+	/* Pad out missing MCUs */
+	for(; s->mcu_id < next_mcu; s->mcu_id++)
+	{
+		STATS_ADD(&s->stats, gap_mcus, 1);
+		
+		/* End the current MCU block */
+		for(s->mcupart = 0; s->mcupart < s->ycparts + 2; s->mcupart++)
+		{
+			if(s->mcupart < s->ycparts) s->component = 0;
+			else s->component = s->mcupart - s->ycparts + 1;
+			s->acpart = 0; ssdv_out_jpeg_int(s, 0, 0); /* DC */
+			s->acpart = 1; ssdv_out_jpeg_int(s, 0, 0); /* AC */
+		}                         
+	}
+}
+
+char ssdv_dec_init(ssdv_t *s)
+{
+	memset(s, 0, sizeof(ssdv_t));
+	
+	/* The packet data should contain only scan data, no headers */
+	s->state = S_HUFF;
+	s->mode = S_DECODING;
+	s->acend = 64;
+	
+	/* Prepare the source JPEG tables */
+	s->sdht[0][0] = stblcpy(s, std_dht00, sizeof(std_dht00));
+	s->sdht[0][1] = stblcpy(s, std_dht01, sizeof(std_dht01));
+	s->sdht[1][0] = stblcpy(s, std_dht10, sizeof(std_dht10));
+	s->sdht[1][1] = stblcpy(s, std_dht11, sizeof(std_dht11));
+	jpeg_dht_build_lookup(&s->sdht_lookup[0][0], s->sdht[0][0]);
+	jpeg_dht_build_lookup(&s->sdht_lookup[0][1], s->sdht[0][1]);
+	jpeg_dht_build_lookup(&s->sdht_lookup[1][0], s->sdht[1][0]);
+	jpeg_dht_build_lookup(&s->sdht_lookup[1][1], s->sdht[1][1]);
+	
+	/* Prepare the output JPEG tables */
+	s->ddht[0][0] = dtblcpy(s, std_dht00, sizeof(std_dht00));
+	s->ddht[0][1] = dtblcpy(s, std_dht01, sizeof(std_dht01));
+	s->ddht[1][0] = dtblcpy(s, std_dht10, sizeof(std_dht10));
+	s->ddht[1][1] = dtblcpy(s, std_dht11, sizeof(std_dht11));
+	jpeg_dht_build_symbols(&s->ddht_symbols[0][0], s->ddht[0][0]);
+	jpeg_dht_build_symbols(&s->ddht_symbols[0][1], s->ddht[0][1]);
+	jpeg_dht_build_symbols(&s->ddht_symbols[1][0], s->ddht[1][0]);
+	jpeg_dht_build_symbols(&s->ddht_symbols[1][1], s->ddht[1][1]);
+	
+	return(SSDV_OK);
+}
+
+char ssdv_dec_set_buffer(ssdv_t *s, uint8_t *buffer, size_t length)
+{
+	size_t c = s->outp - s->out;
+	
+	/* The buffer must hold what's already written, and the EOI */
+	if(length < c + SSDV_EOI_RESERVE) return(SSDV_ERROR);
+	
+	s->outp = buffer + c;
+	s->out = buffer;
+	s->out_len = length - c - SSDV_EOI_RESERVE;
+	
+	/* Flush the output bits */
+	ssdv_outbits(s, 0, 0);
+	
+	return(SSDV_OK);
+}
+
+char ssdv_dec_set_sink(ssdv_t *s, ssdv_sink_t sink, void *arg)
+{
+	/* Output goes through a small staging buffer instead */
+	s->sink = sink;
+	s->sink_arg = arg;
+	s->sink_len = 0;
+	s->out = s->outp = s->sink_buf;
+	s->out_len = SSDV_SINK_LEN;
+	
+	return(SSDV_OK);
+}
+
+char ssdv_dec_set_pixels(ssdv_t *s, uint8_t format, ssdv_pixel_sink_t sink, void *arg)
+{
+	uint8_t base = format & ~SSDV_PIXELS_DC;
+	
+	if(base != SSDV_PIXELS_RGB && base != SSDV_PIXELS_YUV) return(SSDV_ERROR);
+	
+	/* Only the JPEG headers are still written, and thrown away */
+	ssdv_dec_set_sink(s, ssdv_null_sink, NULL);
+	
+	s->pixel_sink = sink;
+	s->pixel_arg = arg;
+	s->pixel_format = base;
+	s->pixel_scale = format & SSDV_PIXELS_DC ? 3 : 0;
+	
+	return(SSDV_OK);
+}
+
+static void ssdv_dec_roi(ssdv_t *s, uint8_t *packet)
+{
+	uint8_t quality;
+	
+	/* Every packet carries the region, the part of it in this packet's tile */
+	ssdv_get_roi(packet, &quality, &s->roi_x, &s->roi_y, &s->roi_width, &s->roi_height);
+	s->roi_quality = quality;
+}
+
+static const char *ssdv_dec_setup(ssdv_t *s, uint8_t *packet)
+{
+	const char *factor = NULL;
+	
+	/* Read the fixed headers from the packet */
+	s->type      = packet[1] - 0x66;
+	s->callsign  = (packet[2] << 24) | (packet[3] << 16) | (packet[4] << 8) | packet[5];
+	s->image_id  = packet[6];
+	s->width     = packet[9] << 4;
+	s->height    = packet[10] << 4;
+	s->mcu_count = packet[9] * packet[10];
+	s->quality   = ((packet[11] >> 3) & 7) ^ 4;
+	s->mcu_mode  = packet[11] & 0x03;
+	s->dht       = packet[11] & SSDV_FLAG_DHT ? S_DHT_PENDING : S_DHT_STANDARD;
+	s->tiled     = packet[11] & SSDV_FLAG_EXT && packet[15] & SSDV_EXT_TILE ? 1 : 0;
+	s->layered   = packet[11] & SSDV_FLAG_EXT && packet[15] & SSDV_EXT_LAYERED ? 1 : 0;
+	s->thumb     = packet[11] & SSDV_FLAG_EXT && packet[15] & SSDV_EXT_THUMB ? (packet[15] & SSDV_EXT_LAYER) + 1 : 0;
+	s->roi       = packet[11] & SSDV_FLAG_EXT && packet[15] & SSDV_EXT_ROI ? 1 : 0;
+	s->grey      = packet[11] & SSDV_FLAG_EXT && packet[15] & SSDV_EXT_GREY ? 1 : 0;
+	s->acend     = 64;
+	
+	/* A tiled image is written out whole */
+	if(s->tiled) ssdv_get_tile(&packet[16], &s->width, &s->height);
+	
+	/* With a region of interest the image is written at the region's quality */
+	if(s->roi) ssdv_dec_roi(s, packet);
+	
+	/* Configure the payload size and CRC position */
+	ssdv_set_packet_conf(s);
+	
+	/* Generate the DQT tables */
+	s->sdqt[0] = sload_standard_dqt(s, std_dqt0, s->quality);
+	s->sdqt[1] = sload_standard_dqt(s, std_dqt1, s->quality);
+	s->ddqt[0] = dload_standard_dqt(s, std_dqt0, s->roi ? s->roi_quality : s->quality);
+	s->ddqt[1] = dload_standard_dqt(s, std_dqt1, s->roi ? s->roi_quality : s->quality);
+	ssdv_init_requant(s);
+	
+	switch(s->mcu_mode & 3)
+	{
+	case 0: factor = "2x2"; s->ycparts = 4; break;
+	case 1: factor = "1x2"; s->ycparts = 2; s->mcu_count *= 2; break;
+	case 2: factor = "2x1"; s->ycparts = 2; s->mcu_count *= 2; break;
+	case 3: factor = "1x1"; s->ycparts = 1; s->mcu_count *= 4; break;
+	}
+	
+	return(factor);
+}
+
+static char ssdv_dec_load_dht(ssdv_t *s, uint8_t *packet)
+{
+	uint8_t *p = &packet[s->pkt_size_header], *d = s->stbls;
+	uint8_t len[DHT_AC_SYMBOLS];
+	uint32_t kraft;
+	int ac, c, i, k = 0;
+	
+	/* The tables take the place of the standard ones, in no more space */
+	for(ac = 0; ac < 2; ac++)
+	{
+		for(c = 0; c < 2; c++)
+		{
+			kraft = 0;
+			for(i = 0; i < (ac ? DHT_AC_SYMBOLS : DHT_DC_SYMBOLS); i++, k++)
+			{
+				len[i] = (k & 1 ? p[k >> 1] : p[k >> 1] >> 4) & 0x0F;
+				if(len[i]) kraft += 1 << (16 - len[i]);
+			}
+			
+			/* Lengths that can't make a prefix code */
+			if(kraft > 1 << 16) return(SSDV_ERROR);
+			
+			s->sdht[ac][c] = d;
+			d += dht_from_lengths(d, dht_ids[ac][c], len, ac);
+			jpeg_dht_build_lookup(&s->sdht_lookup[ac][c], s->sdht[ac][c]);
+		}
+	}
+	
+	s->dht = S_DHT_READY;
+	
+	return(SSDV_OK);
+}
+
+static char ssdv_dec_keep(ssdv_t *s)
+{
+	uint32_t n, count = ssdv_kept_count(s);
+	
+	/* The tiles or layers are decoded into coefficients, and the
+	 * image written out in one piece when it is complete */
+	s->kept_mcu = malloc(sizeof(uint32_t) * count);
+	if(!s->kept_mcu) return(SSDV_ERROR);
+	
+	for(n = 0; n < count; n++)
+		s->kept_mcu[n] = SSDV_LIVE_PADDED;
+	
+	s->kept.r = SSDV_OK;
+	s->coef_out = &s->kept;
+	
+	return(SSDV_OK);
+}
+
+static char ssdv_dec_part_changed(ssdv_t *s, uint8_t *packet)
+{
+	uint16_t x = 0, y = 0, width = packet[9] << 4, height = packet[10] << 4, mcu_id;
+	uint8_t layer = 0;
+	
+	if(!s->kept_mcu) return(0);
+	
+	/* A recording can hold more than one image. A part of any other
+	 * image, or one that doesn't fit this one, is ignored (SSDV_ERROR) */
+	if(((packet[2] << 24) | (packet[3] << 16) | (packet[4] << 8) | packet[5]) != s->callsign ||
+	   packet[6] != s->image_id || (packet[11] & 0x03) != s->mcu_mode ||
+	   !(packet[11] & SSDV_FLAG_EXT) ||
+	   (packet[15] & SSDV_EXT_TILE ? 1 : 0) != s->tiled ||
+	   (packet[15] & SSDV_EXT_LAYERED ? 1 : 0) != s->layered) return(SSDV_ERROR);
+	
+	if(s->tiled) ssdv_get_tile(&packet[19], &x, &y);
+	if(s->layered) layer = packet[15] & SSDV_EXT_LAYER;
+	
+	if(width == 0 || height == 0 || x % MCU_WIDTH(s) || y % MCU_HEIGHT(s) ||
+	   x + width > s->width || y + height > s->height) return(SSDV_ERROR);
+	
+	mcu_id = (packet[13] << 8) | packet[14];
+	if(mcu_id != 0xFFFF && mcu_id >= width * height / (MCU_WIDTH(s) * MCU_HEIGHT(s))) return(SSDV_ERROR);
+	
+	if(x == s->tile_x && y == s->tile_y && layer == s->layer && s->tile_width > 0) return(0);
+	
+	/* Decoding moves on to another tile or layer */
+	s->tile_x = x;
+	s->tile_y = y;
+	s->tile_width = width;
+	s->tile_height = height;
+	s->mcu_count = width * height / (MCU_WIDTH(s) * MCU_HEIGHT(s));
+	s->layer = layer;
+	s->acstart = LAYER_START(s, layer);
+	s->acend = LAYER_END(s, layer);
+	
+	return(1);
+}
+
+static char ssdv_dec_kept_emit(ssdv_t *s)
+{
+	uint32_t mcu, n, count = (s->width / MCU_WIDTH(s)) * (s->height / MCU_HEIGHT(s));
+	uint8_t l, k, run, layers = s->layered ? SSDV_LAYERS : 1;
+	ssdv_coef_t *c[SSDV_LAYERS];
+	int block[64], dc[3] = { 0, 0, 0 };
+	
+	/* Write the kept coefficients in the order of the whole image */
+	s->coef_out = NULL;
+	
+	for(mcu = 0; mcu < count; mcu++)
+	{
+		/* A sink is flushed as it goes, only a fixed buffer can fill up */
+		if(!s->sink && s->out_len == 0)
+		{
+			fprintf(stderr, "Error: The output buffer is full, the image is truncated\n");
+			break;
+		}
+		
+		for(l = 0; l < layers; l++)
+		{
+			n = s->kept_mcu[l * count + mcu];
+			c[l] = n == SSDV_LIVE_PADDED ? NULL : &s->kept.coef[n];
+		}
+		
+		for(s->mcupart = 0; s->mcupart < s->ycparts + 2; s->mcupart++)
+		{
+			if(s->mcupart < s->ycparts) s->component = 0;
+			else s->component = s->mcupart - s->ycparts + 1;
+			
+			/* Merge the block's layers, any missing are left zero */
+			memset(block, 0, sizeof(block));
+			for(l = 0; l < layers; l++)
+				if(c[l]) c[l] = ssdv_coef_expand(c[l], LAYER_START(s, l), block);
+			
+			/* A missing DC repeats the last value, as ssdv_fill_gap() does */
+			s->acpart = 0;
+			if(!c[0]) ssdv_out_jpeg_int(s, 0, 0);
+			else
+			{
+				ssdv_out_jpeg_int(s, 0, block[0] - dc[s->component]);
+				dc[s->component] = block[0];
+			}
+			
+			for(s->acpart = 1, run = 0, k = 1; k < 64; k++)
+			{
+				if(block[k] == 0)
+				{
+					run++;
+					continue;
+				}
+				
+				while(run >= 16)
+				{
+					ssdv_out_jpeg_int(s, 15, 0);
+					run -= 16;
+				}
+				ssdv_out_jpeg_int(s, run, block[k]);
+				run = 0;
+			}
+			
+			if(run > 0) ssdv_out_jpeg_int(s, 0, 0);
+		}
+	}
+	
+	s->mcu_id = s->mcu_count;
+	
+	free(s->kept_mcu);
+	free(s->kept.coef);
+	s->kept_mcu = NULL;
+	memset(&s->kept, 0, sizeof(ssdv_interval_t));
+	
+	return(mcu == count ? SSDV_OK : SSDV_BUFFER_FULL);
+}
+
+static char ssdv_dec_feed_packet(ssdv_t *s, uint8_t *packet)
+{
+	int i = 0, r;
+	uint16_t packet_id;
+	char changed;
+	
+	/* Nothing more can be done once a fixed buffer is full */
+	if(!s->sink && s->out_len == 0) return(SSDV_BUFFER_FULL);
+	
+	/* Or without the image's huffman tables */
+	if(s->dht == S_DHT_LOST) return(SSDV_ERROR);
+	
+	/* Read the packet header */
+	packet_id            = (packet[7] << 8) | packet[8];
+	s->packet_mcu_offset = packet[12];
+	s->packet_mcu_id     = (packet[13] << 8) | packet[14];
+	
+	/* If this is the first packet, write the JPEG headers */
+	if(s->packet_id == 0)
+	{
+		const char *factor;
+		char callsign[SSDV_MAX_CALLSIGN + 1];
+		
+		factor = ssdv_dec_setup(s, packet);
+		
+		/* Display information about the image */
+		fprintf(stderr, "Callsign: %s\n", decode_callsign(callsign, s->callsign));
+		fprintf(stderr, "Image ID: %02X\n", s->image_id);
+		fprintf(stderr, "Resolution: %ix%i\n", s->width, s->height);
+		fprintf(stderr, "MCU blocks: %i\n", s->mcu_count);
+		fprintf(stderr, "Sampling factor: %s\n", factor);
+		if(s->tiled) fprintf(stderr, "Tiles: %ix%i pixels\n", packet[9] << 4, packet[10] << 4);
+		if(s->layered) fprintf(stderr, "Layers: %i\n", SSDV_LAYERS);
+		fprintf(stderr, "Quality level: %d\n", s->quality);
+		
+		if(s->dht == S_DHT_PENDING)
+		{
+			/* The image's own huffman tables fill its first packet */
+			if(packet_id != 0 || ssdv_dec_load_dht(s, packet) != SSDV_OK)
+			{
+				fprintf(stderr, "Error: The packet with the huffman tables is missing\n");
+				s->dht = S_DHT_LOST;
+				return(SSDV_ERROR);
+			}
+			
+			fprintf(stderr, "Huffman tables: optimised\n");
+		}
+		
+		if((s->tiled || s->layered) && ssdv_dec_keep(s) != SSDV_OK) return(SSDV_ERROR);
+		
+		/* Space for one row of MCUs, when decoding to pixels */
+		if(s->pixel_sink && !(s->pixel_row = malloc(((size_t) s->width >> s->pixel_scale) * (MCU_HEIGHT(s) >> s->pixel_scale) * 3)))
+		{
+			fprintf(stderr, "Error: Out of memory for the pixel output\n");
+			return(SSDV_ERROR);
+		}
+		
+		/* Output JPEG headers and enable byte stuffing */
+		ssdv_out_headers(s);
+		s->out_stuff = 1;
+		
+		/* There is no image data in the table packet */
+		if(s->dht == S_DHT_READY)
+		{
+			s->packet_id++;
+			return(SSDV_FEED_ME);
+		}
+	}
+	
+	/* Is this the start of another tile or layer? A packet of some other
+	 * image in the same recording is skipped */
+	changed = ssdv_dec_part_changed(s, packet);
+	if(changed == SSDV_ERROR) return(SSDV_FEED_ME);
+	
+	if(s->packet_mcu_id != 0xFFFF) s->reset_mcu = s->packet_mcu_id;
+	
+	/* Follow the region of interest into each tile */
+	if(s->roi) ssdv_dec_roi(s, packet);
+	
+	/* Is this not the packet we expected, or a new part? */
+	if(changed || packet_id != s->packet_id)
+	{
+		/* One or more packets have been lost! */
+		if(packet_id != s->packet_id)
+			fprintf(stderr, "Gap detected between packets %i and %i\n", s->packet_id - 1, packet_id);
+		
+		/* If this packet has no new MCU, ignore */
+		if(s->packet_mcu_offset == 0xFF) return(SSDV_FEED_ME);
+		
+		/* Fill the gap left by the missing packet. Kept MCUs leave
+		 * it empty, and drop any partly decoded MCU */
+		if(s->kept_mcu)
+		{
+			s->mcu_id = s->packet_mcu_id;
+			s->kept_start = s->kept.coef_len;
+		}
+		else ssdv_fill_gap(s, s->packet_mcu_id);
+		
+		/* Clear the workbits */
+		s->workbits = s->worklen = 0;
+		
+		/* Skip the bytes of the lost MCU */
+		i = s->packet_mcu_offset;
+		
+		/* Reset the JPEG decoder state */
+		s->state = S_HUFF;
+		s->component = 0;
+		s->mcupart = 0;
+		s->acpart = s->acstart;
+		s->accrle = 0;
+		
+		s->packet_id = packet_id;
+	}
+	
+	if(s->roi) s->inroi = ssdv_roi_mcu(s, s->mcu_id);
+	
+	/* Feed the JPEG data into the processor */
+	s->inp    = &packet[s->pkt_size_header + i];
+	s->in_len = s->pkt_size_payload - i;
+	
+	while(s->in_len)
+	{
+		/* Add the new bytes to the work area */
+		ssdv_inbits(s);
+		
+		/* Process the new data until more needed, or an error occurs */
+		r = ssdv_process_all(s);
+		
+		if(r == SSDV_BUFFER_FULL)
+		{
+			/* Only a fixed buffer can fill up, a sink is flushed as it goes */
+			fprintf(stderr, "Error: The output buffer is full, the image is truncated\n");
+			return(SSDV_BUFFER_FULL);
+		}
+		else if(r == SSDV_EOI && s->kept_mcu)
+		{
+			/* The end of a tile or layer, the next one follows in the next packet */
+			s->packet_id++;
+			return(ssdv_last_part(s) ? SSDV_OK : SSDV_FEED_ME);
+		}
+		else if(r == SSDV_EOI)
+		{
+			/* All done! */
+			if(s->sink) ssdv_sink_flush(s);
+			return(SSDV_OK);
+		}
+		else if(r != SSDV_FEED_ME)
+		{
+			/* An error occured */
+			fprintf(stderr, "ssdv_process() failed: %i\n", r);
+			return(SSDV_ERROR);
+		}
+	}
+	
+	/* The next packet to expect... */
+	s->packet_id++;
+	
+	/* Let the sink have what's ready so far */
+	if(s->sink) ssdv_sink_flush(s);
+	
+	return(SSDV_FEED_ME);
+}
+
+char ssdv_dec_set_reorder(ssdv_t *s, uint8_t *buffer, uint16_t window)
+{
+	/* The buffer holds 'window' packets, followed by the bitmap
+	 * of those in use. It is SSDV_REORDER_LEN(window) bytes */
+	s->reorder = buffer;
+	s->reorder_held = buffer ? buffer + (size_t) window * SSDV_PKT_SIZE : NULL;
+	s->reorder_window = window;
+	s->reorder_count = 0;
+	s->reorder_base = 0;
+	
+	if(buffer) memset(s->reorder_held, 0, (window + 7) / 8);
+	
+	return(SSDV_OK);
+}
+
+static char ssdv_dec_release(ssdv_t *s)
+{
+	uint16_t i = s->reorder_base % s->reorder_window;
+	char r = SSDV_FEED_ME;
+	
+	/* Decode the lowest packet in the window, if it has arrived */
+	if(REORDER_HELD(s, i))
+	{
+		s->reorder_held[i >> 3] &= ~(1 << (i & 7));
+		s->reorder_count--;
+		r = ssdv_dec_feed_packet(s, &s->reorder[i * SSDV_PKT_SIZE]);
+	}
+	
+	s->reorder_base++;
+	
+	return(r);
+}
+
+static char ssdv_dec_feed_window(ssdv_t *s, uint8_t *packet)
+{
+	uint16_t packet_id = (packet[7] << 8) | packet[8];
+	uint16_t i;
+	char r = SSDV_FEED_ME, rr;
+	
+	if(!s->reorder) return(ssdv_dec_feed_packet(s, packet));
+	
+	/* Too late, the image has already moved past this packet */
+	if(packet_id < s->reorder_base) return(SSDV_FEED_ME);
+	
+	/* Make room in the window, missing packets are given up on. Once
+	 * none are held the window moves straight to the new packet */
+	while(packet_id >= s->reorder_base + s->reorder_window)
+	{
+		if(s->reorder_count == 0)
+		{
+			s->reorder_base = packet_id - s->reorder_window + 1;
+			break;
+		}
+		
+		if((rr = ssdv_dec_release(s)) != SSDV_FEED_ME) r = rr;
+	}
+	
+	/* Hold the packet, ignoring duplicates */
+	i = packet_id % s->reorder_window;
+	if(REORDER_HELD(s, i)) return(r);
+	
+	memcpy(&s->reorder[i * SSDV_PKT_SIZE], packet, SSDV_PKT_SIZE);
+	s->reorder_held[i >> 3] |= 1 << (i & 7);
+	s->reorder_count++;
+	
+	/* Decode any packets that are now in order */
+	while(REORDER_HELD(s, s->reorder_base % s->reorder_window))
+		if((rr = ssdv_dec_release(s)) != SSDV_FEED_ME) r = rr;
+	
+	return(r);
+}
+
+char ssdv_dec_feed(ssdv_t *s, uint8_t *packet)
+{
+	char r;
+	STATS_START(t);
+	
+	r = ssdv_dec_feed_window(s, packet);
+	
+	STATS_STOP(&s->stats, ns_packet, t);
+	return(r);
+}
+
+static char ssdv_dec_finish(ssdv_t *s, uint8_t **jpeg, size_t *length)
+{
+	char r = SSDV_OK;
+	
+	/* Decode any packets still held for reordering */
+	while(s->reorder && s->reorder_count > 0)
+		ssdv_dec_release(s);
+	
+	/* Nothing could be decoded without the huffman tables */
+	if(s->dht == S_DHT_LOST)
+	{
+		*jpeg = NULL;
+		*length = 0;
+		return(SSDV_ERROR);
+	}
+	
+	/* Is the image complete? A truncated image can only be ended */
+	if(s->kept_mcu) r = ssdv_dec_kept_emit(s);
+	else if(s->sink || s->out_len > 0)
+	{
+		if(s->mcu_id < s->mcu_count) ssdv_fill_gap(s, s->mcu_count);
+	}
+	
+	/* Use the space kept back for the EOI, dropping any bits that didn't fit */
+	if(!s->sink)
+	{
+		if(s->out_len == 0)
+		{
+			s->outlen = 0;
+			r = SSDV_BUFFER_FULL;
+		}
+		s->out_len += SSDV_EOI_RESERVE;
+	}
+	
+	/* Sync, and final EOI header and return */
+	ssdv_outbits_sync(s);
+	s->out_stuff = 0;
+	ssdv_write_marker(s, J_EOI, 0, 0);
+	
+	/* Every row of pixels has been passed on */
+	free(s->pixel_row);
+	s->pixel_row = NULL;
+	
+	if(s->sink)
+	{
+		/* Everything has already gone to the sink */
+		ssdv_sink_flush(s);
+		*jpeg = NULL;
+		*length = s->sink_len;
+		return(SSDV_OK);
+	}
+	
+	*jpeg = s->out;
+	*length = (size_t) (s->outp - s->out);
+	
+	/* A full buffer leaves the JPEG truncated, but still ended */
+	return(r);
+}
+
+char ssdv_dec_get_jpeg(ssdv_t *s, uint8_t **jpeg, size_t *length)
+{
+	char r;
+	STATS_START(t);
+	
+	r = ssdv_dec_finish(s, jpeg, length);
+	
+	STATS_STOP(&s->stats, ns_finish, t);
+	return(r);
+}
+
+static char ssdv_dec_check_header(uint8_t *pkt, uint8_t type, uint16_t pkt_size_payload)
+{
+	ssdv_packet_info_t p;
+	
+	ssdv_dec_header(&p, pkt);
+	
+	if(p.type != type) return(-1);
+	if(p.width == 0 || p.height == 0) return(-1);
+	if(p.tiled && (p.tile_x + p.width > p.image_width || p.tile_y + p.height > p.image_height)) return(-1);
+	if(p.layered && p.layer >= SSDV_LAYERS) return(-1);
+	if(p.thumbnail > SSDV_MAX_THUMB) return(-1);
+	if(p.roi && (p.roi_x + p.roi_width > p.width || p.roi_y + p.roi_height > p.height)) return(-1);
+	
+	/* An extended header leaves less room for the payload */
+	pkt_size_payload -= ssdv_header_size(pkt) - SSDV_PKT_SIZE_HEADER;
+	
+	if(p.mcu_id != 0xFFFF)
+	{
+		if(p.mcu_id >= p.mcu_count) return(-1);
+		if(p.mcu_offset >= pkt_size_payload) return(-1);
+	}
+	
+	return(0);
+}
+
+static char ssdv_dec_test_packet(uint8_t *packet, int *errors, ssdv_stats_t *stats)
+{
+	uint8_t pkt[SSDV_PKT_SIZE];
+	uint8_t type;
+	uint16_t pkt_size_payload;
+	uint16_t pkt_size_crcdata;
+	uint32_t x;
+	int i;
+	
+	/* Testing is destructive, work on a copy */
+	memcpy(pkt, packet, SSDV_PKT_SIZE);
+	pkt[0] = 0x55;
+	
+	type = SSDV_TYPE_INVALID;
+	
+	if(pkt[1] == 0x66 + SSDV_TYPE_NOFEC)
+	{
+		/* Test for a valid NOFEC packet */
+		pkt_size_payload = SSDV_PKT_SIZE - SSDV_PKT_SIZE_HEADER - SSDV_PKT_SIZE_CRC;
+		pkt_size_crcdata = SSDV_PKT_SIZE_HEADER + pkt_size_payload - 1;
+		
+		/* No FEC scan */
+		if(errors) *errors = 0;
+		
+		/* Test the checksum */
+		x = crc32(&pkt[1], pkt_size_crcdata);
+		
+		i = 1 + pkt_size_crcdata;
+		if(x == (pkt[i + 3] | (pkt[i + 2] << 8) | (pkt[i + 1] << 16) | (pkt[i] << 24)))
+		{
+			/* Valid, set the type and continue */
+			type = SSDV_TYPE_NOFEC;
+			STATS_ADD(stats, crc_ok, 1);
+		}
+	}
+	else if(pkt[1] == 0x66 + SSDV_TYPE_NORMAL)
+	{
+		/* Test for a valid NORMAL packet */
+		pkt_size_payload = SSDV_PKT_SIZE - SSDV_PKT_SIZE_HEADER - SSDV_PKT_SIZE_CRC - SSDV_PKT_SIZE_RSCODES;
+		pkt_size_crcdata = SSDV_PKT_SIZE_HEADER + pkt_size_payload - 1;
+		
+		/* No FEC scan */
+		if(errors) *errors = 0;
+		
+		/* Test the checksum */
+		x = crc32(&pkt[1], pkt_size_crcdata);
+		
+		i = 1 + pkt_size_crcdata;
+		if(x == (pkt[i + 3] | (pkt[i + 2] << 8) | (pkt[i + 1] << 16) | (pkt[i] << 24)))
+		{
+			/* Valid, set the type and continue */
+			type = SSDV_TYPE_NORMAL;
+			STATS_ADD(stats, crc_ok, 1);
+		}
+	}
+	
+	if(type == SSDV_TYPE_INVALID)
+	{
+		/* Test for a valid NORMAL packet with correctable errors */
+		pkt_size_payload = SSDV_PKT_SIZE - SSDV_PKT_SIZE_HEADER - SSDV_PKT_SIZE_CRC - SSDV_PKT_SIZE_RSCODES;
+		pkt_size_crcdata = SSDV_PKT_SIZE_HEADER + pkt_size_payload - 1;
+		
+		/* Run the reed-solomon decoder */
+		pkt[1] = 0x66 + SSDV_TYPE_NORMAL;
+		i = decode_rs_8(&pkt[1], 0, 0, 0);
+		
+		if(i < 0)
+		{
+			/* Reed-solomon decoder failed */
+			STATS_ADD(stats, rs_failed, 1);
+			return(-1);
+		}
+		if(errors) *errors = i;
+		STATS_ADD(stats, rs_corrected, i);
+		
+		/* Test the checksum */
+		x = crc32(&pkt[1], pkt_size_crcdata);
+		
+		i = 1 + pkt_size_crcdata;
+		if(x == (pkt[i + 3] | (pkt[i + 2] << 8) | (pkt[i + 1] << 16) | (pkt[i] << 24)))
+		{
+			/* Valid, set the type and continue */
+			type = SSDV_TYPE_NORMAL;
+			STATS_ADD(stats, rs_ok, 1);
+		}
+	}
+	
+	if(type == SSDV_TYPE_INVALID)
+	{
+		/* All attempts to read the packet have failed */
+		STATS_ADD(stats, crc_failed, 1);
+		return(-1);
+	}
+	
+	/* Sanity checks */
+	if(ssdv_dec_check_header(pkt, type, pkt_size_payload) != 0)
+	{
+		STATS_ADD(stats, invalid, 1);
+		return(-1);
+	}
+	
+	/* Appears to be a valid packet! Copy it back */
+	memcpy(packet, pkt, SSDV_PKT_SIZE);
+	
+	return(0);
+}
+
+char ssdv_dec_is_packet(uint8_t *packet, int *errors)
+{
+	return(ssdv_dec_check_packet(packet, errors, NULL));
+}
+
+char ssdv_dec_check_packet(uint8_t *packet, int *errors, ssdv_stats_t *stats)
+{
+	char r;
+#ifdef SSDV_STATS
+	ssdv_stats_t none;
+	
+	/* Counted and thrown away if the caller has nowhere to keep them */
+	if(!stats) stats = memset(&none, 0, sizeof(none));
+#endif
+	STATS_START(t);
+	
+	r = ssdv_dec_test_packet(packet, errors, stats);
+	
+	STATS_ADD(stats, checked, 1);
+	STATS_ADD(stats, accepted, r == 0);
+	STATS_STOP(stats, ns_check, t);
+	return(r);
+}
+
+char ssdv_get_stats(ssdv_t *s, ssdv_stats_t *stats)
+{
+	memset(stats, 0, sizeof(ssdv_stats_t));
+	
+#ifdef SSDV_STATS
+	/* Only the image's own counters, packet checks are counted by the caller */
+	*stats = s->stats;
+	
+	return(SSDV_OK);
+#else
+	return(SSDV_ERROR);
+#endif
+}
+
+void ssdv_dec_header(ssdv_packet_info_t *info, uint8_t *packet)
+{
+	info->type       = packet[1] - 0x66;
+	info->callsign   = (packet[2] << 24) | (packet[3] << 16) | (packet[4] << 8) | packet[5];
+	decode_callsign(info->callsign_s, info->callsign);
+	info->image_id   = packet[6];
+	info->packet_id  = (packet[7] << 8) | packet[8];
+	info->width      = packet[9] << 4;
+	info->height     = packet[10] << 4;
+	info->eoi        = (packet[11] >> 2) & 1;
+	info->quality    = ((packet[11] >> 3) & 7) ^ 4;
+	info->mcu_mode   = packet[11] & 0x03;
+	info->mcu_offset = packet[12];
+	info->mcu_id     = (packet[13] << 8) | packet[14];
+	info->mcu_count  = packet[9] * packet[10];
+	if(info->mcu_mode == 1 || info->mcu_mode == 2) info->mcu_count *= 2;
+	else if(info->mcu_mode == 3) info->mcu_count *= 4;
+	info->tiled      = packet[11] & SSDV_FLAG_EXT && packet[15] & SSDV_EXT_TILE ? 1 : 0;
+	info->layered    = packet[11] & SSDV_FLAG_EXT && packet[15] & SSDV_EXT_LAYERED ? 1 : 0;
+	info->layer      = info->layered ? packet[15] & SSDV_EXT_LAYER : 0;
+	info->thumbnail  = packet[11] & SSDV_FLAG_EXT && packet[15] & SSDV_EXT_THUMB ? (packet[15] & SSDV_EXT_LAYER) + 1 : 0;
+	info->roi        = packet[11] & SSDV_FLAG_EXT && packet[15] & SSDV_EXT_ROI ? 1 : 0;
+	info->grey       = packet[11] & SSDV_FLAG_EXT && packet[15] & SSDV_EXT_GREY ? 1 : 0;
+	info->roi_quality = info->roi_x = info->roi_y = info->roi_width = info->roi_height = 0;
+	if(info->roi) ssdv_get_roi(packet, &info->roi_quality, &info->roi_x, &info->roi_y, &info->roi_width, &info->roi_height);
+	info->image_width  = info->width;
+	info->image_height = info->height;
+	info->tile_x = info->tile_y = 0;
+	
+	if(info->tiled)
+	{
+		ssdv_get_tile(&packet[16], &info->image_width, &info->image_height);
+		ssdv_get_tile(&packet[19], &info->tile_x, &info->tile_y);
+	}
+}
+
+/*****************************************************************************/
+
+static void ssdv_demux_sink(void *arg, uint8_t *data, size_t length)
+{
+	ssdv_demux_slot_t *slot = arg;
+	uint8_t *buffer;
+	size_t size;
+	
+	if(slot->full) return;
+	
+	if(slot->buffer_len + length > slot->buffer_size)
+	{
+		/* Grow the buffer, up to the limit if there is one */
+		size = slot->buffer_size ? slot->buffer_size : SSDV_DEMUX_BUFFER;
+		while(size < slot->buffer_len + length) size *= 2;
+		if(slot->buffer_limit && size > slot->buffer_limit) size = slot->buffer_limit;
+		
+		if(size < slot->buffer_len + length || !(buffer = realloc(slot->buffer, size)))
+		{
+			fprintf(stderr, "Error: The output buffer is full, the image is truncated\n");
+			slot->full = 1;
+			return;
+		}
+		
+		slot->buffer = buffer;
+		slot->buffer_size = size;
+	}
+	
+	memcpy(&slot->buffer[slot->buffer_len], data, length);
+	slot->buffer_len += length;
+}
+
+static void ssdv_demux_finish(ssdv_demux_t *d, ssdv_demux_slot_t *slot)
+{
+	uint8_t *jpeg;
+	size_t length;
+	
+	if(slot->state != D_DECODING) return;
+	
+	/* Complete the JPEG, the sink has collected it */
+	ssdv_dec_get_jpeg(&slot->ssdv, &jpeg, &length);
+	
+	/* A truncated image still ends with an EOI */
+	if(slot->full && slot->buffer_len >= 2)
+	{
+		slot->buffer[slot->buffer_len - 2] = 0xFF;
+		slot->buffer[slot->buffer_len - 1] = J_EOI & 0xFF;
+	}
+	
+	if(d->callback) d->callback(d->callback_arg, &slot->info, slot->buffer, slot->buffer_len);
+	
+	/* Keep the slot's identity so late packets are ignored */
+	slot->state = D_DONE;
+}
+
+char ssdv_demux_init(ssdv_demux_t *d, size_t buffer_length, uint32_t timeout, ssdv_demux_callback_t callback, void *arg)
+{
+	memset(d, 0, sizeof(ssdv_demux_t));
+	
+	d->buffer_length = buffer_length;
+	d->timeout = timeout;
+	d->callback = callback;
+	d->callback_arg = arg;
+	
+	return(SSDV_OK);
+}
+
+char ssdv_demux_feed(ssdv_demux_t *d, uint8_t *packet)
+{
+	ssdv_demux_slot_t *slot = NULL, *sl;
+	uint32_t callsign;
+	uint8_t image_id, thumb;
+	int i;
+	char r;
+	
+	callsign = (packet[2] << 24) | (packet[3] << 16) | (packet[4] << 8) | packet[5];
+	image_id = packet[6];
+	thumb    = packet[11] & SSDV_FLAG_EXT && packet[15] & SSDV_EXT_THUMB ? 1 : 0;
+	
+	d->clock++;
+	
+	/* Find the image this packet belongs to, a thumbnail is kept apart from the full image */
+	for(i = 0; i < SSDV_DEMUX_SLOTS; i++)
+	{
+		sl = &d->slot[i];
+		if(sl->state != D_FREE && sl->info.callsign == callsign && sl->info.image_id == image_id &&
+		   (sl->info.thumbnail ? 1 : 0) == thumb)
+			slot = sl;
+	}
+	
+	/* Ignore packets for an image that has already been finished */
+	if(slot && slot->state == D_DONE) return(SSDV_FEED_ME);
+	
+	if(!slot)
+	{
+		for(i = 0; i < SSDV_DEMUX_SLOTS; i++)
 		{
-			int i, j;
-			
-			switch(d[0])
-			{
-			case 0x00: s->sdht[0][0] = d; break;
-			case 0x01: s->sdht[0][1] = d; break;
-			case 0x10: s->sdht[1][0] = d; break;
-			case 0x11: s->sdht[1][1] = d; break;
-			}
+			sl = &d->slot[i];
 			
-			/* Skip to the next DHT table */
-			for(j = 17, i = 1; i <= 16; i++)
-				j += d[i];
+			/* A new image from this callsign ends the previous one */
+			if(sl->info.callsign == callsign) ssdv_demux_finish(d, sl);
 			
-			l -= j;
-			d += j;
+			/* Prefer a free slot, then a finished one, then the least recently fed */
+			if(!slot || sl->state < slot->state ||
+			   (sl->state == slot->state && sl->last_seen < slot->last_seen))
+				slot = sl;
 		}
-		break;
-	
-	case J_DQT:
-		s->stbl_len += l;
-		while(l > 0)
+		
+		ssdv_demux_finish(d, slot);
+		
+		/* The slot's buffer is kept for the next image */
+		slot->buffer_len = 0;
+		slot->buffer_limit = d->buffer_length;
+		slot->full = 0;
+		
+		if(d->reorder_window && !slot->reorder &&
+		   !(slot->reorder = malloc(SSDV_REORDER_LEN(d->reorder_window))))
 		{
-			switch(d[0])
-			{
-			case 0x00: s->sdqt[0] = d; break;
-			case 0x01: s->sdqt[1] = d; break;
-			}
-			
-			/* Skip to the next one, if present */
-			l -= 65;
-			d += 65;
+			fprintf(stderr, "Error: Failed to allocate the packet reordering buffer\n");
+			return(SSDV_ERROR);
 		}
-		break;
+		
+		ssdv_dec_init(&slot->ssdv);
+		ssdv_dec_set_sink(&slot->ssdv, ssdv_demux_sink, slot);
+		if(slot->reorder) ssdv_dec_set_reorder(&slot->ssdv, slot->reorder, d->reorder_window);
+		
+		ssdv_dec_header(&slot->info, packet);
+		slot->state = D_DECODING;
+	}
 	
-	case J_DRI:
-		s->dri = (d[0] << 8) + d[1];
-		fprintf(stderr, "Reset interval: %i blocks\n", s->dri);
-		break;
+	slot->last_seen = d->clock;
+	
+	/* Feed it to the image's decoder, finishing the image at the EOI */
+	r = ssdv_dec_feed(&slot->ssdv, packet);
+	if(r == SSDV_OK) ssdv_demux_finish(d, slot);
+	
+	/* Finish any images that have not been seen for too long */
+	for(i = 0; d->timeout && i < SSDV_DEMUX_SLOTS; i++)
+	{
+		sl = &d->slot[i];
+		if(d->clock - sl->last_seen > d->timeout) ssdv_demux_finish(d, sl);
 	}
 	
-	s->state = S_MARKER;
-	return(SSDV_OK);
+	return(r);
 }
 
-char ssdv_enc_init(ssdv_t *s, uint8_t type, char *callsign, uint8_t image_id, int8_t quality)
+char ssdv_demux_flush(ssdv_demux_t *d)
 {
-	/* Limit the quality level */
-	if(quality < 0) quality = 0;
-	if(quality > 7) quality = 7;
-	
-	memset(s, 0, sizeof(ssdv_t));
-	s->image_id = image_id;
-	s->callsign = encode_callsign(callsign);
-	s->mode = S_ENCODING;
-	s->type = type;
-	s->quality = quality;
-	ssdv_set_packet_conf(s);
+	int i;
 	
-	/* Prepare the output JPEG tables */
-	s->ddqt[0] = dload_standard_dqt(s, std_dqt0, s->quality);
-	s->ddqt[1] = dload_standard_dqt(s, std_dqt1, s->quality);
-	s->ddht[0][0] = dtblcpy(s, std_dht00, sizeof(std_dht00));
-	s->ddht[0][1] = dtblcpy(s, std_dht01, sizeof(std_dht01));
-	s->ddht[1][0] = dtblcpy(s, std_dht10, sizeof(std_dht10));
-	s->ddht[1][1] = dtblcpy(s, std_dht11, sizeof(std_dht11));
+	for(i = 0; i < SSDV_DEMUX_SLOTS; i++)
+	{
+		ssdv_demux_finish(d, &d->slot[i]);
+		
+		free(d->slot[i].buffer);
+		free(d->slot[i].reorder);
+		d->slot[i].buffer = NULL;
+		d->slot[i].buffer_size = 0;
+		d->slot[i].reorder = NULL;
+		d->slot[i].state = D_FREE;
+	}
 	
 	return(SSDV_OK);
 }
 
-char ssdv_enc_set_buffer(ssdv_t *s, uint8_t *buffer)
+/*****************************************************************************/
+
+static uint64_t ssdv_merge_key(uint8_t *packet)
 {
-	s->out     = buffer;
-	s->outp    = buffer + SSDV_PKT_SIZE_HEADER;
-	s->out_len = s->pkt_size_payload;
+	/* Callsign, image ID and packet ID */
+	return(((uint64_t) packet[2] << 48) | ((uint64_t) packet[3] << 40) |
+	       ((uint64_t) packet[4] << 32) | ((uint64_t) packet[5] << 24) |
+	       (packet[6] << 16) | (packet[7] << 8) | packet[8]);
+}
+
+/* Marks a used entry in the history, the keys only use 56 bits */
+#define SSDV_MERGE_USED (1ULL << 63)
+
+static uint16_t ssdv_merge_hash(uint64_t key)
+{
+	/* Consecutive packets of an image go to consecutive entries, each
+	 * image starting at a different place. A packet replaces any older
+	 * one in the same entry */
+	return((key + (key >> 16) * 0x9E3779B1) & (SSDV_MERGE_HISTORY - 1));
+}
+
+static void ssdv_merge_pass(ssdv_merge_t *m)
+{
+	ssdv_merge_slot_t *slot = &m->slot[m->head];
 	
-	/* Zero the payload memory */
-	memset(s->out, 0, SSDV_PKT_SIZE);
+	/* Remember the oldest packet, so later copies are dropped */
+	m->history[ssdv_merge_hash(slot->key)] = slot->key | SSDV_MERGE_USED;
 	
-	/* Flush the output bits */
-	ssdv_outbits(s, 0, 0);
+	m->head = (m->head + 1) % SSDV_MERGE_WINDOW;
+	m->len--;
 	
-	return(SSDV_OK);
+	/* And pass it on */
+	m->callback(m->callback_arg, slot->packet);
 }
 
-char ssdv_enc_get_packet(ssdv_t *s)
+char ssdv_merge_init(ssdv_merge_t *m, uint32_t window, ssdv_merge_callback_t callback, void *arg)
 {
-	int r;
-	uint8_t b;
+	memset(m, 0, sizeof(ssdv_merge_t));
 	
-	/* Have we reached the end of the image? */
-	if(s->state == S_EOI) return(SSDV_EOI);
+	m->window = window < SSDV_MERGE_WINDOW ? window : SSDV_MERGE_WINDOW;
+	m->callback = callback;
+	m->callback_arg = arg;
 	
-	/* If the output buffer is empty, re-initialise */
-	if(s->out_len == 0) ssdv_enc_set_buffer(s, s->out);
+	return(SSDV_OK);
+}
+
+char ssdv_merge_feed(ssdv_merge_t *m, uint8_t *packet, int errors)
+{
+	ssdv_merge_slot_t *slot = NULL, *sl;
+	uint64_t key = ssdv_merge_key(packet);
+	char r = SSDV_OK;
+	int i;
 	
-	while(s->in_len)
+	m->clock++;
+	
+	/* Is this a copy of a packet already passed on? */
+	if(m->history[ssdv_merge_hash(key)] == (key | SSDV_MERGE_USED)) r = SSDV_FEED_ME;
+	else
 	{
-		b = *(s->inp++);
-		s->in_len--;
-		
-		/* Skip bytes if necessary */
-		if(s->in_skip) { s->in_skip--; continue; }
-		
-		switch(s->state)
+		/* Or of one still being held? */
+		for(i = 0; i < m->len && !slot; i++)
 		{
-		case S_MARKER:
-			s->marker = (s->marker << 8) | b;
-			
-			if(s->marker == J_TEM ||
-			   (s->marker >= J_RST0 && s->marker <= J_EOI))
-			{
-				/* Marker without data */
-				s->marker_len = 0;
-				r = ssdv_have_marker(s);
-				if(r != SSDV_OK) return(r);
-			}
-			else if(s->marker >= J_SOF0 && s->marker <= J_COM)
-			{
-				/* All other markers are followed by data */
-				s->marker_len = 0;
-				s->state = S_MARKER_LEN;
-				s->needbits = 16;
-			}
-			break;
-		
-		case S_MARKER_LEN:
-			s->marker_len = (s->marker_len << 8) | b;
-			if((s->needbits -= 8) == 0)
-			{
-				s->marker_len -= 2;
-				r = ssdv_have_marker(s);
-				if(r != SSDV_OK) return(r);
-			}
-			break;
+			sl = &m->slot[(m->head + i) % SSDV_MERGE_WINDOW];
+			if(sl->key == key) slot = sl;
+		}
 		
-		case S_MARKER_DATA:
-			s->marker_data[s->marker_data_len++] = b;
-			if(s->marker_data_len == s->marker_len)
+		if(slot)
+		{
+			/* Keep whichever copy needed fewer corrections */
+			if(errors < slot->errors)
 			{
-				r = ssdv_have_marker_data(s);
-				if(r != SSDV_OK) return(r);
+				memcpy(slot->packet, packet, SSDV_PKT_SIZE);
+				slot->errors = errors;
 			}
-			break;
-		
-		case S_HUFF:
-		case S_INT:
-			/* Is the next byte a stuffing byte? Skip it */
-			/* TODO: Test the next byte is actually 0x00 */
-			if(b == 0xFF) s->in_skip++;
-			
-			/* Add the new byte to the work area */
-			s->workbits = (s->workbits << 8) | b;
-			s->worklen += 8;
 			
-			/* Process the new data until more needed, or an error occurs */
-			while((r = ssdv_process(s)) == SSDV_OK);
+			r = SSDV_FEED_ME;
+		}
+		else
+		{
+			if(m->len == SSDV_MERGE_WINDOW) ssdv_merge_pass(m);
 			
-			if(r == SSDV_BUFFER_FULL || r == SSDV_EOI)
-			{
-				uint16_t mcu_id     = s->packet_mcu_id;
-				uint8_t i, mcu_offset = s->packet_mcu_offset;
-				uint32_t x;
-				
-				if(mcu_offset != 0xFF && mcu_offset >= s->pkt_size_payload)
-				{
-					/* The first MCU begins in the next packet, not this one */
-					mcu_id = 0xFFFF;
-					mcu_offset = 0xFF;
-					s->packet_mcu_offset -= s->pkt_size_payload;
-				}
-				else
-				{
-					/* Clear the MCU data for the next packet */
-					s->packet_mcu_id = 0xFFFF;
-					s->packet_mcu_offset = 0xFF;
-				}
-				
-				/* A packet is ready, create the headers */
-				s->out[0]   = 0x55;                /* Sync */
-				s->out[1]   = 0x66 + s->type;      /* Type */
-				s->out[2]   = s->callsign >> 24;
-				s->out[3]   = s->callsign >> 16;
-				s->out[4]   = s->callsign >> 8;
-				s->out[5]   = s->callsign;
-				s->out[6]   = s->image_id;         /* Image ID */
-				s->out[7]   = s->packet_id >> 8;   /* Packet ID MSB */
-				s->out[8]   = s->packet_id & 0xFF; /* Packet ID LSB */
-				s->out[9]   = s->width >> 4;       /* Width / 16 */
-				s->out[10]  = s->height >> 4;      /* Height / 16 */
-				s->out[11]  = 0x00;
-				s->out[11] |= ((s->quality - 4) & 7) << 3;  /* Quality level */
-				s->out[11] |= (r == SSDV_EOI ? 1 : 0) << 2; /* EOI flag (1 bit) */
-				s->out[11] |= s->mcu_mode & 0x03;  /* MCU mode (2 bits) */
-				s->out[12]  = mcu_offset;          /* Next MCU offset */
-				s->out[13]  = mcu_id >> 8;         /* MCU ID MSB */
-				s->out[14]  = mcu_id & 0xFF;       /* MCU ID LSB */
-				
-				/* Fill any remaining bytes with noise */
-				if(s->out_len > 0) ssdv_memset_prng(s->outp, s->out_len);
-				
-				/* Calculate the CRC codes */
-				x = crc32(&s->out[1], s->pkt_size_crcdata);
-				
-				i = 1 + s->pkt_size_crcdata;
-				s->out[i++] = (x >> 24) & 0xFF;
-				s->out[i++] = (x >> 16) & 0xFF;
-				s->out[i++] = (x >> 8) & 0xFF;
-				s->out[i++] = x & 0xFF;
-				
-				/* Generate the RS codes */
-				if(s->type == SSDV_TYPE_NORMAL)
-					encode_rs_8(&s->out[1], &s->out[i], 0);
-				
-				s->packet_id++;
-				
-				/* Have we reached the end of the image data? */
-				if(r == SSDV_EOI) s->state = S_EOI;
-				
-				return(SSDV_OK);
-			}
-			else if(r != SSDV_FEED_ME)
-			{
-				/* An error occured */
-				fprintf(stderr, "ssdv_process() failed: %i\n", r);
-				return(SSDV_ERROR);
-			}
-			break;
-		
-		case S_EOI:
-			/* Shouldn't reach this point */
-			break;
+			slot = &m->slot[(m->head + m->len) % SSDV_MERGE_WINDOW];
+			slot->key = key;
+			slot->errors = errors;
+			slot->first_seen = m->clock;
+			memcpy(slot->packet, packet, SSDV_PKT_SIZE);
+			m->len++;
 		}
 	}
 	
-	/* Need more data */
-	return(SSDV_FEED_ME);
+	if(r == SSDV_FEED_ME) m->duplicates++;
+	
+	/* Pass on the packets that have waited long enough for another copy */
+	while(m->len > 0 && m->clock - m->slot[m->head].first_seen >= m->window)
+		ssdv_merge_pass(m);
+	
+	return(r);
 }
 
-char ssdv_enc_feed(ssdv_t *s, uint8_t *buffer, size_t length)
+char ssdv_merge_flush(ssdv_merge_t *m)
 {
-	s->inp    = buffer;
-	s->in_len = length;
+	while(m->len > 0) ssdv_merge_pass(m);
+	
 	return(SSDV_OK);
 }
 
 /*****************************************************************************/
 
-static void ssdv_write_marker(ssdv_t *s, uint16_t id, uint16_t length, const uint8_t *data)
+#define LIVE_PACKET(l, id) (&(l)->packets[(size_t) (id) * SSDV_PKT_SIZE])
+
+static inline char ssdv_live_resync(ssdv_live_t *l, uint32_t id)
 {
-	ssdv_outbits(s, id, 16);
-	if(length > 0)
+	uint8_t *pkt = LIVE_PACKET(l, id);
+	
+	/* Does an MCU begin in this packet? */
+	return(pkt[12] != 0xFF && ((pkt[13] << 8) | pkt[14]) != 0xFFFF);
+}
+
+static size_t ssdv_live_mcu_len(ssdv_live_t *l, uint32_t id)
+{
+	ssdv_coef_t *c = &l->coef.coef[l->mcu[id]];
+	int i;
+	
+	/* Walk to the end of the MCU's last block */
+	for(i = 0; i < l->dec.ycparts + 2; i++)
+		while((c++)->rle != SSDV_COEF_END);
+	
+	return(c - &l->coef.coef[l->mcu[id]]);
+}
+
+static char ssdv_live_compact(ssdv_live_t *l)
+{
+	ssdv_coef_t *coef;
+	size_t len = 0, n;
+	uint32_t id;
+	
+	/* Drop the coefficients that have been replaced */
+	coef = malloc(sizeof(ssdv_coef_t) * (l->coef.coef_len - l->coef_unused));
+	if(!coef) return(SSDV_ERROR);
+	
+	for(id = 0; id < l->dec.mcu_count; id++)
 	{
-		ssdv_outbits(s, length + 2, 16);
-		while(length--) ssdv_outbits(s, *(data++), 8);
+		if(l->mcu[id] == SSDV_LIVE_PADDED) continue;
+		
+		n = ssdv_live_mcu_len(l, id);
+		memcpy(&coef[len], &l->coef.coef[l->mcu[id]], sizeof(ssdv_coef_t) * n);
+		l->mcu[id] = len;
+		len += n;
 	}
+	
+	free(l->coef.coef);
+	l->coef.coef = coef;
+	l->coef.coef_len = len;
+	l->coef.coef_size = len;
+	l->coef_unused = 0;
+	
+	return(SSDV_OK);
 }
 
-static void ssdv_out_headers(ssdv_t *s)
+static char ssdv_live_decode(ssdv_live_t *l, uint32_t id, uint32_t *first, uint32_t *last)
 {
-	uint8_t *b = &s->stbls[s->stbl_len];
+	ssdv_t *s = &l->dec;
+	uint8_t *pkt;
+	uint32_t start, k, mcu;
+	size_t n, len, c;
+	char r = SSDV_FEED_ME;
+	int i;
 	
-	ssdv_write_marker(s, J_SOI,    0, 0);
-	ssdv_write_marker(s, J_APP0,  14, app0);
-	ssdv_write_marker(s, J_DQT,   65, s->ddqt[0]);  /* DQT Luminance       */
-	ssdv_write_marker(s, J_DQT,   65, s->ddqt[1]);  /* DQT Chrominance     */
+	/* Start at the last MCU to begin before this packet, if every
+	 * packet since then is here. Otherwise at this packet's own MCU */
+	for(start = id; start > 0 && l->have[start - 1]; )
+		if(ssdv_live_resync(l, --start)) break;
 	
-	/* Build SOF0 header */
-	b[0]  = 8; /* Precision */
-	b[1]  = s->height >> 8;
-	b[2]  = s->height & 0xFF;
-	b[3]  = s->width >> 8;
-	b[4]  = s->width & 0xFF;
-	b[5]  = 3; /* Components (Y'Cb'Cr) */
-	b[6]  = 1; /* Y */
-	switch(s->mcu_mode)
+	if(start == id || !ssdv_live_resync(l, start))
 	{
-	case 0: b[7] = 0x22; break;
-	case 1: b[7] = 0x12; break;
-	case 2: b[7] = 0x21; break;
-	case 3: b[7] = 0x11; break;
+		/* Without an MCU start the packet has to wait for the one before it */
+		if(!ssdv_live_resync(l, id)) return(SSDV_FEED_ME);
+		start = id;
+	}
+	
+	pkt = LIVE_PACKET(l, start);
+	s->mcu_id = s->reset_mcu = (pkt[13] << 8) | pkt[14];
+	if(s->mcu_id >= s->mcu_count) return(SSDV_FEED_ME);
+	
+	/* Reset the JPEG decoder state */
+	s->state = S_HUFF;
+	s->component = 0;
+	s->mcupart = 0;
+	s->acpart = 0;
+	s->accrle = 0;
+	s->workbits = s->worklen = 0;
+	
+	*first = s->mcu_id;
+	c = l->coef.coef_len;
+	s->coef_out = &l->coef;
+	
+	for(k = start; k < l->packets_len && l->have[k]; k++)
+	{
+		pkt = LIVE_PACKET(l, k);
+		len = s->pkt_size_payload;
+		n = 0;
+		
+		if(k == start) n = pkt[12];
+		else if(ssdv_live_resync(l, k))
+		{
+			s->reset_mcu = (pkt[13] << 8) | pkt[14];
+			
+			/* Past the new packet, the rest was decoded from here before */
+			if(k > id) len = pkt[12];
+		}
+		
+		s->inp    = &pkt[s->pkt_size_header + n];
+		s->in_len = len > n ? len - n : 0;
+		
+		while(s->in_len)
+		{
+			ssdv_inbits(s);
+			r = ssdv_process_all(s);
+			if(r != SSDV_FEED_ME) break;
+		}
+		
+		if(r != SSDV_FEED_ME || len < s->pkt_size_payload) break;
 	}
-	b[8]  = 0x00;
-	b[9]  = 2; /* Cb */
-	b[10] = 0x11;
-	b[11] = 0x01;
-	b[12] = 3; /* Cr */
-	b[13] = 0x11;
-	b[14] = 0x01;
-	ssdv_write_marker(s, J_SOF0,  15, b);  /* SOF0 (Baseline DCT) */
 	
-	ssdv_write_marker(s, J_DHT,   29, std_dht00); /* DHT (DC Luminance)  */
-	ssdv_write_marker(s, J_DHT,  179, std_dht10); /* DHT (AC Luminance)  */
-	ssdv_write_marker(s, J_DHT,   29, std_dht01); /* DHT (DC Chrominance */
-	ssdv_write_marker(s, J_DHT,  179, std_dht11); /* DHT (AC Chrominance */
-	ssdv_write_marker(s, J_SOS,   10, sos);
-}
-
-static void ssdv_fill_gap(ssdv_t *s, uint16_t next_mcu)
-{
-	if(s->mcupart > 0 || s->acpart > 0)
+	/* Complete a partly decoded MCU as ssdv_fill_gap() would */
+	if(r != SSDV_EOI && (s->mcupart > 0 || s->acpart > 0))
 	{
-		/* Cleanly end the current MCU part */
 		if(s->acpart > 0)
 		{
-			ssdv_out_jpeg_int(s, 0, 0);
+			ssdv_coef_push(&l->coef, 0, 0);
+			ssdv_coef_push(&l->coef, SSDV_COEF_END, 0);
 			s->mcupart++;
 		}
 		
-		/* End the current MCU block */
 		for(; s->mcupart < s->ycparts + 2; s->mcupart++)
 		{
-			if(s->mcupart < s->ycparts) s->component = 0;
-			else s->component = s->mcupart - s->ycparts + 1;
-			s->acpart = 0; ssdv_out_jpeg_int(s, 0, 0); /* DC */
-			s->acpart = 1; ssdv_out_jpeg_int(s, 0, 0); /* AC */
+			ssdv_coef_push(&l->coef, SSDV_COEF_DIFF, 0);
+			ssdv_coef_push(&l->coef, 0, 0);
+			ssdv_coef_push(&l->coef, SSDV_COEF_END, 0);
 		}
 		
 		s->mcu_id++;
 	}
 	
-	/* Pad out missing MCUs */
-	for(; s->mcu_id < next_mcu; s->mcu_id++)
+	s->coef_out = NULL;
+	if(l->coef.r != SSDV_OK) return(SSDV_ERROR);
+	
+	/* Point the MCUs at their new coefficients */
+	for(mcu = *first; c < l->coef.coef_len && mcu < s->mcu_count; mcu++)
 	{
-		/* End the current MCU block */
-		for(s->mcupart = 0; s->mcupart < s->ycparts + 2; s->mcupart++)
-		{
-			if(s->mcupart < s->ycparts) s->component = 0;
-			else s->component = s->mcupart - s->ycparts + 1;
-			s->acpart = 0; ssdv_out_jpeg_int(s, 0, 0); /* DC */
-			s->acpart = 1; ssdv_out_jpeg_int(s, 0, 0); /* AC */
-		}                         
+		if(l->mcu[mcu] != SSDV_LIVE_PADDED)
+			l->coef_unused += ssdv_live_mcu_len(l, mcu);
+		
+		l->mcu[mcu] = c;
+		for(i = 0; i < s->ycparts + 2; i++)
+			while(l->coef.coef[c++].rle != SSDV_COEF_END);
 	}
-}
-
-char ssdv_dec_init(ssdv_t *s)
-{
-	memset(s, 0, sizeof(ssdv_t));
-	
-	/* The packet data should contain only scan data, no headers */
-	s->state = S_HUFF;
-	s->mode = S_DECODING;
-	
-	/* Prepare the source JPEG tables */
-	s->sdht[0][0] = stblcpy(s, std_dht00, sizeof(std_dht00));
-	s->sdht[0][1] = stblcpy(s, std_dht01, sizeof(std_dht01));
-	s->sdht[1][0] = stblcpy(s, std_dht10, sizeof(std_dht10));
-	s->sdht[1][1] = stblcpy(s, std_dht11, sizeof(std_dht11));
 	
-	/* Prepare the output JPEG tables */
-	s->ddht[0][0] = dtblcpy(s, std_dht00, sizeof(std_dht00));
-	s->ddht[0][1] = dtblcpy(s, std_dht01, sizeof(std_dht01));
-	s->ddht[1][0] = dtblcpy(s, std_dht10, sizeof(std_dht10));
-	s->ddht[1][1] = dtblcpy(s, std_dht11, sizeof(std_dht11));
+	*last = mcu;
 	
 	return(SSDV_OK);
 }
 
-char ssdv_dec_set_buffer(ssdv_t *s, uint8_t *buffer, size_t length)
+static char ssdv_live_reserve(ssdv_live_t *l, size_t n)
 {
-	size_t c = s->outp - s->out;
+	ssdv_t *e = &l->enc;
+	uint8_t *scratch;
+	size_t size;
 	
-	s->outp = buffer + c;
-	s->out = buffer;
-	s->out_len = length - c;
+	if(e->out_len >= n) return(SSDV_OK);
 	
-	/* Flush the output bits */
-	ssdv_outbits(s, 0, 0);
+	/* Grow the scratch buffer, keeping what's written so far */
+	size = l->scratch_size * 2 + n;
+	scratch = realloc(l->scratch, size);
+	if(!scratch) return(SSDV_ERROR);
+	
+	l->scratch = scratch;
+	l->scratch_size = size;
+	ssdv_dec_set_buffer(e, scratch, size);
 	
 	return(SSDV_OK);
 }
 
-char ssdv_dec_feed(ssdv_t *s, uint8_t *packet)
+static char ssdv_live_emit(ssdv_live_t *l, uint32_t first, uint32_t last)
 {
-	int i = 0, r;
-	uint8_t b;
-	uint16_t packet_id;
+	ssdv_t *e = &l->enc;
+	ssdv_live_interval_t *iv;
+	ssdv_coef_t *c;
+	size_t start, end, len;
+	uint32_t i, id, stop;
+	uint8_t *jpeg;
+	int dc[3], pred[3], v;
 	
-	/* Read the packet header */
-	packet_id            = (packet[7] << 8) | packet[8];
-	s->packet_mcu_offset = packet[12];
-	s->packet_mcu_id     = (packet[13] << 8) | packet[14];
+	if(last <= first) return(SSDV_OK);
 	
-	if(s->packet_mcu_id != 0xFFFF) s->reset_mcu = s->packet_mcu_id;
+	/* Write the changed intervals into the scratch buffer */
+	i = first / SSDV_LIVE_DRI;
+	stop = (last - 1) / SSDV_LIVE_DRI + 1;
+	start = l->interval[i].offset;
+	for(v = 0; v < 3; v++) dc[v] = l->interval[i].dc[v];
 	
-	/* If this is the first packet, write the JPEG headers */
-	if(s->packet_id == 0)
+	e->outbits = 0;
+	e->outlen = 0;
+	e->out_stuff = 1;
+	e->out = e->outp = l->scratch;
+	ssdv_dec_set_buffer(e, l->scratch, l->scratch_size);
+	
+	for(; ; i++)
 	{
-		const char *factor;
-		char callsign[SSDV_MAX_CALLSIGN + 1];
+		iv = &l->interval[i];
 		
-		/* Read the fixed headers from the packet */
-		s->type      = packet[1] - 0x66;
-		s->callsign  = (packet[2] << 24) | (packet[3] << 16) | (packet[4] << 8) | packet[5];
-		s->image_id  = packet[6];
-		s->width     = packet[9] << 4;
-		s->height    = packet[10] << 4;
-		s->mcu_count = packet[9] * packet[10];
-		s->quality   = ((packet[11] >> 3) & 7) ^ 4;
-		s->mcu_mode  = packet[11] & 0x03;
+		/* Stop once the DC values carried in match the old ones */
+		if(i >= stop && (i == l->intervals ||
+		   (dc[0] == iv->dc[0] && dc[1] == iv->dc[1] && dc[2] == iv->dc[2]))) break;
 		
-		/* Configure the payload size and CRC position */
-		ssdv_set_packet_conf(s);
+		iv->offset = start + (e->outp - e->out);
+		for(v = 0; v < 3; v++) iv->dc[v] = dc[v];
 		
-		/* Generate the DQT tables */
-		s->sdqt[0] = sload_standard_dqt(s, std_dqt0, s->quality);
-		s->sdqt[1] = sload_standard_dqt(s, std_dqt1, s->quality);
-		s->ddqt[0] = dload_standard_dqt(s, std_dqt0, s->quality);
-		s->ddqt[1] = dload_standard_dqt(s, std_dqt1, s->quality);
+		/* The predictors start from zero after a restart marker */
+		pred[0] = pred[1] = pred[2] = 0;
 		
-		switch(s->mcu_mode & 3)
+		for(id = i * SSDV_LIVE_DRI; id < (i + 1) * SSDV_LIVE_DRI && id < e->mcu_count; id++)
 		{
-		case 0: factor = "2x2"; s->ycparts = 4; break;
-		case 1: factor = "1x2"; s->ycparts = 2; s->mcu_count *= 2; break;
-		case 2: factor = "2x1"; s->ycparts = 2; s->mcu_count *= 2; break;
-		case 3: factor = "1x1"; s->ycparts = 1; s->mcu_count *= 4; break;
+			/* An MCU of 6 blocks can't take more than this */
+			if(ssdv_live_reserve(l, 4096) != SSDV_OK) return(SSDV_ERROR);
+			
+			c = l->mcu[id] == SSDV_LIVE_PADDED ? NULL : &l->coef.coef[l->mcu[id]];
+			
+			for(e->mcupart = 0; e->mcupart < e->ycparts + 2; e->mcupart++)
+			{
+				if(e->mcupart < e->ycparts) e->component = 0;
+				else e->component = e->mcupart - e->ycparts + 1;
+				
+				/* DC, absolute or relative to the last block. MCUs not
+				 * received yet are left grey, rather than repeating the
+				 * last DC value like ssdv_fill_gap(), so they don't all
+				 * have to be written again each time it changes */
+				v = 0;
+				if(c && c->rle == SSDV_COEF_DIFF) v = dc[e->component] + c->value;
+				else if(c) v = c->value;
+				
+				e->acpart = 0;
+				ssdv_out_jpeg_int(e, 0, v - pred[e->component]);
+				dc[e->component] = pred[e->component] = v;
+				
+				/* AC, or just an EOB for an MCU not yet received */
+				e->acpart = 1;
+				if(!c) ssdv_out_jpeg_int(e, 0, 0);
+				else
+				{
+					for(c++; c->rle != SSDV_COEF_END; c++)
+						ssdv_out_jpeg_int(e, c->rle, c->value);
+					c++;
+				}
+			}
 		}
 		
-		/* Display information about the image */
-		fprintf(stderr, "Callsign: %s\n", decode_callsign(callsign, s->callsign));
-		fprintf(stderr, "Image ID: %02X\n", s->image_id);
-		fprintf(stderr, "Resolution: %ix%i\n", s->width, s->height);
-		fprintf(stderr, "MCU blocks: %i\n", s->mcu_count);
-		fprintf(stderr, "Sampling factor: %s\n", factor);
-		fprintf(stderr, "Quality level: %d\n", s->quality);
-		
-		/* Output JPEG headers and enable byte stuffing */
-		ssdv_out_headers(s);
-		s->out_stuff = 1;
+		/* Sync, and the restart marker if another interval follows */
+		ssdv_outbits_sync(e);
+		if(i + 1 < l->intervals)
+		{
+			e->out_stuff = 0;
+			ssdv_write_marker(e, J_RST0 + (i & 7), 0, 0);
+			e->out_stuff = 1;
+		}
 	}
 	
-	/* Is this not the packet we expected? */
-	if(packet_id != s->packet_id)
-	{
-		/* One or more packets have been lost! */
-		fprintf(stderr, "Gap detected between packets %i and %i\n", s->packet_id - 1, packet_id);
-		
-		/* If this packet has no new MCU, ignore */
-		if(s->packet_mcu_offset == 0xFF) return(SSDV_FEED_ME);
-		
-		/* Fill the gap left by the missing packet */
-		ssdv_fill_gap(s, s->packet_mcu_id);
-		
-		/* Clear the workbits */
-		s->workbits = s->worklen = 0;
-		
-		/* Skip the bytes of the lost MCU */
-		i = s->packet_mcu_offset;
-		
-		/* Reset the JPEG decoder state */
-		s->state = S_HUFF;
-		s->component = 0;
-		s->mcupart = 0;
-		s->acpart = 0;
-		s->accrle = 0;
-		
-		s->packet_id = packet_id;
-	}
+	/* Make room in the JPEG for the new intervals */
+	end = l->interval[i].offset;
+	len = e->outp - e->out;
 	
-	/* Feed the JPEG data into the processor */
-	for(; i < s->pkt_size_payload; i++)
+	if(l->jpeg_len - (end - start) + len > l->jpeg_size)
 	{
-		b = packet[SSDV_PKT_SIZE_HEADER + i];
-		
-		/* Add the new byte to the work area */
-		s->workbits = (s->workbits << 8) | b;
-		s->worklen += 8;
+		jpeg = realloc(l->jpeg, l->jpeg_size * 2 + len);
+		if(!jpeg) return(SSDV_ERROR);
 		
-		/* Process the new data until more needed, or an error occurs */
-		while((r = ssdv_process(s)) == SSDV_OK);
-		
-		if(r == SSDV_BUFFER_FULL)
-		{
-			/* Realloc memory */
-		}
-		else if(r == SSDV_EOI)
-		{
-			/* All done! */
-			return(SSDV_OK);
-		}
-		else if(r != SSDV_FEED_ME)
-		{
-			/* An error occured */
-			fprintf(stderr, "ssdv_process() failed: %i\n", r);
-			return(SSDV_ERROR);
-		}
+		l->jpeg = jpeg;
+		l->jpeg_size = l->jpeg_size * 2 + len;
 	}
 	
-	/* The next packet to expect... */
-	s->packet_id++;
+	/* Move the unchanged intervals and the EOI, then splice in the new ones */
+	memmove(&l->jpeg[start + len], &l->jpeg[end], l->jpeg_len - end);
+	memcpy(&l->jpeg[start], e->out, len);
+	l->jpeg_len = l->jpeg_len - (end - start) + len;
 	
-	return(SSDV_FEED_ME);
+	for(; i <= l->intervals; i++)
+		l->interval[i].offset = l->interval[i].offset - end + start + len;
+	
+	return(SSDV_OK);
 }
 
-char ssdv_dec_get_jpeg(ssdv_t *s, uint8_t **jpeg, size_t *length)
+char ssdv_live_init(ssdv_live_t *l)
 {
-	/* Is the image complete? */
-	if(s->mcu_id < s->mcu_count) ssdv_fill_gap(s, s->mcu_count);
-	
-	/* Sync, and final EOI header and return */
-	ssdv_outbits_sync(s);
-	s->out_stuff = 0;
-	ssdv_write_marker(s, J_EOI, 0, 0);
-	
-	*jpeg = s->out;
-	*length = (size_t) (s->outp - s->out);
-	
+	memset(l, 0, sizeof(ssdv_live_t));
 	return(SSDV_OK);
 }
 
-char ssdv_dec_is_packet(uint8_t *packet, int *errors)
+char ssdv_live_feed(ssdv_live_t *l, uint8_t *packet)
 {
-	uint8_t pkt[SSDV_PKT_SIZE];
-	uint8_t type;
-	uint16_t pkt_size_payload;
-	uint16_t pkt_size_crcdata;
-	ssdv_packet_info_t p;
-	uint32_t x;
-	int i;
-	
-	/* Testing is destructive, work on a copy */
-	memcpy(pkt, packet, SSDV_PKT_SIZE);
-	pkt[0] = 0x55;
+	uint16_t id = (packet[7] << 8) | packet[8];
+	uint32_t first, last, n;
+	uint8_t *p;
+	char r;
 	
-	type = SSDV_TYPE_INVALID;
+	/* Tiled, layered and region of interest images are only decoded whole */
+	if(packet[11] & SSDV_FLAG_EXT && packet[15] & (SSDV_EXT_TILE | SSDV_EXT_LAYERED | SSDV_EXT_ROI)) return(SSDV_ERROR);
 	
-	if(pkt[1] == 0x66 + SSDV_TYPE_NOFEC)
+	if(!l->mcu)
 	{
-		/* Test for a valid NOFEC packet */
-		pkt_size_payload = SSDV_PKT_SIZE - SSDV_PKT_SIZE_HEADER - SSDV_PKT_SIZE_CRC;
-		pkt_size_crcdata = SSDV_PKT_SIZE_HEADER + pkt_size_payload - 1;
+		/* The first packet describes the image */
+		ssdv_dec_init(&l->dec);
+		ssdv_dec_setup(&l->dec, packet);
+		ssdv_dec_set_sink(&l->dec, ssdv_null_sink, NULL);
 		
-		/* No FEC scan */
-		if(errors) *errors = 0;
-		
-		/* Test the checksum */
-		x = crc32(&pkt[1], pkt_size_crcdata);
+		ssdv_dec_init(&l->enc);
+		ssdv_dec_setup(&l->enc, packet);
 		
-		i = 1 + pkt_size_crcdata;
-		if(x == (pkt[i + 3] | (pkt[i + 2] << 8) | (pkt[i + 1] << 16) | (pkt[i] << 24)))
+		l->intervals = (l->dec.mcu_count + SSDV_LIVE_DRI - 1) / SSDV_LIVE_DRI;
+		l->mcu = malloc(sizeof(uint32_t) * l->dec.mcu_count);
+		l->interval = calloc(l->intervals + 1, sizeof(ssdv_live_interval_t));
+		l->jpeg_size = l->scratch_size = 65536;
+		l->jpeg = malloc(l->jpeg_size);
+		l->scratch = malloc(l->scratch_size);
+		if(!l->mcu || !l->interval || !l->jpeg || !l->scratch)
 		{
-			/* Valid, set the type and continue */
-			type = SSDV_TYPE_NOFEC;
+			ssdv_live_free(l);
+			return(SSDV_ERROR);
 		}
-	}
-	else if(pkt[1] == 0x66 + SSDV_TYPE_NORMAL)
-	{
-		/* Test for a valid NORMAL packet */
-		pkt_size_payload = SSDV_PKT_SIZE - SSDV_PKT_SIZE_HEADER - SSDV_PKT_SIZE_CRC - SSDV_PKT_SIZE_RSCODES;
-		pkt_size_crcdata = SSDV_PKT_SIZE_HEADER + pkt_size_payload - 1;
 		
-		/* No FEC scan */
-		if(errors) *errors = 0;
+		for(n = 0; n < l->dec.mcu_count; n++)
+			l->mcu[n] = SSDV_LIVE_PADDED;
 		
-		/* Test the checksum */
-		x = crc32(&pkt[1], pkt_size_crcdata);
+		/* Start with the headers, an empty scan and the EOI */
+		l->enc.dri = SSDV_LIVE_DRI;
+		ssdv_dec_set_buffer(&l->enc, l->jpeg, l->jpeg_size);
+		ssdv_out_headers(&l->enc);
+		ssdv_write_marker(&l->enc, J_EOI, 0, 0);
 		
-		i = 1 + pkt_size_crcdata;
-		if(x == (pkt[i + 3] | (pkt[i + 2] << 8) | (pkt[i + 1] << 16) | (pkt[i] << 24)))
-		{
-			/* Valid, set the type and continue */
-			type = SSDV_TYPE_NORMAL;
-		}
+		l->jpeg_len = l->enc.outp - l->enc.out;
+		for(n = 0; n <= l->intervals; n++)
+			l->interval[n].offset = l->jpeg_len - 2;
+		
+		/* And fill the scan with blank MCUs */
+		l->coef.r = SSDV_OK;
+		if(ssdv_live_emit(l, 0, l->dec.mcu_count) != SSDV_OK) return(SSDV_ERROR);
 	}
 	
-	if(type == SSDV_TYPE_INVALID)
+	/* Ignore packets from any other image */
+	if(packet[6] != l->dec.image_id || (packet[9] << 4) != l->dec.width ||
+	   (packet[10] << 4) != l->dec.height) return(SSDV_FEED_ME);
+	
+	/* Make room for the packet, and ignore it if it's been seen before */
+	if(id >= l->packets_len)
 	{
-		/* Test for a valid NORMAL packet with correctable errors */
-		pkt_size_payload = SSDV_PKT_SIZE - SSDV_PKT_SIZE_HEADER - SSDV_PKT_SIZE_CRC - SSDV_PKT_SIZE_RSCODES;
-		pkt_size_crcdata = SSDV_PKT_SIZE_HEADER + pkt_size_payload - 1;
+		n = id + 1 > l->packets_len * 2 ? id + 1 : l->packets_len * 2;
 		
-		/* Run the reed-solomon decoder */
-		pkt[1] = 0x66 + SSDV_TYPE_NORMAL;
-		i = decode_rs_8(&pkt[1], 0, 0, 0);
+		p = realloc(l->packets, (size_t) n * SSDV_PKT_SIZE);
+		if(!p) return(SSDV_ERROR);
+		l->packets = p;
 		
-		if(i < 0) return(-1); /* Reed-solomon decoder failed */
-		if(errors) *errors = i;
+		p = realloc(l->have, n);
+		if(!p) return(SSDV_ERROR);
+		l->have = p;
 		
-		/* Test the checksum */
-		x = crc32(&pkt[1], pkt_size_crcdata);
+		memset(&l->have[l->packets_len], 0, n - l->packets_len);
+		l->packets_len = n;
+	}
+	
+	if(l->have[id]) return(SSDV_FEED_ME);
+	
+	memcpy(LIVE_PACKET(l, id), packet, SSDV_PKT_SIZE);
+	l->have[id] = 1;
+	
+	if(l->dec.dht == S_DHT_PENDING)
+	{
+		/* Hold the packets until the image's huffman tables arrive */
+		if(id != 0) return(SSDV_FEED_ME);
+		if(ssdv_dec_load_dht(&l->dec, packet) != SSDV_OK) return(SSDV_ERROR);
 		
-		i = 1 + pkt_size_crcdata;
-		if(x == (pkt[i + 3] | (pkt[i + 2] << 8) | (pkt[i + 1] << 16) | (pkt[i] << 24)))
+		/* Then decode everything held, and write it out in one go */
+		first = l->dec.mcu_count;
+		last = 0;
+		for(n = 1; n < l->packets_len; n++)
 		{
-			/* Valid, set the type and continue */
-			type = SSDV_TYPE_NORMAL;
+			uint32_t f, t;
+			
+			if(!l->have[n]) continue;
+			
+			r = ssdv_live_decode(l, n, &f, &t);
+			if(r == SSDV_ERROR) return(r);
+			if(r != SSDV_OK) continue;
+			
+			if(f < first) first = f;
+			if(t > last) last = t;
 		}
 	}
-	
-	if(type == SSDV_TYPE_INVALID)
+	else
 	{
-		/* All attempts to read the packet have failed */
-		return(-1);
+		/* Decode just the MCUs this packet affects */
+		r = ssdv_live_decode(l, id, &first, &last);
+		if(r != SSDV_OK) return(r);
 	}
 	
-	/* Sanity checks */
-	ssdv_dec_header(&p, pkt);
-	
-	if(p.type != type) return(-1);
-	if(p.width == 0 || p.height == 0) return(-1);
-	if(p.mcu_id != 0xFFFF)
-	{
-		if(p.mcu_id >= p.mcu_count) return(-1);
-		if(p.mcu_offset >= pkt_size_payload) return(-1);
-	}
+	if(l->coef_unused > l->coef.coef_len / 2 && ssdv_live_compact(l) != SSDV_OK)
+		return(SSDV_ERROR);
 	
-	/* Appears to be a valid packet! Copy it back */
-	memcpy(packet, pkt, SSDV_PKT_SIZE);
+	/* And write them out */
+	return(ssdv_live_emit(l, first, last));
+}
+
+char ssdv_live_get_jpeg(ssdv_live_t *l, uint8_t **jpeg, size_t *length)
+{
+	*jpeg = l->jpeg;
+	*length = l->jpeg_len;
 	
-	return(0);
+	return(l->jpeg ? SSDV_OK : SSDV_FEED_ME);
 }
 
-void ssdv_dec_header(ssdv_packet_info_t *info, uint8_t *packet)
+void ssdv_live_free(ssdv_live_t *l)
 {
-	info->type       = packet[1] - 0x66;
-	info->callsign   = (packet[2] << 24) | (packet[3] << 16) | (packet[4] << 8) | packet[5];
-	decode_callsign(info->callsign_s, info->callsign);
-	info->image_id   = packet[6];
-	info->packet_id  = (packet[7] << 8) | packet[8];
-	info->width      = packet[9] << 4;
-	info->height     = packet[10] << 4;
-	info->eoi        = (packet[11] >> 2) & 1;
-	info->quality    = ((packet[11] >> 3) & 7) ^ 4;
-	info->mcu_mode   = packet[11] & 0x03;
-	info->mcu_offset = packet[12];
-	info->mcu_id     = (packet[13] << 8) | packet[14];
-	info->mcu_count  = packet[9] * packet[10];
-	if(info->mcu_mode == 1 || info->mcu_mode == 2) info->mcu_count *= 2;
-	else if(info->mcu_mode == 3) info->mcu_count *= 4;
+	free(l->packets);
+	free(l->have);
+	free(l->coef.coef);
+	free(l->mcu);
+	free(l->interval);
+	free(l->jpeg);
+	free(l->scratch);
+	
+	memset(l, 0, sizeof(ssdv_live_t));
 }
 
 /*****************************************************************************/
@@ -36,6 +36,9 @@ extern "C" {
 #define SSDV_PKT_SIZE_HEADER  (0x0F)
 #define SSDV_PKT_SIZE_CRC     (0x04)
 #define SSDV_PKT_SIZE_RSCODES (0x20)
+#define SSDV_PKT_SIZE_EXT     (0x01) /* Header extension flags           */
+#define SSDV_PKT_SIZE_TILE    (0x06) /* Header extension of a tiled image */
+#define SSDV_PKT_SIZE_ROI     (0x05) /* Header extension of a region of interest */
 
 #define TBL_LEN (546) /* Maximum size of the DQT and DHT tables */
 #define HBUFF_LEN (16) /* Extra space for reading marker data */
@@ -46,11 +49,134 @@ extern "C" {
 #define SSDV_TYPE_NORMAL  (0x00)
 #define SSDV_TYPE_NOFEC   (0x01)
 
+#define SSDV_DHT_LOOKAHEAD (9) /* Code bits resolved by one table lookup */
+
+#define SSDV_LAYERS (4) /* Bands of coefficients sent by the layered encoder */
+
+#define SSDV_MAX_THUMB (3) /* Thumbnail scales, 1 to 3 for 1/8, 1/4 or 1/2 */
+
+#define SSDV_MAX_THREADS (64) /* Maximum threads for transcoding restart intervals */
+
+#define SSDV_SINK_LEN (256) /* Size of the staging buffer for a decoder output sink */
+
+/* Size of the buffer given to ssdv_dec_set_reorder(): the packets, then a
+ * bit for each one marking it as held */
+#define SSDV_REORDER_LEN(window) ((size_t) (window) * SSDV_PKT_SIZE + ((window) + 7) / 8)
+
+/* Called by the decoder with each piece of the JPEG as it is produced */
+typedef void (*ssdv_sink_t)(void *arg, uint8_t *data, size_t length);
+
+/* Pixel formats for the decoder, three bytes for each pixel */
+#define SSDV_PIXELS_RGB (0) /* R, G, B */
+#define SSDV_PIXELS_YUV (1) /* Y, Cb, Cr, with the chroma upsampled */
+#define SSDV_PIXELS_DC  (0x10) /* Added to either, a 1/8 scale thumbnail made
+                                  from only the DC of each block, no IDCT  */
+
+/* Called by the decoder with each row of MCUs decoded to pixels: 'rows'
+ * lines of 'width' pixels, starting at line 'y' of the image */
+typedef void (*ssdv_pixel_sink_t)(void *arg, uint8_t *pixels, uint16_t width, uint16_t y, uint8_t rows);
+
+/* Counters for profiling the encoder and decoder. Only kept when built
+ * with SSDV_STATS defined, and read with ssdv_get_stats(). The packet
+ * checks aren't part of an image, they are added up by the caller */
+typedef struct
+{
+	/* For each image */
+	uint64_t huff_lookups;  /* Huffman codes read                        */
+	uint64_t huff_slow;     /* Of those, too long for the lookup table   */
+	uint64_t bits_in;       /* Bits read from the JPEG or packets        */
+	uint64_t bits_out;      /* Bits written to the packets or JPEG       */
+	uint64_t stuff_in;      /* Stuffing bytes skipped                    */
+	uint64_t stuff_out;     /* Stuffing bytes written                    */
+	uint64_t gap_mcus;      /* MCUs made up for lost packets             */
+	uint64_t ns_packet;     /* Time in ssdv_enc_get_packet() or ssdv_dec_feed() */
+	uint64_t ns_process;    /* Of which decoding and writing the scan    */
+	uint64_t ns_finish;     /* Time in ssdv_dec_get_jpeg()               */
+	
+	/* For the packets given to ssdv_dec_check_packet() */
+	uint64_t checked;
+	uint64_t accepted;
+	uint64_t crc_ok;        /* CRC correct as received                   */
+	uint64_t rs_ok;         /* CRC correct after Reed-Solomon            */
+	uint64_t rs_failed;     /* Rejected, too many errors to correct      */
+	uint64_t crc_failed;    /* Rejected, CRC wrong even after correction */
+	uint64_t invalid;       /* Rejected by the header checks             */
+	uint64_t rs_corrected;  /* Bytes corrected by Reed-Solomon           */
+	uint64_t ns_check;      /* Time in ssdv_dec_check_packet()           */
+} ssdv_stats_t;
+
+/* Huffman decode table, built from a DHT */
+typedef struct
+{
+	uint16_t lookup[1 << SSDV_DHT_LOOKAHEAD]; /* (width << 8) | symbol, 0 = long code */
+	int32_t  maxcode[17]; /* Largest code of each width, -1 if none    */
+	uint16_t mincode[17]; /* Smallest code of each width               */
+	uint16_t valptr[17];  /* Index of the first symbol of each width   */
+} ssdv_dht_lookup_t;
+
+/* Huffman encode table, built from a DHT */
+typedef struct
+{
+	uint16_t bits[256];   /* Code for each symbol                      */
+	uint8_t  width[256];  /* Code width for each symbol, 0 if unused   */
+} ssdv_dht_symbols_t;
+
+/* A transcoded coefficient, waiting to be packetised. Each block is
+ * stored as its absolute DC value, the AC values, then an end marker */
+typedef struct
+{
+	int16_t value;
+	uint8_t rle;          /* Zero run before an AC value, or SSDV_COEF_END */
+} ssdv_coef_t;
+
+#define SSDV_COEF_END  (0xFF)
+#define SSDV_COEF_DIFF (0xFE) /* A DC value relative to the last block */
+
+/* A restart interval of the source image */
+typedef struct
+{
+	uint8_t *data;        /* Entropy-coded data between the RST markers */
+	size_t length;
+	uint32_t mcus;        /* Number of MCU blocks in the interval      */
+	ssdv_coef_t *coef;    /* The transcoded blocks                     */
+	size_t coef_len;
+	size_t coef_size;
+	char r;               /* SSDV_OK if the interval was transcoded    */
+} ssdv_interval_t;
+
+/* The output of one tile counted for every quality level, encoder only */
+typedef struct
+{
+	int adc[8][3];             /* DC adjusted value for each quality level  */
+	uint8_t reset[8];          /* Current MCU starts a packet               */
+	uint32_t packet[8];        /* Packet the last MCU marker points into    */
+	uint64_t bits[8];          /* Output bits so far                        */
+	uint64_t mark[8];          /* Output bits before the last symbol        */
+} ssdv_estimate_part_t;
+
+/* Packet count estimate for every quality level, encoder only */
+typedef struct
+{
+	uint64_t rq_div[8][2];     /* DC requantisation for each quality level  */
+	uint64_t rq_mul[8][2][64]; /* AC requantisation, 0 if unchanged         */
+	int dc[3];                 /* DC value of the source for each component */
+	uint8_t accrle[8];         /* Accumulative RLE value                    */
+	ssdv_estimate_part_t part; /* The tile of the current MCU               */
+	
+	/* A tiled image is counted a row of tiles at a time, each tile
+	 * starting its own packets */
+	ssdv_estimate_part_t *row; /* The other tiles of the row, or NULL       */
+	uint16_t cols;             /* Tiles across the image                    */
+	uint16_t col;              /* Tile of the current MCU                   */
+	uint32_t packets[8];       /* Packets of the rows of tiles already done */
+} ssdv_estimate_t;
+
 typedef struct
 {
 	/* Packet type configuration */
 	uint8_t type; /* 0 = Normal mode (224 byte packet + 32 bytes FEC),
 	                 1 = No-FEC mode (256 byte packet) */
+	uint16_t pkt_size_header;
 	uint16_t pkt_size_payload;
 	uint16_t pkt_size_crcdata;
 	
@@ -61,8 +187,8 @@ typedef struct
 	uint8_t  image_id;
 	uint16_t packet_id;
 	uint8_t  mcu_mode;  /* 0 = 2x2, 1 = 2x1, 2 = 1x2, 3 = 1x1           */
-	uint16_t mcu_id;
-	uint16_t mcu_count;
+	uint32_t mcu_id;
+	uint32_t mcu_count;
 	uint8_t  quality;   /* JPEG quality level for encoding, 0-7         */
 	uint16_t packet_mcu_id;
 	uint8_t  packet_mcu_offset;
@@ -71,9 +197,10 @@ typedef struct
 	uint8_t *inp;      /* Pointer to next input byte                    */
 	size_t in_len;     /* Number of input bytes remaining               */
 	size_t in_skip;    /* Number of input bytes to skip                 */
+	char in_stuff;     /* Flag to remove stuffing bytes from input      */
 	
 	/* Source bits */
-	uint32_t workbits; /* Input bits currently being worked on          */
+	uint64_t workbits; /* Input bits currently being worked on          */
 	uint8_t worklen;   /* Number of bits in the input bit buffer        */
 	
 	/* JPEG / Packet output buffer */
@@ -83,7 +210,7 @@ typedef struct
 	char out_stuff;    /* Flag to add stuffing bytes to output          */
 	
 	/* Output bits */
-	uint32_t outbits;  /* Output bit buffer                             */
+	uint64_t outbits;  /* Output bit buffer                             */
 	uint8_t outlen;    /* Number of bits in the output bit buffer       */
 	
 	/* JPEG decoder state */
@@ -119,11 +246,103 @@ typedef struct
 	uint8_t stbls[TBL_LEN + HBUFF_LEN];
 	uint8_t *sdht[2][2], *sdqt[2];
 	uint16_t stbl_len;
+	ssdv_dht_lookup_t sdht_lookup[2][2];
 	
 	/* The same for output */
 	uint8_t dtbls[TBL_LEN];
 	uint8_t *ddht[2][2], *ddqt[2];
 	uint16_t dtbl_len;
+	ssdv_dht_symbols_t ddht_symbols[2][2];
+	
+	/* Huffman tables made for the image, sent in packet 0 */
+	enum {
+		S_DHT_STANDARD = 0,
+		S_DHT_PENDING,      /* Not yet sent, or not yet received            */
+		S_DHT_READY,
+		S_DHT_LOST,         /* Packet 0 was missed, the image can't be decoded */
+	} dht;
+	uint32_t (*dht_freq)[2][256]; /* Symbol counts for each table, or NULL */
+	
+	/* Requantisation tables, built once both sets of DQTs are known */
+	uint64_t rq_div[2][64]; /* Reciprocal of each output DQT value, 0 if unchanged */
+	uint64_t rq_mul[2][64]; /* The same, multiplied by the input DQT value  */
+	
+	/* A region of interest, sent at a higher quality than the rest */
+	char roi;
+	char inroi;         /* The current MCU is inside the region         */
+	int8_t roi_quality;
+	uint16_t roi_x, roi_y; /* Multiples of 16 pixels. The encoder's are  */
+	uint16_t roi_width, roi_height; /* in the whole image, the decoder's in the tile */
+	uint8_t rdqt[2][65]; /* The DQT tables used inside it, encoder only  */
+	uint64_t roi_rq_div[2][64]; /* Its requantisation, as rq_div and rq_mul */
+	uint64_t roi_rq_mul[2][64];
+	
+	/* Restart interval transcoding, encoder only */
+	int threads;        /* Number of threads to transcode intervals with */
+	ssdv_interval_t *intervals; /* The intervals, NULL if not used      */
+	uint32_t intervals_len;
+	uint32_t interval;  /* Interval currently being packetised           */
+	ssdv_coef_t *coef;  /* Next coefficient to packetise                 */
+	ssdv_interval_t *coef_out; /* Interval being transcoded into        */
+	
+	/* Images too big for one SSDV image are sent as a grid of tiles */
+	char tiled;
+	uint16_t tile_x, tile_y; /* Origin of the current tile              */
+	uint16_t tile_width, tile_height; /* Size of the current tile       */
+	uint16_t tile_size_w, tile_size_h; /* Size of a whole tile, encoder only */
+	
+	/* Or in layers, each one a band of coefficients for the whole image */
+	char layered;
+	uint8_t layer;      /* Layer currently being sent                   */
+	uint8_t acstart;    /* First coefficient of each block in the layer */
+	uint8_t acend;      /* And one past the last, 64 if not layered     */
+	int block[64];      /* Block being sent in layers, encoder only     */
+	
+	/* A thumbnail is a scaled down copy sent in place of the image */
+	uint8_t thumb;      /* 1 to 3 for 1/8, 1/4 or 1/2 scale, 0 if not   */
+	
+	/* A greyscale image sends only the Y parts of each MCU */
+	char grey;
+	
+	/* The image taken apart into MCUs, for tiles or layers */
+	ssdv_coef_t **mcu_coef; /* Encoder: the first coefficient of each MCU */
+	ssdv_interval_t kept; /* Decoder: the coefficients received so far */
+	uint32_t *kept_mcu; /* Decoder: first coefficient of each MCU in each
+	                       layer, or SSDV_LIVE_PADDED if not received   */
+	size_t kept_start;  /* Decoder: first coefficient of the current MCU */
+	
+	/* Packet count estimate, encoder only */
+	ssdv_estimate_t *estimate; /* Counting bits instead of output, or NULL */
+	
+	/* Packet reordering, decoder only */
+	uint8_t *reorder;   /* Held packets, one slot per packet ID in the window */
+	uint8_t *reorder_held; /* Bitmap of the slots holding a packet       */
+	uint16_t reorder_window; /* Number of slots, 0 = packets used as they arrive */
+	uint16_t reorder_count; /* Number of packets held                    */
+	uint32_t reorder_base; /* Lowest packet ID not yet passed to the decoder */
+	
+	/* Output sink, decoder only */
+	ssdv_sink_t sink;   /* Receives the JPEG as it is produced, or NULL  */
+	void *sink_arg;
+	size_t sink_len;    /* Number of bytes passed to the sink so far     */
+	uint8_t sink_buf[SSDV_SINK_LEN];
+	
+	/* Pixel output, decoder only. The JPEG symbols are decoded as
+	 * they are produced, in place of being written out */
+	ssdv_pixel_sink_t pixel_sink; /* Receives the pixels, or NULL    */
+	void *pixel_arg;
+	uint8_t pixel_format;
+	uint8_t pixel_scale; /* Image scaled down by 2^this, 3 for DC only   */
+	uint8_t *pixel_row; /* One row of MCUs                               */
+	int16_t pixel_block[64]; /* Block being decoded, in natural order    */
+	uint8_t pixel_k;    /* Next coefficient of the block, 0 for the DC  */
+	uint8_t pixel_part; /* Block of the MCU                             */
+	uint32_t pixel_mcu; /* Number of MCUs decoded                       */
+	int pixel_dc[3];    /* Last DC value of each component              */
+	uint8_t pixel_mcu_buf[6][64]; /* Samples of each block of the MCU   */
+	
+	/* Profiling counters, left zero unless built with SSDV_STATS */
+	ssdv_stats_t stats;
 	
 } ssdv_t;
 
@@ -141,23 +360,183 @@ typedef struct {
 	uint8_t  mcu_offset;
 	uint16_t mcu_id;
 	uint16_t mcu_count;
+	uint8_t  tiled;
+	uint8_t  layered;
+	uint8_t  layer;
+	uint8_t  thumbnail;    /* Scale of a thumbnail, 1 to 3, or 0 */
+	uint8_t  grey;
+	uint8_t  roi;          /* A region of interest is sent at roi_quality */
+	uint8_t  roi_quality;
+	uint16_t roi_x;        /* Within the tile, if tiled */
+	uint16_t roi_y;
+	uint16_t roi_width;
+	uint16_t roi_height;
+	uint16_t image_width;  /* Size of the whole image, the same as the */
+	uint16_t image_height; /* width and height unless it is tiled      */
+	uint16_t tile_x;
+	uint16_t tile_y;
 } ssdv_packet_info_t;
 
+/* Called with each finished image from the demultiplexer */
+typedef void (*ssdv_demux_callback_t)(void *arg, ssdv_packet_info_t *info, uint8_t *jpeg, size_t length);
+
+#define SSDV_DEMUX_SLOTS  (4)     /* Maximum number of images decoded at once */
+#define SSDV_DEMUX_BUFFER (65536) /* First allocation for an image, it grows as needed */
+
+typedef struct
+{
+	enum {
+		D_FREE = 0,
+		D_DONE,
+		D_DECODING,
+	} state;
+	ssdv_packet_info_t info; /* Header of the first packet of the image */
+	uint32_t last_seen;  /* Value of the packet clock when last fed     */
+	uint8_t *buffer;     /* The JPEG so far, written by the decoder's sink */
+	size_t   buffer_size;
+	size_t   buffer_len;
+	size_t   buffer_limit; /* The demultiplexer's buffer_length          */
+	char     full;       /* The JPEG didn't fit, and is truncated       */
+	uint8_t *reorder;    /* Packet reordering buffer, if enabled        */
+	ssdv_t   ssdv;
+} ssdv_demux_slot_t;
+
+typedef struct
+{
+	ssdv_demux_slot_t slot[SSDV_DEMUX_SLOTS];
+	size_t   buffer_length; /* Largest JPEG for each image, 0 = no limit */
+	uint32_t timeout;   /* Packets without an update before an image is
+	                       finished, 0 = never                          */
+	uint32_t clock;     /* Number of packets fed so far                 */
+	uint16_t reorder_window; /* Packet reordering window for each image,
+	                            0 = off. Set before feeding any packets */
+	ssdv_demux_callback_t callback;
+	void *callback_arg;
+} ssdv_demux_t;
+
+/* Called with each packet passed on by the merger */
+typedef void (*ssdv_merge_callback_t)(void *arg, uint8_t *packet);
+
+#define SSDV_MERGE_WINDOW  (256)  /* Maximum packets held for a better copy */
+#define SSDV_MERGE_HISTORY (4096) /* Packets remembered once passed on, a
+                                     power of 2                          */
+
+typedef struct
+{
+	uint64_t key;       /* Callsign, image ID and packet ID             */
+	int      errors;    /* Bytes corrected by RS in the best copy       */
+	uint32_t first_seen; /* Value of the packet clock when first fed    */
+	uint8_t  packet[SSDV_PKT_SIZE];
+} ssdv_merge_slot_t;
+
+/* Merges the packets of several receivers into one stream, passing on
+ * one copy of each: the one that needed the fewest corrections */
+typedef struct
+{
+	ssdv_merge_slot_t slot[SSDV_MERGE_WINDOW]; /* In order of arrival   */
+	uint16_t head;
+	uint16_t len;
+	uint64_t history[SSDV_MERGE_HISTORY]; /* Keys of packets passed on,
+	                       indexed by ssdv_merge_hash()                 */
+	uint32_t window;    /* Packets fed before a held one is passed on   */
+	uint32_t clock;     /* Number of packets fed so far                 */
+	uint32_t duplicates; /* Number of copies dropped                    */
+	ssdv_merge_callback_t callback;
+	void *callback_arg;
+} ssdv_merge_t;
+
+/* The incremental decoder writes a restart marker after this many MCUs,
+ * so a change only has to be written out again from the last one */
+#define SSDV_LIVE_DRI    (16)
+#define SSDV_LIVE_PADDED (0xFFFFFFFF)
+
+/* A restart interval in the output of the incremental decoder */
+typedef struct
+{
+	size_t  offset;     /* Byte offset of the interval in the JPEG      */
+	int16_t dc[3];      /* DC value of each component before it         */
+} ssdv_live_interval_t;
+
+/* Incremental decoder. The decoded coefficients are kept for each MCU,
+ * so a packet arriving late only needs its own MCUs decoded again */
+typedef struct
+{
+	ssdv_t dec;         /* Decodes packets into coefficients            */
+	ssdv_t enc;         /* Writes the JPEG from the coefficients        */
+	
+	/* Every packet received, by packet ID */
+	uint8_t *packets;
+	uint8_t *have;
+	uint32_t packets_len;
+	
+	/* The decoded coefficients. Each MCU has the index of its first
+	 * coefficient, or SSDV_LIVE_PADDED if it hasn't been received */
+	ssdv_interval_t coef;
+	size_t coef_unused; /* Coefficients replaced by a later decode      */
+	uint32_t *mcu;
+	
+	/* Each restart interval's place in the JPEG, plus the end of the scan */
+	ssdv_live_interval_t *interval;
+	uint32_t intervals;
+	
+	/* The JPEG image, and space to write the changed intervals */
+	uint8_t *jpeg;
+	size_t jpeg_size;
+	size_t jpeg_len;
+	uint8_t *scratch;
+	size_t scratch_size;
+} ssdv_live_t;
+
 /* Encoding */
 extern char ssdv_enc_init(ssdv_t *s, uint8_t type, char *callsign, uint8_t image_id, int8_t quality);
 extern char ssdv_enc_set_buffer(ssdv_t *s, uint8_t *buffer);
 extern char ssdv_enc_get_packet(ssdv_t *s);
 extern char ssdv_enc_feed(ssdv_t *s, uint8_t *buffer, size_t length);
+extern char ssdv_enc_set_threads(ssdv_t *s, int threads);
+extern char ssdv_enc_set_layered(ssdv_t *s, char layered);
+extern char ssdv_enc_set_thumbnail(ssdv_t *s, uint8_t scale);
+extern char ssdv_enc_set_grey(ssdv_t *s, char grey);
+extern char ssdv_enc_set_roi(ssdv_t *s, uint16_t x, uint16_t y, uint16_t width, uint16_t height, int8_t quality);
+extern char ssdv_enc_estimate(ssdv_t *s, uint8_t *jpeg, size_t length, uint32_t packets[8]);
+extern char ssdv_enc_optimise_dht(ssdv_t *s, uint8_t *jpeg, size_t length);
 
 /* Decoding */
 extern char ssdv_dec_init(ssdv_t *s);
 extern char ssdv_dec_set_buffer(ssdv_t *s, uint8_t *buffer, size_t length);
+extern char ssdv_dec_set_sink(ssdv_t *s, ssdv_sink_t sink, void *arg);
+extern char ssdv_dec_set_pixels(ssdv_t *s, uint8_t format, ssdv_pixel_sink_t sink, void *arg);
+extern char ssdv_dec_set_reorder(ssdv_t *s, uint8_t *buffer, uint16_t window);
 extern char ssdv_dec_feed(ssdv_t *s, uint8_t *packet);
 extern char ssdv_dec_get_jpeg(ssdv_t *s, uint8_t **jpeg, size_t *length);
 
 extern char ssdv_dec_is_packet(uint8_t *packet, int *errors);
+
+/* As ssdv_dec_is_packet(), adding to the packet check counters in 'stats'
+ * when built with SSDV_STATS. Each thread or receiver can keep its own */
+extern char ssdv_dec_check_packet(uint8_t *packet, int *errors, ssdv_stats_t *stats);
+
 extern void ssdv_dec_header(ssdv_packet_info_t *info, uint8_t *packet);
 
+/* Profiling counters of an image, the packet check counters are left
+ * zero. Returns SSDV_ERROR, with the counters zero, without SSDV_STATS */
+extern char ssdv_get_stats(ssdv_t *s, ssdv_stats_t *stats);
+
+/* Decoding of streams containing more than one image */
+extern char ssdv_demux_init(ssdv_demux_t *d, size_t buffer_length, uint32_t timeout, ssdv_demux_callback_t callback, void *arg);
+extern char ssdv_demux_feed(ssdv_demux_t *d, uint8_t *packet);
+extern char ssdv_demux_flush(ssdv_demux_t *d);
+
+/* Merging the packets of several receivers */
+extern char ssdv_merge_init(ssdv_merge_t *m, uint32_t window, ssdv_merge_callback_t callback, void *arg);
+extern char ssdv_merge_feed(ssdv_merge_t *m, uint8_t *packet, int errors);
+extern char ssdv_merge_flush(ssdv_merge_t *m);
+
+/* Incremental decoding */
+extern char ssdv_live_init(ssdv_live_t *l);
+extern char ssdv_live_feed(ssdv_live_t *l, uint8_t *packet);
+extern char ssdv_live_get_jpeg(ssdv_live_t *l, uint8_t **jpeg, size_t *length);
+extern void ssdv_live_free(ssdv_live_t *l);
+
 #ifdef __cplusplus
 }
 #endif